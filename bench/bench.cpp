@@ -0,0 +1,335 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include <event2/event.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <atomic>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+namespace
+{
+std::atomic<uint64_t> g_allocations(0);
+std::atomic<int64_t> g_allocated_bytes(0);
+
+int64_t block_size(void* ptr)
+{
+#ifdef __GLIBC__
+    return ptr != nullptr ? static_cast<int64_t>(malloc_usable_size(ptr)) : 0;
+#else
+    (void)ptr;
+    return 0;
+#endif
+}
+
+void* counting_malloc(size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = malloc(size);
+    g_allocated_bytes.fetch_add(block_size(ptr), std::memory_order_relaxed);
+    return ptr;
+}
+
+void* counting_realloc(void* ptr, size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    const int64_t old_size = block_size(ptr);
+    void* ret = realloc(ptr, size);
+    if (ret != nullptr || size == 0)
+        g_allocated_bytes.fetch_add(block_size(ret) - old_size, std::memory_order_relaxed);
+    return ret;
+}
+
+void counting_free(void* ptr)
+{
+    g_allocated_bytes.fetch_sub(block_size(ptr), std::memory_order_relaxed);
+    free(ptr);
+}
+
+std::vector<std::pair<std::string, BenchFunction> >& registry()
+{
+    static std::vector<std::pair<std::string, BenchFunction> > benchmarks;
+    return benchmarks;
+}
+} // namespace
+
+void* operator new(size_t size)
+{
+    void* ptr = counting_malloc(size != 0 ? size : 1);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t& /*unused*/) noexcept
+{
+    return counting_malloc(size != 0 ? size : 1);
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    counting_free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t& /*unused*/) noexcept
+{
+    counting_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    counting_free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t& /*unused*/) noexcept
+{
+    counting_free(ptr);
+}
+
+uint64_t allocation_count()
+{
+    return g_allocations.load(std::memory_order_relaxed);
+}
+
+int64_t allocated_bytes()
+{
+    return g_allocated_bytes.load(std::memory_order_relaxed);
+}
+
+CBenchState::CBenchState(double min_seconds)
+    : m_min_seconds(min_seconds), m_started(false), m_paused(false), m_iterations(0), m_items(0), m_bytes(0), m_allocations(0), m_alloc_start(0), m_elapsed(0), m_fixed_elapsed(-1)
+{
+}
+
+bool CBenchState::KeepRunning()
+{
+    if (!m_started) {
+        m_started = true;
+        m_alloc_start = allocation_count();
+        m_start = clock::now();
+        return true;
+    }
+    ++m_iterations;
+    if (m_paused)
+        ResumeTiming();
+    if (m_fixed_elapsed >= 0) {
+        m_elapsed = m_fixed_elapsed;
+        m_allocations += allocation_count() - m_alloc_start;
+        return false;
+    }
+    const clock::time_point now = clock::now();
+    const double elapsed = m_elapsed + std::chrono::duration<double>(now - m_start).count();
+    if (elapsed < m_min_seconds)
+        return true;
+    m_elapsed = elapsed;
+    m_allocations += allocation_count() - m_alloc_start;
+    return false;
+}
+
+void CBenchState::PauseTiming()
+{
+    if (m_paused)
+        return;
+    m_paused = true;
+    m_elapsed += std::chrono::duration<double>(clock::now() - m_start).count();
+    m_allocations += allocation_count() - m_alloc_start;
+}
+
+void CBenchState::ResumeTiming()
+{
+    if (!m_paused)
+        return;
+    m_paused = false;
+    m_alloc_start = allocation_count();
+    m_start = clock::now();
+}
+
+void CBenchState::AddItems(uint64_t items)
+{
+    m_items += items;
+}
+
+void CBenchState::AddBytes(uint64_t bytes)
+{
+    m_bytes += bytes;
+}
+
+void CBenchState::SetElapsed(double seconds)
+{
+    m_fixed_elapsed = seconds;
+}
+
+void CBenchState::SetCounter(const std::string& name, double value)
+{
+    for (auto& counter : m_counters) {
+        if (counter.first == name) {
+            counter.second = value;
+            return;
+        }
+    }
+    m_counters.emplace_back(name, value);
+}
+
+uint64_t CBenchState::GetIterations() const
+{
+    return m_iterations;
+}
+
+uint64_t CBenchState::GetItems() const
+{
+    return m_items;
+}
+
+uint64_t CBenchState::GetBytes() const
+{
+    return m_bytes;
+}
+
+uint64_t CBenchState::GetAllocations() const
+{
+    return m_allocations;
+}
+
+double CBenchState::GetElapsed() const
+{
+    return m_elapsed;
+}
+
+const std::vector<std::pair<std::string, double> >& CBenchState::GetCounters() const
+{
+    return m_counters;
+}
+
+CHistogram::CHistogram()
+{
+    for (auto& count : m_buckets)
+        count.store(0, std::memory_order_relaxed);
+}
+
+// Values below 2^sub_bits get a bucket each. Above that, each power of two is
+// split into 2^sub_bits buckets.
+int CHistogram::bucket(uint64_t value)
+{
+    if (value < (uint64_t(1) << sub_bits))
+        return static_cast<int>(value);
+    int msb = 63;
+    while ((value >> msb) == 0)
+        --msb;
+    const int shift = msb - sub_bits;
+    return ((shift + 1) << sub_bits) + static_cast<int>((value >> shift) & ((1 << sub_bits) - 1));
+}
+
+uint64_t CHistogram::bucket_max(int index)
+{
+    if (index < (1 << sub_bits))
+        return static_cast<uint64_t>(index);
+    const int shift = (index >> sub_bits) - 1;
+    const uint64_t low = (uint64_t(1) << sub_bits | (index & ((1 << sub_bits) - 1))) << shift;
+    return low + ((uint64_t(1) << shift) - 1);
+}
+
+void CHistogram::Record(uint64_t ns)
+{
+    m_buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t CHistogram::GetCount() const
+{
+    uint64_t total = 0;
+    for (const auto& count : m_buckets)
+        total += count.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t CHistogram::GetPercentile(double fraction) const
+{
+    const uint64_t total = GetCount();
+    if (total == 0)
+        return 0;
+    uint64_t wanted = static_cast<uint64_t>(fraction * static_cast<double>(total));
+    if (wanted == 0)
+        wanted = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < num_buckets; ++i) {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen >= wanted)
+            return bucket_max(i);
+    }
+    return bucket_max(num_buckets - 1);
+}
+
+void RegisterBenchmark(const std::string& name, BenchFunction func)
+{
+    registry().emplace_back(name, std::move(func));
+}
+
+static void usage(const char* self)
+{
+    printf("Usage: %s [-time=<seconds>] [filter]\n", self);
+    printf("Runs every benchmark whose name contains filter, each for at least\n");
+    printf("the given time (default 0.5s).\n");
+}
+
+int main(int argc, char** argv)
+{
+    // Must come before anything else touches libevent.
+    event_set_mem_functions(counting_malloc, counting_realloc, counting_free);
+
+    double min_seconds = 0.5;
+    const char* filter = "";
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "-time=", 6) == 0) {
+            min_seconds = atof(argv[i] + 6);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    printf("%-52s %12s %10s %14s %10s %12s\n", "benchmark", "iterations", "ns/item", "items/s", "MB/s", "allocs/item");
+    for (const auto& bench : registry()) {
+        if (bench.first.find(filter) == std::string::npos)
+            continue;
+        CBenchState state(min_seconds);
+        bench.second(state);
+        const double elapsed = state.GetElapsed();
+        const double items = static_cast<double>(state.GetItems() != 0 ? state.GetItems() : state.GetIterations());
+        printf("%-52s %12llu %10.1f %14.0f %10.1f %12.3f\n", bench.first.c_str(),
+            static_cast<unsigned long long>(state.GetIterations()),
+            items != 0 ? elapsed * 1e9 / items : 0.0,
+            elapsed > 0 ? items / elapsed : 0.0,
+            elapsed > 0 ? static_cast<double>(state.GetBytes()) / elapsed / 1e6 : 0.0,
+            items != 0 ? static_cast<double>(state.GetAllocations()) / items : 0.0);
+        if (!state.GetCounters().empty()) {
+            printf("   ");
+            for (const auto& counter : state.GetCounters())
+                printf(" %s=%.2f", counter.first.c_str(), counter.second);
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_BENCH_BENCH_H
+#define LIBBTCNET_BENCH_BENCH_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Counts every allocation made through operator new or libevent's allocator.
+uint64_t allocation_count();
+
+// Bytes currently held in blocks from the same allocators. Always 0 where the
+// C library can't report a block's size.
+int64_t allocated_bytes();
+
+// Passed to each benchmark, which runs its body for as long as KeepRunning()
+// returns true:
+//
+//     while (state.KeepRunning()) {
+//         state.PauseTiming();
+//         ...setup...
+//         state.ResumeTiming();
+//         ...measured code...
+//         state.AddItems(messages);
+//         state.AddBytes(bytes);
+//     }
+//
+// Allocations made while timing is paused are not counted either.
+class CBenchState
+{
+public:
+    explicit CBenchState(double min_seconds);
+
+    bool KeepRunning();
+    void PauseTiming();
+    void ResumeTiming();
+    void AddItems(uint64_t items);
+    void AddBytes(uint64_t bytes);
+
+    // For benchmarks that time themselves. The next KeepRunning() returns
+    // false and reports seconds as the elapsed time.
+    void SetElapsed(double seconds);
+
+    // Report an extra figure alongside the standard ones.
+    void SetCounter(const std::string& name, double value);
+
+    uint64_t GetIterations() const;
+    uint64_t GetItems() const;
+    uint64_t GetBytes() const;
+    uint64_t GetAllocations() const;
+    double GetElapsed() const;
+    const std::vector<std::pair<std::string, double> >& GetCounters() const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    const double m_min_seconds;
+    bool m_started;
+    bool m_paused;
+    uint64_t m_iterations;
+    uint64_t m_items;
+    uint64_t m_bytes;
+    uint64_t m_allocations;
+    uint64_t m_alloc_start;
+    double m_elapsed;
+    double m_fixed_elapsed;
+    clock::time_point m_start;
+    std::vector<std::pair<std::string, double> > m_counters;
+};
+
+// Log-linear histogram of durations in nanoseconds, accurate to within 1/16th
+// of a value. Samples may be recorded from several threads at once.
+class CHistogram
+{
+public:
+    CHistogram();
+
+    void Record(uint64_t ns);
+    uint64_t GetCount() const;
+
+    // Returns the smallest value that fraction (0 to 1) of samples are below
+    // or equal to, or 0 if nothing has been recorded.
+    uint64_t GetPercentile(double fraction) const;
+
+private:
+    static constexpr int sub_bits = 4;
+    static constexpr int num_buckets = (64 - sub_bits + 1) << sub_bits;
+    static int bucket(uint64_t value);
+    static uint64_t bucket_max(int index);
+
+    std::atomic<uint64_t> m_buckets[num_buckets];
+
+    CHistogram(const CHistogram&) = delete;
+    CHistogram& operator=(const CHistogram&) = delete;
+};
+
+typedef std::function<void(CBenchState&)> BenchFunction;
+
+void RegisterBenchmark(const std::string& name, BenchFunction func);
+
+// Register a benchmark from namespace scope.
+struct CBenchRegistration {
+    CBenchRegistration(const std::string& name, BenchFunction func)
+    {
+        RegisterBenchmark(name, std::move(func));
+    }
+};
+
+#endif // LIBBTCNET_BENCH_BENCH_H
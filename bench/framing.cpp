@@ -0,0 +1,296 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// The receive path: finding message boundaries in the input buffer and moving
+// complete messages out of it, as the read callbacks do on every read.
+
+#include "bench.h"
+
+#include "libbtcnet/handler.h"
+#include "libbtcnet/networkconfig.h"
+#include "src/eventtypes.h"
+#include "src/framer.h"
+#include "src/message.h"
+#include "src/messagestorage.h"
+#include "src/received.h"
+
+#include <event2/buffer.h>
+
+#include <assert.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+// The size of a TCP segment's payload on a typical link.
+constexpr size_t g_segment_size = 1460;
+constexpr int g_chunk_size = 4096;
+
+enum Layout {
+    CONTIGUOUS,
+    FRAGMENTED
+};
+
+struct CProfile {
+    const char* name;
+    std::vector<size_t> payloads;
+    size_t count;
+};
+
+// Messages per read: many small control messages, a typical relay mix of
+// inv/tx/addr sizes, and a few large block-sized messages.
+const CProfile g_profiles[] = {
+    {"small", {8}, 1000},
+    {"mixed", {8, 37, 61, 250, 370, 500, 1000, 1081}, 1000},
+    {"large", {250000}, 4},
+};
+
+CNetworkConfig bitcoin_config()
+{
+    CNetworkConfig config;
+    config.header_msg_size_offset = 16;
+    config.header_msg_size_size = 4;
+    config.header_msg_size_encoding = CNetworkConfig::SIZE_LITTLE_ENDIAN;
+    config.header_size = 24;
+    config.message_max_size = 1000000 + config.header_size;
+    config.message_start = {0xf9, 0xbe, 0xb4, 0xd9};
+    return config;
+}
+
+// count messages, cycling through payload sizes, serialized back to back.
+std::vector<unsigned char> make_stream(const CNetworkConfig& config, const std::vector<size_t>& payloads, size_t count)
+{
+    std::vector<unsigned char> stream;
+    for (size_t i = 0; i < count; ++i) {
+        const size_t payload = payloads[i % payloads.size()];
+        const size_t start = stream.size();
+        stream.resize(start + config.header_size + payload, static_cast<unsigned char>(i));
+        unsigned char* header = &stream[start];
+        memcpy(header, config.message_start.data(), config.message_start.size());
+        memset(header + 4, 0, 12);
+        for (int j = 0; j < 4; ++j)
+            header[config.header_msg_size_offset + j] = static_cast<unsigned char>(payload >> (8 * j));
+    }
+    return stream;
+}
+
+// Fragmented buffers reference the stream in segment-sized pieces, each in a
+// chain of its own, as bytes trickle in from the network.
+event_type<evbuffer> make_buffer(const std::vector<unsigned char>& stream, Layout layout, size_t segment = g_segment_size)
+{
+    event_type<evbuffer> buf(evbuffer_new());
+    if (layout == CONTIGUOUS) {
+        evbuffer_add(buf, stream.data(), stream.size());
+        return buf;
+    }
+    for (size_t offset = 0; offset < stream.size(); offset += segment) {
+        const size_t len = std::min(segment, stream.size() - offset);
+        evbuffer_add_reference(buf, stream.data() + offset, len, nullptr, nullptr);
+    }
+    return buf;
+}
+
+const char* layout_name(Layout layout)
+{
+    return layout == CONTIGUOUS ? "contiguous" : "fragmented";
+}
+
+const char* delivery_name(CHandlerOptions::Delivery delivery)
+{
+    switch (delivery) {
+    case CHandlerOptions::DELIVER_VECTORS:
+        return "vectors";
+    case CHandlerOptions::DELIVER_BUFFERS:
+        return "buffers";
+    case CHandlerOptions::DELIVER_POOLED:
+        return "pooled";
+    case CHandlerOptions::DELIVER_BATCH:
+        return "batch";
+    }
+    return "unknown";
+}
+
+// Repeatedly size the first message in a buffer. Fragmented buffers split the
+// header across chains, which forces it to be copied out.
+void bench_first_message_size(CBenchState& state, Layout layout)
+{
+    const CNetworkConfig config = bitcoin_config();
+    const std::vector<unsigned char> stream = make_stream(config, {250}, 1);
+    event_type<evbuffer> buf = make_buffer(stream, layout, 7);
+    const size_t calls = 1000;
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < calls; ++i) {
+            bool fComplete = false;
+            bool fBadMsgStart = false;
+            uint64_t size = first_complete_message_size(config, buf, fComplete, fBadMsgStart);
+            assert(size == stream.size() && fComplete && !fBadMsgStart);
+            (void)size;
+        }
+        state.AddItems(calls);
+    }
+}
+
+// What read_cb_message does with a read's worth of data: find the complete
+// messages, remove them, and hand them over. Handing them over includes
+// releasing them, as an application would once it's done.
+void bench_extract(CBenchState& state, const CProfile& profile, Layout layout, CHandlerOptions::Delivery delivery)
+{
+    const CNetworkConfig config = bitcoin_config();
+    const std::vector<unsigned char> stream = make_stream(config, profile.payloads, profile.count);
+    CMessagePool* pool = new CMessagePool(true);
+    std::vector<size_t> sizes;
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        event_type<evbuffer> input = make_buffer(stream, layout);
+        state.ResumeTiming();
+        {
+            CReceivedMessages received;
+            CFrameState frame;
+            bool fBadMsgStart = false;
+            bool fTooBig = false;
+            sizes.clear();
+            find_complete_messages<CLE32Framer>(config, input, frame, sizes, received.totalsize, fBadMsgStart, fTooBig);
+            assert(sizes.size() == profile.count && !fBadMsgStart && !fTooBig);
+            received.extract(input, sizes, delivery, pool);
+        }
+        state.AddItems(sizes.size());
+        state.AddBytes(stream.size());
+        state.PauseTiming();
+        input.free();
+        state.ResumeTiming();
+    }
+    pool->Release();
+}
+
+// A large message trickling in a segment at a time, with its header split
+// across the first two, and the input checked for complete messages after
+// each. Without the frame state carried from one check to the next, each
+// parses the header again.
+void bench_trickle(CBenchState& state, bool carry_state)
+{
+    const CNetworkConfig config = bitcoin_config();
+    const std::vector<unsigned char> stream = make_stream(config, {1000000}, 1);
+    std::vector<size_t> sizes;
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        event_type<evbuffer> input(evbuffer_new());
+        state.ResumeTiming();
+        CFrameState frame;
+        size_t checks = 0;
+        size_t segment = 7;
+        for (size_t offset = 0; offset < stream.size(); offset += segment, segment = g_segment_size) {
+            state.PauseTiming();
+            evbuffer_add_reference(input, stream.data() + offset, std::min(segment, stream.size() - offset), nullptr, nullptr);
+            state.ResumeTiming();
+            if (!carry_state)
+                frame = CFrameState();
+            size_t totalsize = 0;
+            bool fBadMsgStart = false;
+            bool fTooBig = false;
+            sizes.clear();
+            find_complete_messages<CLE32Framer>(config, input, frame, sizes, totalsize, fBadMsgStart, fTooBig);
+            assert(!fBadMsgStart && !fTooBig);
+            ++checks;
+        }
+        assert(sizes.size() == 1);
+        state.AddItems(checks);
+        state.PauseTiming();
+        input.free();
+        state.ResumeTiming();
+    }
+}
+
+// Finding the next message_start past a megabyte of garbage, as a connection
+// resynchronising after a bad message does, against evbuffer_search.
+void bench_resync(CBenchState& state, Layout layout, bool scan)
+{
+    const CNetworkConfig config = bitcoin_config();
+    std::vector<unsigned char> stream(1000000);
+    uint32_t seed = 1;
+    for (unsigned char& byte : stream) {
+        seed = seed * 1103515245 + 12345;
+        byte = static_cast<unsigned char>(seed >> 16);
+    }
+    const std::vector<unsigned char> message = make_stream(config, {8}, 1);
+    stream.insert(stream.end(), message.begin(), message.end());
+    const event_type<evbuffer> input = make_buffer(stream, layout);
+    const size_t expected = stream.size() - message.size();
+    while (state.KeepRunning()) {
+        size_t skip;
+        if (scan) {
+            skip = resync_skip(config, input);
+        } else {
+            evbuffer_ptr pos;
+            evbuffer_ptr_set(input, &pos, 1, EVBUFFER_PTR_SET);
+            skip = evbuffer_search(input, reinterpret_cast<const char*>(config.message_start.data()), config.message_start.size(), &pos).pos;
+        }
+        assert(skip == expected);
+        (void)skip;
+        (void)expected;
+        state.AddItems(1);
+        state.AddBytes(expected);
+    }
+}
+
+// What read_cb_chunk does with a read's worth of fixed-size chunks.
+void bench_chunks(CBenchState& state, Layout layout, CHandlerOptions::Delivery delivery)
+{
+    const size_t count = 256;
+    const std::vector<unsigned char> stream(count * g_chunk_size, 0x5a);
+    CMessagePool* pool = new CMessagePool(true);
+    std::vector<size_t> sizes;
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        event_type<evbuffer> input = make_buffer(stream, layout);
+        state.ResumeTiming();
+        {
+            CReceivedMessages received;
+            sizes.assign(evbuffer_get_length(input) / g_chunk_size, g_chunk_size);
+            received.totalsize = sizes.size() * g_chunk_size;
+            received.extract(input, sizes, delivery, pool);
+        }
+        state.AddItems(count);
+        state.AddBytes(stream.size());
+        state.PauseTiming();
+        input.free();
+        state.ResumeTiming();
+    }
+    pool->Release();
+}
+
+struct CFramingBenchmarks {
+    CFramingBenchmarks()
+    {
+        const Layout layouts[] = {CONTIGUOUS, FRAGMENTED};
+        const CHandlerOptions::Delivery deliveries[] = {CHandlerOptions::DELIVER_VECTORS, CHandlerOptions::DELIVER_BUFFERS, CHandlerOptions::DELIVER_POOLED, CHandlerOptions::DELIVER_BATCH};
+
+        for (Layout layout : layouts)
+            RegisterBenchmark(std::string("first_complete_message_size/") + layout_name(layout), std::bind(bench_first_message_size, std::placeholders::_1, layout));
+
+        RegisterBenchmark("read_message/trickle/reparse", std::bind(bench_trickle, std::placeholders::_1, false));
+        RegisterBenchmark("read_message/trickle/cached", std::bind(bench_trickle, std::placeholders::_1, true));
+
+        for (Layout layout : layouts) {
+            RegisterBenchmark(std::string("resync/") + layout_name(layout) + "/evbuffer_search", std::bind(bench_resync, std::placeholders::_1, layout, false));
+            RegisterBenchmark(std::string("resync/") + layout_name(layout) + "/find_bytes", std::bind(bench_resync, std::placeholders::_1, layout, true));
+        }
+
+        for (const CProfile& profile : g_profiles) {
+            for (Layout layout : layouts) {
+                for (CHandlerOptions::Delivery delivery : deliveries) {
+                    std::string name = std::string("read_message/") + profile.name + "/" + layout_name(layout) + "/" + delivery_name(delivery);
+                    RegisterBenchmark(name, std::bind(bench_extract, std::placeholders::_1, std::cref(profile), layout, delivery));
+                }
+            }
+        }
+
+        for (Layout layout : layouts) {
+            for (CHandlerOptions::Delivery delivery : deliveries) {
+                std::string name = std::string("read_chunk/") + layout_name(layout) + "/" + delivery_name(delivery);
+                RegisterBenchmark(name, std::bind(bench_chunks, std::placeholders::_1, layout, delivery));
+            }
+        }
+    }
+} g_framing_benchmarks;
+} // namespace
@@ -0,0 +1,370 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// End-to-end benchmarks over the loopback interface. A single handler binds,
+// connects to itself, and then either bounces messages back and forth or
+// streams them in one direction. Both ends live in this process, so CPU time
+// covers sending and receiving.
+
+#include "bench.h"
+
+#include "libbtcnet/connection.h"
+#include "libbtcnet/handler.h"
+#include "libbtcnet/networkconfig.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+constexpr unsigned short g_port = 28445;
+const char* const g_socket_path = "/tmp/btcnet_bench.sock";
+constexpr size_t g_header_size = 24;
+
+// The first byte of the command field tells the two ends apart.
+constexpr unsigned char CMD_PING = 'p';
+constexpr unsigned char CMD_PONG = 'o';
+constexpr unsigned char CMD_DATA = 'd';
+constexpr unsigned char CMD_ACK = 'a';
+
+enum Pattern {
+    PINGPONG,
+    STREAM
+};
+
+enum Transport {
+    TCP,
+    UNIX
+};
+
+enum Threading {
+    UNTHREADED,
+    THREADED,
+    SHARDED
+};
+
+enum Engine {
+    BUFFEREVENT,
+    URING,
+    // Whitelisted, with fWhitelistFastPath.
+    RAW,
+    // Bufferevents, with large messages read by nDirectReadSize.
+    DIRECT
+};
+
+struct CLoopbackParams {
+    Pattern pattern;
+    Transport transport;
+    Threading threading;
+    int connections;
+    size_t payload;
+    // Messages in flight per connection when streaming.
+    int window;
+    Engine engine;
+};
+
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double cpu_seconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+CNetworkConfig bench_config()
+{
+    CNetworkConfig config;
+    config.header_msg_size_offset = 16;
+    config.header_msg_size_size = 4;
+    config.header_msg_size_encoding = CNetworkConfig::SIZE_LITTLE_ENDIAN;
+    config.header_size = g_header_size;
+    config.message_max_size = 4000000 + g_header_size;
+    config.message_start = {0xf9, 0xbe, 0xb4, 0xd9};
+    config.chunk_size = 0;
+    config.protocol_version = 0;
+    config.protocol_handshake_version = 0;
+    config.service_flags = 0;
+    return config;
+}
+
+class CLoopbackBench final : public CConnectionHandler
+{
+public:
+    CLoopbackBench(const CLoopbackParams& params, double seconds)
+        : CConnectionHandler(params.threading != UNTHREADED), m_params(params), m_seconds(seconds), m_requested(0), m_ready(0), m_start_ns(0), m_deadline_ns(0), m_start_cpu(0), m_elapsed(0), m_cpu(0), m_messages(0), m_bytes(0), m_stopping(false), m_errors(0)
+    {
+    }
+
+    void Run()
+    {
+        CHandlerOptions opts;
+        if (m_params.threading == SHARDED) {
+            opts.nShards = 2;
+            opts.nDispatch = CHandlerOptions::DISPATCH_PER_SHARD;
+        }
+        if (m_params.engine == URING)
+            opts.nIOEngine = CHandlerOptions::IO_URING;
+        opts.fWhitelistFastPath = m_params.engine == RAW;
+        if (m_params.engine == DIRECT)
+            opts.nDirectReadSize = 32 * 1024;
+        Start(m_params.connections, opts);
+        while (PumpEvents(true)) {
+        }
+    }
+
+    const CHistogram& GetLatency() const { return m_latency; }
+    double GetElapsed() const { return m_elapsed; }
+    double GetCPU() const { return m_cpu; }
+    uint64_t GetMessages() const { return m_messages.load(); }
+    uint64_t GetBytes() const { return m_bytes.load(); }
+    int GetErrors() const { return m_errors.load(); }
+
+protected:
+    CConnection MakeConnection() const
+    {
+        CConnectionOptions opts;
+        opts.fWhitelisted = m_params.engine == RAW;
+        if (m_params.transport == UNIX) {
+            opts.nFamily = CConnectionOptions::UNIX;
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, g_socket_path, sizeof(addr.sun_path) - 1);
+            return CConnection(opts, bench_config(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        }
+        opts.nFamily = CConnectionOptions::IPV4;
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(g_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return CConnection(opts, bench_config(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    }
+
+    void OnStartup() final
+    {
+        if (m_params.transport == UNIX)
+            unlink(g_socket_path);
+        if (!Bind(MakeConnection())) {
+            m_errors++;
+            Shutdown();
+        }
+    }
+
+    std::list<CConnection> OnNeedOutgoingConnections(int need) final
+    {
+        std::list<CConnection> ret;
+        for (; need > 0 && m_requested < m_params.connections; --need, ++m_requested)
+            ret.push_back(MakeConnection());
+        return ret;
+    }
+
+    bool OnIncomingConnection(ConnID /*id*/, const CConnection& /*bind*/, const CConnection& /*resolved*/) final { return true; }
+    bool OnOutgoingConnection(ConnID /*id*/, const CConnection& /*conn*/, const CConnection& /*resolved*/) final { return true; }
+
+    void OnReadyForFirstSend(ConnID id) final
+    {
+        // Measure from the point every connection is up.
+        m_ready_ids.push_back(id);
+        if (++m_ready < m_params.connections)
+            return;
+        m_start_cpu = cpu_seconds();
+        m_start_ns = now_ns();
+        m_deadline_ns = m_start_ns + static_cast<uint64_t>(m_seconds * 1e9);
+        const int burst = m_params.pattern == PINGPONG ? 1 : m_params.window;
+        for (ConnID ready : m_ready_ids) {
+            for (int i = 0; i < burst; ++i)
+                SendMessage(ready, m_params.pattern == PINGPONG ? CMD_PING : CMD_DATA, m_params.payload);
+        }
+    }
+
+    bool OnReceiveMessages(ConnID id, std::list<std::vector<unsigned char> > msgs, size_t totalsize) final
+    {
+        const uint64_t now = now_ns();
+        uint32_t acks = 0;
+        for (auto& msg : msgs) {
+            if (msg.size() < g_header_size + 8) {
+                m_errors++;
+                continue;
+            }
+            const unsigned char cmd = msg[4];
+            uint64_t sent = 0;
+            memcpy(&sent, &msg[g_header_size], sizeof(sent));
+            if (cmd == CMD_PING) {
+                msg[4] = CMD_PONG;
+                Send(id, msg.data(), msg.size());
+            } else if (cmd == CMD_PONG) {
+                Complete(now, sent, 2 * msg.size());
+                if (!m_stopping)
+                    SendMessage(id, CMD_PING, m_params.payload);
+            } else if (cmd == CMD_DATA) {
+                Complete(now, sent, msg.size());
+                acks++;
+            } else if (cmd == CMD_ACK) {
+                uint32_t count = 0;
+                memcpy(&count, &msg[g_header_size + 8], sizeof(count));
+                for (uint32_t i = 0; i < count && !m_stopping; ++i)
+                    SendMessage(id, CMD_DATA, m_params.payload);
+            }
+        }
+        // Return credit to the sender once per read.
+        if (acks != 0) {
+            std::vector<unsigned char> ack = MakeMessage(CMD_ACK, 12);
+            memcpy(&ack[g_header_size + 8], &acks, sizeof(acks));
+            Send(id, ack.data(), ack.size());
+        }
+        if (now >= m_deadline_ns && m_deadline_ns != 0 && !m_stopping.exchange(true)) {
+            m_elapsed = (now - m_start_ns) / 1e9;
+            m_cpu = cpu_seconds() - m_start_cpu;
+            Shutdown();
+        }
+        return true;
+    }
+
+    void OnDnsResponse(const CConnection& /*conn*/, std::list<CConnection> /*results*/) final {}
+    bool OnConnectionFailure(const CConnection& /*conn*/, const CConnection& /*resolved*/, bool /*retry*/) final
+    {
+        m_errors++;
+        Shutdown();
+        return false;
+    }
+    bool OnDisconnected(ConnID /*id*/, bool /*persistent*/) final { return false; }
+    void OnBindFailure(const CConnection& /*bind*/) final { m_errors++; }
+    bool OnDnsFailure(const CConnection& /*conn*/, bool /*retry*/) final { return false; }
+    void OnWriteBufferFull(ConnID /*id*/, size_t /*bufsize*/) final {}
+    void OnWriteBufferReady(ConnID /*id*/, size_t /*bufsize*/) final {}
+    void OnMalformedMessage(ConnID /*id*/) final { m_errors++; }
+    bool OnProxyFailure(const CConnection& /*conn*/, bool /*retry*/) final { return false; }
+    void OnBytesRead(ConnID /*id*/, size_t /*bytes*/, size_t /*total_bytes*/) final {}
+    void OnBytesWritten(ConnID /*id*/, size_t /*bytes*/, size_t /*total_bytes*/) final {}
+    void OnPingTimeout(ConnID /*id*/) final {}
+    void OnShutdown() final
+    {
+        if (m_params.transport == UNIX)
+            unlink(g_socket_path);
+    }
+
+private:
+    static std::vector<unsigned char> MakeMessage(unsigned char cmd, size_t payload)
+    {
+        std::vector<unsigned char> msg(g_header_size + payload);
+        const unsigned char start[] = {0xf9, 0xbe, 0xb4, 0xd9};
+        memcpy(&msg[0], start, sizeof(start));
+        msg[4] = cmd;
+        for (int i = 0; i < 4; ++i)
+            msg[16 + i] = static_cast<unsigned char>(payload >> (8 * i));
+        return msg;
+    }
+
+    void SendMessage(ConnID id, unsigned char cmd, size_t payload)
+    {
+        std::vector<unsigned char> msg = MakeMessage(cmd, payload);
+        const uint64_t sent = now_ns();
+        memcpy(&msg[g_header_size], &sent, sizeof(sent));
+        Send(id, msg.data(), msg.size());
+    }
+
+    void Complete(uint64_t now, uint64_t sent, size_t bytes)
+    {
+        if (m_stopping)
+            return;
+        m_latency.Record(now - sent);
+        m_messages++;
+        m_bytes += bytes;
+    }
+
+    const CLoopbackParams m_params;
+    const double m_seconds;
+    int m_requested;
+    int m_ready;
+    std::vector<ConnID> m_ready_ids;
+    uint64_t m_start_ns;
+    std::atomic<uint64_t> m_deadline_ns;
+    double m_start_cpu;
+    double m_elapsed;
+    double m_cpu;
+    std::atomic<uint64_t> m_messages;
+    std::atomic<uint64_t> m_bytes;
+    std::atomic<bool> m_stopping;
+    std::atomic<int> m_errors;
+    CHistogram m_latency;
+};
+
+void bench_loopback(CBenchState& state, CLoopbackParams params, double seconds)
+{
+    while (state.KeepRunning()) {
+        CLoopbackBench bench(params, seconds);
+        bench.Run();
+        if (bench.GetErrors() != 0 || bench.GetElapsed() == 0) {
+            printf("loopback benchmark failed\n");
+            return;
+        }
+        state.SetElapsed(bench.GetElapsed());
+        state.AddItems(bench.GetMessages());
+        state.AddBytes(bench.GetBytes());
+
+        const CHistogram& latency = bench.GetLatency();
+        const char* prefix = params.pattern == PINGPONG ? "rtt_" : "latency_";
+        state.SetCounter(std::string(prefix) + "p50_us", latency.GetPercentile(0.5) / 1e3);
+        state.SetCounter(std::string(prefix) + "p99_us", latency.GetPercentile(0.99) / 1e3);
+        state.SetCounter(std::string(prefix) + "p999_us", latency.GetPercentile(0.999) / 1e3);
+        state.SetCounter("cpu_s_per_gb", bench.GetCPU() / (bench.GetBytes() / 1e9));
+    }
+}
+
+struct CLoopbackBenchmarks {
+    CLoopbackBenchmarks()
+    {
+        // Each run lasts about this long, regardless of -time.
+        const double seconds = 1.0;
+        const Threading threadings[] = {UNTHREADED, THREADED, SHARDED};
+        const char* const threading_names[] = {"unthreaded", "threaded", "sharded"};
+        const Transport transports[] = {TCP, UNIX};
+        const char* const transport_names[] = {"tcp", "unix"};
+
+        // The other engines only over TCP, as they treat unix sockets no
+        // differently.
+        const Engine engines[] = {BUFFEREVENT, URING, RAW, DIRECT};
+        const char* const engine_names[] = {"", "/uring", "/raw", "/direct"};
+
+        for (int e = 0; e < 4; ++e) {
+            for (int t = 0; t < (engines[e] == BUFFEREVENT ? 2 : 1); ++t) {
+                for (int th = 0; th < 3; ++th) {
+                    const std::string suffix = std::string(transport_names[t]) + "/" + threading_names[th] + engine_names[e];
+                    CLoopbackParams stream_large = {STREAM, transports[t], threadings[th], 4, 65536, 8, engines[e]};
+                    RegisterBenchmark("loopback/stream/64k/k4/" + suffix, std::bind(bench_loopback, std::placeholders::_1, stream_large, seconds));
+                    CLoopbackParams stream_huge = {STREAM, transports[t], threadings[th], 4, 1024 * 1024, 2, engines[e]};
+                    RegisterBenchmark("loopback/stream/1m/k4/" + suffix, std::bind(bench_loopback, std::placeholders::_1, stream_huge, seconds));
+                    // Nothing smaller is read directly.
+                    if (engines[e] == DIRECT)
+                        continue;
+                    CLoopbackParams pingpong = {PINGPONG, transports[t], threadings[th], 1, 64, 1, engines[e]};
+                    RegisterBenchmark("loopback/pingpong/64b/k1/" + suffix, std::bind(bench_loopback, std::placeholders::_1, pingpong, seconds));
+                    CLoopbackParams pingpong_many = {PINGPONG, transports[t], threadings[th], 16, 64, 1, engines[e]};
+                    RegisterBenchmark("loopback/pingpong/64b/k16/" + suffix, std::bind(bench_loopback, std::placeholders::_1, pingpong_many, seconds));
+                    CLoopbackParams stream = {STREAM, transports[t], threadings[th], 4, 1024, 64, engines[e]};
+                    RegisterBenchmark("loopback/stream/1k/k4/" + suffix, std::bind(bench_loopback, std::placeholders::_1, stream, seconds));
+                }
+            }
+        }
+    }
+} g_loopback_benchmarks;
+} // namespace
@@ -0,0 +1,334 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Connection setup and teardown benchmarks. A single handler binds and dials
+// itself, so every connection passes through both CDirectConnection::Connect
+// and the listener's accept path into OnIncomingConnection.
+//
+// Cycle runs close each connection as soon as it is up and immediately dial
+// another, which is what an inbound flood or a reconnect storm looks like.
+// Hold runs open a fixed number of connections and report the heap they pin.
+
+#include "bench.h"
+
+#include "libbtcnet/connection.h"
+#include "libbtcnet/handler.h"
+#include "libbtcnet/networkconfig.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <deque>
+#include <list>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace
+{
+constexpr unsigned short g_port = 28446;
+const char* const g_socket_path = "/tmp/btcnet_bench_storm.sock";
+
+enum Mode {
+    CYCLE,
+    HOLD
+};
+
+enum Transport {
+    TCP,
+    UNIX
+};
+
+enum Threading {
+    UNTHREADED,
+    THREADED,
+    SHARDED
+};
+
+struct CStormParams {
+    Mode mode;
+    Transport transport;
+    Threading threading;
+    // Outgoing connections open at once. Cycle runs are also bounded by how
+    // many connections the handler will have connecting at a time.
+    int connections;
+};
+
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double cpu_seconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+CNetworkConfig bench_config()
+{
+    CNetworkConfig config;
+    config.header_msg_size_offset = 16;
+    config.header_msg_size_size = 4;
+    config.header_msg_size_encoding = CNetworkConfig::SIZE_LITTLE_ENDIAN;
+    config.header_size = 24;
+    config.message_max_size = 4000000 + 24;
+    config.message_start = {0xf9, 0xbe, 0xb4, 0xd9};
+    config.chunk_size = 0;
+    config.protocol_version = 0;
+    config.protocol_handshake_version = 0;
+    config.service_flags = 0;
+    return config;
+}
+
+class CStormBench final : public CConnectionHandler
+{
+public:
+    CStormBench(const CStormParams& params, double seconds)
+        : CConnectionHandler(params.threading != UNTHREADED), m_params(params), m_seconds(seconds), m_requested(0), m_accepted(0), m_ready(0), m_start_ns(0), m_deadline_ns(0), m_start_cpu(0), m_start_allocations(0), m_start_bytes(0), m_elapsed(0), m_cpu(0), m_allocations(0), m_bytes(0), m_stopping(false), m_errors(0)
+    {
+    }
+
+    void Run()
+    {
+        CHandlerOptions opts;
+        if (m_params.threading == SHARDED) {
+            opts.nShards = 2;
+            opts.nDispatch = CHandlerOptions::DISPATCH_PER_SHARD;
+        }
+        Start(m_params.connections, opts);
+        while (PumpEvents(true)) {
+        }
+    }
+
+    const CHistogram& GetLatency() const { return m_latency; }
+    double GetElapsed() const { return m_elapsed; }
+    double GetCPU() const { return m_cpu; }
+    uint64_t GetAccepted() const { return m_accepted; }
+    uint64_t GetAllocations() const { return m_allocations; }
+    int64_t GetBytes() const { return m_bytes; }
+    int GetErrors() const { return m_errors; }
+
+protected:
+    CConnection MakeConnection() const
+    {
+        CConnectionOptions opts;
+        if (m_params.transport == UNIX) {
+            opts.nFamily = CConnectionOptions::UNIX;
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, g_socket_path, sizeof(addr.sun_path) - 1);
+            return CConnection(opts, bench_config(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        }
+        opts.nFamily = CConnectionOptions::IPV4;
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(g_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return CConnection(opts, bench_config(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    }
+
+    void OnStartup() final
+    {
+        if (m_params.transport == UNIX)
+            unlink(g_socket_path);
+        if (!Bind(MakeConnection())) {
+            m_errors++;
+            Shutdown();
+            return;
+        }
+        m_start_cpu = cpu_seconds();
+        m_start_allocations = allocation_count();
+        m_start_bytes = allocated_bytes();
+        m_start_ns = now_ns();
+        m_deadline_ns = m_start_ns + static_cast<uint64_t>(m_seconds * 1e9);
+    }
+
+    std::list<CConnection> OnNeedOutgoingConnections(int need) final
+    {
+        std::list<CConnection> ret;
+        for (; need > 0 && !m_stopping; --need) {
+            if (m_params.mode == HOLD && m_requested == m_params.connections)
+                break;
+            ret.push_back(MakeConnection());
+            m_dialed.push_back(now_ns());
+            m_requested++;
+        }
+        return ret;
+    }
+
+    bool OnIncomingConnection(ConnID /*id*/, const CConnection& /*bind*/, const CConnection& /*resolved*/) final
+    {
+        // Connects are issued in order and loopback handshakes complete in
+        // the kernel before connect() returns, so accepts arrive in the order
+        // they were dialed.
+        const uint64_t now = now_ns();
+        if (m_dialed.empty()) {
+            m_errors++;
+            return false;
+        }
+        if (!m_stopping) {
+            m_latency.Record(now - m_dialed.front());
+            m_accepted++;
+        }
+        m_dialed.pop_front();
+        if (m_params.mode == CYCLE && now >= m_deadline_ns)
+            Finish(now);
+        else if (m_params.mode == HOLD)
+            CheckHeld(now);
+        return true;
+    }
+
+    bool OnOutgoingConnection(ConnID /*id*/, const CConnection& /*conn*/, const CConnection& /*resolved*/) final { return true; }
+
+    void OnReadyForFirstSend(ConnID id) final
+    {
+        if (m_params.mode == CYCLE) {
+            CloseConnection(id, true);
+        } else {
+            m_ready++;
+            CheckHeld(now_ns());
+        }
+    }
+
+    bool OnReceiveMessages(ConnID /*id*/, std::list<std::vector<unsigned char> > /*msgs*/, size_t /*totalsize*/) final { return true; }
+    void OnDnsResponse(const CConnection& /*conn*/, std::list<CConnection> /*results*/) final {}
+    bool OnConnectionFailure(const CConnection& /*conn*/, const CConnection& /*resolved*/, bool /*retry*/) final
+    {
+        // Dials still in progress are cancelled on shutdown.
+        if (!m_stopping) {
+            m_errors++;
+            Shutdown();
+        }
+        return false;
+    }
+    bool OnDisconnected(ConnID /*id*/, bool /*persistent*/) final { return false; }
+    void OnBindFailure(const CConnection& /*bind*/) final { m_errors++; }
+    bool OnDnsFailure(const CConnection& /*conn*/, bool /*retry*/) final { return false; }
+    void OnWriteBufferFull(ConnID /*id*/, size_t /*bufsize*/) final {}
+    void OnWriteBufferReady(ConnID /*id*/, size_t /*bufsize*/) final {}
+    void OnMalformedMessage(ConnID /*id*/) final { m_errors++; }
+    bool OnProxyFailure(const CConnection& /*conn*/, bool /*retry*/) final { return false; }
+    void OnBytesRead(ConnID /*id*/, size_t /*bytes*/, size_t /*total_bytes*/) final {}
+    void OnBytesWritten(ConnID /*id*/, size_t /*bytes*/, size_t /*total_bytes*/) final {}
+    void OnPingTimeout(ConnID /*id*/) final {}
+    void OnShutdown() final
+    {
+        if (m_params.transport == UNIX)
+            unlink(g_socket_path);
+    }
+
+private:
+    void CheckHeld(uint64_t now)
+    {
+        if (m_accepted == static_cast<uint64_t>(m_params.connections) && m_ready == m_params.connections)
+            Finish(now);
+    }
+
+    void Finish(uint64_t now)
+    {
+        if (m_stopping)
+            return;
+        m_stopping = true;
+        m_elapsed = (now - m_start_ns) / 1e9;
+        m_cpu = cpu_seconds() - m_start_cpu;
+        m_allocations = allocation_count() - m_start_allocations;
+        m_bytes = allocated_bytes() - m_start_bytes;
+        Shutdown();
+    }
+
+    const CStormParams m_params;
+    const double m_seconds;
+    int m_requested;
+    uint64_t m_accepted;
+    int m_ready;
+    // When each outstanding dial was handed to the handler, oldest first.
+    std::deque<uint64_t> m_dialed;
+    uint64_t m_start_ns;
+    uint64_t m_deadline_ns;
+    double m_start_cpu;
+    uint64_t m_start_allocations;
+    int64_t m_start_bytes;
+    double m_elapsed;
+    double m_cpu;
+    uint64_t m_allocations;
+    int64_t m_bytes;
+    bool m_stopping;
+    int m_errors;
+    CHistogram m_latency;
+};
+
+void report_latency(CBenchState& state, const CHistogram& latency)
+{
+    state.SetCounter("accept_p50_us", latency.GetPercentile(0.5) / 1e3);
+    state.SetCounter("accept_p99_us", latency.GetPercentile(0.99) / 1e3);
+    state.SetCounter("accept_p999_us", latency.GetPercentile(0.999) / 1e3);
+}
+
+void bench_cycle(CBenchState& state, CStormParams params, double seconds)
+{
+    while (state.KeepRunning()) {
+        CStormBench bench(params, seconds);
+        bench.Run();
+        if (bench.GetErrors() != 0 || bench.GetAccepted() == 0) {
+            printf("storm benchmark failed\n");
+            return;
+        }
+        state.SetElapsed(bench.GetElapsed());
+        state.AddItems(bench.GetAccepted());
+        report_latency(state, bench.GetLatency());
+        state.SetCounter("cpu_us_per_conn", bench.GetCPU() * 1e6 / bench.GetAccepted());
+    }
+}
+
+void bench_hold(CBenchState& state, CStormParams params)
+{
+    while (state.KeepRunning()) {
+        CStormBench bench(params, 0);
+        bench.Run();
+        if (bench.GetErrors() != 0 || bench.GetAccepted() != static_cast<uint64_t>(params.connections)) {
+            printf("storm benchmark failed\n");
+            return;
+        }
+        state.SetElapsed(bench.GetElapsed());
+        state.AddItems(bench.GetAccepted());
+        report_latency(state, bench.GetLatency());
+        // Both ends of every connection live in this process.
+        const double ends = 2.0 * params.connections;
+        state.SetCounter("heap_bytes_per_conn", bench.GetBytes() / ends);
+        state.SetCounter("allocs_per_conn", bench.GetAllocations() / ends);
+    }
+}
+
+struct CStormBenchmarks {
+    CStormBenchmarks()
+    {
+        // Each cycle run lasts about this long, regardless of -time.
+        const double seconds = 1.0;
+        const Threading threadings[] = {UNTHREADED, THREADED, SHARDED};
+        const char* const threading_names[] = {"unthreaded", "threaded", "sharded"};
+        const Transport transports[] = {TCP, UNIX};
+        const char* const transport_names[] = {"tcp", "unix"};
+
+        for (int t = 0; t < 2; ++t) {
+            for (int th = 0; th < 3; ++th) {
+                const std::string suffix = std::string(transport_names[t]) + "/" + threading_names[th];
+                CStormParams cycle = {CYCLE, transports[t], threadings[th], 8};
+                RegisterBenchmark("storm/cycle/k8/" + suffix, std::bind(bench_cycle, std::placeholders::_1, cycle, seconds));
+                CStormParams hold = {HOLD, transports[t], threadings[th], 1000};
+                RegisterBenchmark("storm/hold/1000/" + suffix, std::bind(bench_hold, std::placeholders::_1, hold));
+            }
+        }
+    }
+} g_storm_benchmarks;
+} // namespace
@@ -101,6 +101,16 @@ public:
         RESOLVE_CONNECT = 1 << 2
     };
 
+    enum RetryJitter {
+        /// Wait exactly the computed delay
+        NO_JITTER = 1 << 0,
+        /// Wait anywhere between zero and the computed delay
+        FULL_JITTER = 1 << 1,
+        /// Wait anywhere between nRetryInterval and nRetryMultiplier times the
+        /// previous delay
+        DECORRELATED_JITTER = 1 << 2
+    };
+
     CConnectionOptions();
     bool fWhitelisted;
     bool fOneShot;
@@ -112,9 +122,31 @@ public:
     int nSendTimeout;
     int nInitialTimeout;
     int nMaxSendBuffer;
+    /// Seconds before the first retry of a failed connection or lookup. Each
+    /// consecutive failure multiplies the delay by nRetryMultiplier, up to
+    /// nRetryMaxInterval seconds, and nRetryJitter randomizes it. The
+    /// defaults retry at a fixed interval.
     int nRetryInterval;
+    int nRetryMaxInterval;
+    int nRetryMultiplier;
+    RetryJitter nRetryJitter;
     int nMaxLookupResults;
     Family nFamily;
+    /// How many of a resolved name's addresses may be tried at once. Above
+    /// 1, attempts alternate between address families and start
+    /// nConnectStagger milliseconds apart, or as soon as one fails. The first
+    /// to connect is kept and the rest are abandoned, and failure is only
+    /// reported once every address has failed.
+    int nParallelConnects;
+    int nConnectStagger;
+    /// On a message that doesn't begin with the network's message_start, or
+    /// whose size can't be decoded, skip ahead to the next message_start
+    /// rather than disconnecting. The bytes skipped are counted in
+    /// CConnectionStats::nBytesSkipped, and each skip in nMalformedMessages
+    /// (garbage arriving over several reads may take several), but
+    /// OnMalformedMessage isn't called. Oversized messages still disconnect,
+    /// as does everything on a network without a message_start.
+    bool fResyncOnBadStart;
 };
 
 class CConnection : public CConnectionBase
@@ -131,7 +163,7 @@ public:
     bool CanConnectProxy() const;
     bool CanConnectDirect() const;
     bool CanResolve() const;
-    static bool CanConnectDirect(sockaddr* sock, CConnectionOptions::Family family);
+    static bool CanConnectDirect(const sockaddr* sock, CConnectionOptions::Family family);
 private:
     CProxy proxy;
     CConnectionOptions opts;
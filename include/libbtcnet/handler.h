@@ -5,6 +5,10 @@
 #ifndef LIBBTCNET_HANDLER_H
 #define LIBBTCNET_HANDLER_H
 
+#include "netmessage.h"
+#include "logging.h"
+#include "stats.h"
+
 #include <list>
 #include <vector>
 #include <stddef.h>
@@ -18,11 +22,128 @@ struct CNodeMessages {
     size_t size;
 };
 
+/// Identifies a connection. Ids are never negative. Once a connection is gone
+/// its id is never valid again, though it need not be larger than older ids.
 typedef int64_t ConnID;
 
 class CConnectionHandlerInt;
 struct CNetworkConfig;
 
+class CHandlerOptions
+{
+public:
+    enum Delivery {
+        /// Copy each message into its own vector. See OnReceiveMessages.
+        DELIVER_VECTORS = 1 << 0,
+        /// Hand out messages without copying them. See OnReceiveMessageBuffers.
+        DELIVER_BUFFERS = 1 << 1,
+        /// Copy each message into contiguous memory which is recycled once
+        /// released, rather than allocated per message. Delivered through
+        /// OnReceiveMessageBuffers, and GetContiguous() never fails.
+        DELIVER_POOLED = 1 << 2,
+        /// Copy each read's messages into one contiguous buffer. See
+        /// OnReceiveMessageBatch.
+        DELIVER_BATCH = 1 << 3
+    };
+
+    enum Dispatch {
+        /// Make a sharded connection's data callbacks on its shard's thread
+        DISPATCH_PER_SHARD = 1 << 0,
+        /// Queue them to be made from PumpEvents, like everything else
+        DISPATCH_MERGED = 1 << 1
+    };
+
+    enum IOEngine {
+        /// Socket bufferevents, woken by the event base when sockets are ready
+        IO_BUFFEREVENT = 1 << 0,
+        /// Linux io_uring: multishot accepts, multishot receives into buffers
+        /// shared with the kernel, and batched sends, all submitted once per
+        /// turn of the event loop. Needs Linux 5.19 or later, and falls back
+        /// to IO_BUFFEREVENT elsewhere. Rate limits aren't applied to
+        /// connections using it.
+        IO_URING = 1 << 1
+    };
+
+    CHandlerOptions();
+    Delivery nDelivery;
+
+    /// Number of worker threads, each with its own event loop, that established
+    /// connections are spread across. 0 handles everything from PumpEvents.
+    /// Requires threading to be enabled.
+    int nShards;
+
+    /// Where the callbacks for sharded connections are made. Connection setup,
+    /// teardown, and everything else are always called from PumpEvents. With
+    /// DISPATCH_PER_SHARD, OnReceiveMessages, OnReceiveMessageBuffers,
+    /// OnReceiveMessageBatch, OnWriteBufferFull, OnWriteBufferReady,
+    /// OnBytesRead, OnBytesWritten, OnPingTimeout and OnMalformedMessage may be
+    /// called concurrently from different shards, though never concurrently
+    /// for the same connection.
+    Dispatch nDispatch;
+
+    /// Send without taking the handler's connection lock. Each connection gets
+    /// a queue that any thread may push to, which the connection's event
+    /// thread drains into its send buffer. Only useful when sending from
+    /// threads other than the one calling PumpEvents. Requires threading to
+    /// be enabled.
+    bool fLockFreeSend;
+
+    /// Call OnBytesRead and OnBytesWritten as data is read from and written
+    /// to the socket. The same counts are always available from GetStats and
+    /// GetConnectionStats.
+    bool fByteCallbacks;
+
+    /// With fByteCallbacks, how often each connection's traffic is reported,
+    /// in milliseconds. Everything since the previous report is reported at
+    /// most once per interval, and once more on disconnect. 0 reports each
+    /// socket read and write as it happens, at the cost of watching every
+    /// change to the connection's buffers.
+    int nByteCallbackInterval;
+
+    /// How many answers to keep in the DNS cache. Lookups for the same host
+    /// that are in progress at the same time are always shared, whatever
+    /// the size.
+    int nDnsCacheSize;
+
+    /// How long each answer is kept, in seconds. 0 disables the cache.
+    int nDnsCacheSeconds;
+
+    /// How many connection attempts may be in progress at once.
+    int nConnecting;
+
+    /// Above nConnecting, let the number of attempts in progress adapt to how
+    /// they fare: one more is allowed for each attempt that connects, up to
+    /// nMaxConnecting, and the allowance halves, down to nConnecting, for
+    /// each that fails. A well-connected node fills its outgoing slots
+    /// quickly, without dialing ever harder into a failing network.
+    int nMaxConnecting;
+
+    /// How listening sockets and established connections do their I/O. The
+    /// callbacks are the same either way.
+    IOEngine nIOEngine;
+
+    /// Drive whitelisted connections (see CConnectionOptions::fWhitelisted)
+    /// without bufferevents, for less overhead per message: each socket is
+    /// watched by a single edge-triggered event, messages are parsed where
+    /// they were read (and with DELIVER_BUFFERS, delivered from there), and
+    /// sends are gathered into one system call. Such connections aren't
+    /// subject to the incoming and outgoing rate limits, and SetRateLimit
+    /// has no effect on them. Only with IO_BUFFEREVENT, and where the event
+    /// backend supports edge-triggered events, as epoll and kqueue do.
+    bool fWhitelistFastPath;
+
+    /// Read messages of at least this many bytes, header included, straight
+    /// from the socket into one buffer of their own, once their header has
+    /// arrived. The connection's bufferevent stops reading until the message
+    /// is complete, so there's no piecing it together from small buffers and
+    /// no framing until then. The buffer is kept for the next large message
+    /// once nothing references it. With DELIVER_BUFFERS and DELIVER_POOLED,
+    /// the message is delivered from it without copying. Rate limits aren't
+    /// applied to what is read this way, and connections with their own
+    /// (see SetRateLimit) don't use it. 0 never does.
+    int nDirectReadSize;
+};
+
 class CConnectionHandler
 {
     friend class CConnectionHandlerInt;
@@ -45,6 +166,46 @@ public:
     /// \param size Size of the raw data
     bool Send(ConnID id, const unsigned char* data, size_t size);
 
+    /// \brief Send several buffers to the remote at once
+    ///
+    /// Equivalent to calling Send for each buffer in order, but the connection
+    /// is only looked up and locked once, and the buffers are queued together
+    /// so that they may be written with a single writev. Either all of the
+    /// buffers are queued or none are.
+    /// \param id The connection's unique id
+    /// \param bufs The buffers to send, in order
+    /// \param count Number of buffers
+    bool SendBatch(ConnID id, const CBufferSpan* bufs, size_t count);
+
+    /// \brief Send the same data to several remotes
+    ///
+    /// Equivalent to calling Send for each id, but the connection table is
+    /// only locked once. Unknown ids are skipped.
+    /// \param ids The connections' unique ids
+    /// \param count Number of ids
+    /// \param data Raw data to send
+    /// \param size Size of the raw data
+    /// \returns The number of connections the data was queued for
+    size_t SendToMany(const ConnID* ids, size_t count, const unsigned char* data, size_t size);
+
+    /// \brief Send a shared payload to the remote without copying it
+    ///
+    /// The connection keeps a reference to the payload until it has been
+    /// written. See CSharedPayload.
+    /// \param id The connection's unique id
+    /// \param payload The data to send
+    bool Send(ConnID id, const CSharedPayload& payload);
+
+    /// \brief Send a shared payload to several remotes without copying it
+    ///
+    /// Each connection references the same memory, which is freed once the
+    /// last of them has flushed it. Unknown ids are skipped.
+    /// \param ids The connections' unique ids
+    /// \param count Number of ids
+    /// \param payload The data to send
+    /// \returns The number of connections the payload was queued for
+    size_t SendToMany(const ConnID* ids, size_t count, const CSharedPayload& payload);
+
     /// \brief Set a rate limit for a specific connection
     ///
     /// This may only be called after the handler has been started. See OnStartup.
@@ -95,11 +256,27 @@ public:
     /// \param limit The new outgoing rate limit
     void SetOutgoingRateLimit(const CRateLimit& limit);
 
+    /// \brief Take a snapshot of the handler-wide counters
+    ///
+    /// May be called from any thread once the handler has been started. Each
+    /// counter is read atomically, but counters still being updated by other
+    /// threads may be slightly out of step with each other.
+    CHandlerStats GetStats() const;
+
+    /// \brief Take a snapshot of a connection's counters
+    ///
+    /// May be called from any thread once the handler has been started.
+    /// \param id The connection's unique id
+    /// \param stats Set to the connection's counters
+    /// \returns false if the connection is not established
+    bool GetConnectionStats(ConnID id, CConnectionStats& stats) const;
+
     /// \brief Bind an address and listen for new connections on it
     ///
     /// This may only be called after the handler has been started. See OnStartup.
     /// Once bound, new connection notifications will come via OnIncomingConnection
-    /// \returns true if the address was successfully bound
+    /// \returns true if the address was successfully bound, false if it could
+    ///          not be or if its network config's size field is invalid
     bool Bind(const CConnection& conn);
 
 protected:
@@ -146,14 +323,16 @@ protected:
     /// This must be called by the thread that will be calling PumpEvents.
     ///
     /// \param outgoing_limit Target number of outgoing connections
-    void Start(int outgoing_limit);
+    /// \param opts Handler-wide options
+    void Start(int outgoing_limit, const CHandlerOptions& opts = CHandlerOptions());
 
     /// \brief Request for outgoing connections
     ///
     /// When the handler does not have enough current outgoing connections, this
     /// will be called to request more. It expects to receive a list of candidate
     /// connections, up to needcount. If more than needcount candidates are
-    /// provided, the excess will be ignored.
+    /// provided, the excess will be ignored. Candidates whose network config
+    /// has an invalid size field fail at once, via OnConnectionFailure.
     ///
     /// \param needcount The maximum available connection slots for this request
     /// \returns A list of outgoing connections
@@ -239,10 +418,37 @@ protected:
     /// \param totalsize The length of all combined messages
     virtual bool OnReceiveMessages(ConnID id, std::list<std::vector<unsigned char> > msgs, size_t totalsize) = 0;
 
+    /// \brief Notification of new messages, without copies
+    ///
+    /// Called instead of OnReceiveMessages when the handler was started with
+    /// CHandlerOptions::DELIVER_BUFFERS or DELIVER_POOLED. With DELIVER_BUFFERS
+    /// the messages reference the buffers they were read into, so the payloads
+    /// are never copied by the library. With DELIVER_POOLED each message is
+    /// copied once into memory that is reused after the message is released.
+    /// The default implementation copies the messages and forwards them to
+    /// OnReceiveMessages.
+    /// \param id The connection's unique id
+    /// \param msgs The received messages, in order
+    /// \param totalsize The length of all combined messages
+    virtual bool OnReceiveMessageBuffers(ConnID id, std::vector<CNetMessage> msgs, size_t totalsize);
+
+    /// \brief Notification of new messages, in a single buffer
+    ///
+    /// Called instead of OnReceiveMessages when the handler was started with
+    /// CHandlerOptions::DELIVER_BATCH. All messages from one read are copied
+    /// into one contiguous buffer.
+    /// The default implementation copies the messages and forwards them to
+    /// OnReceiveMessages.
+    /// \param id The connection's unique id
+    /// \param batch The received messages, in order
+    virtual bool OnReceiveMessageBatch(ConnID id, CMessageBatch batch);
+
     /// \brief Notification of a malformed message
     ///
     /// Called when a message is received with a corrupt or incorrect header
-    /// This will be followed by an OnDisconnected event.
+    /// This will be followed by an OnDisconnected event. Not called for
+    /// connections that resynchronise instead (see
+    /// CConnectionOptions::fResyncOnBadStart).
     /// \param id The connection's unique id
     virtual void OnMalformedMessage(ConnID id) = 0;
 
@@ -264,7 +470,9 @@ protected:
     /// \brief Notification of bytes read from the remote connection
     ///
     /// Called every time a chunk is read from the remote. Does not indicate a
-    /// complete message has been received.
+    /// complete message has been received. Not called if
+    /// CHandlerOptions::fByteCallbacks is disabled, and batched according to
+    /// CHandlerOptions::nByteCallbackInterval.
     /// \param id The connection's unique id
     /// \param bytes Number of bytes read since the last notification
     /// \param total_bytes Total bytes read
@@ -273,7 +481,9 @@ protected:
     /// \brief Notification of bytes written to the remote connection
     ///
     /// Called every time a chunk is written to the remote. Does not indicate a
-    /// complete message has been sent.
+    /// complete message has been sent. Not called if
+    /// CHandlerOptions::fByteCallbacks is disabled, and batched according to
+    /// CHandlerOptions::nByteCallbackInterval.
     /// \param id The connection's unique id
     /// \param bytes Number of bytes written since the last notification
     /// \param total_bytes Total bytes written
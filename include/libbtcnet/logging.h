@@ -0,0 +1,72 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_LOGGING_H
+#define LIBBTCNET_LOGGING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// \brief Where the library's diagnostic messages go
+///
+/// Messages more verbose than the LOGLEVEL the library was built with
+/// (LOGERR unless defined otherwise) are compiled out, as is everything in
+/// NDEBUG builds. The rest are checked against the runtime level before
+/// their arguments are evaluated, then formatted and handed to the sink.
+///
+/// These settings are process-wide. Configure them before starting any
+/// handler.
+class CLogging
+{
+public:
+    enum Level {
+        LOGNONE,
+        LOGERR,
+        LOGWARN,
+        LOGINFO,
+        LOGVERBOSE,
+        LOGALL
+    };
+
+    /// Receives a formatted message, which has no trailing newline and is
+    /// only valid for the duration of the call.
+    typedef void (*Callback)(Level level, const char* message, size_t size, void* ctx);
+
+    /// \brief Discard messages more verbose than level
+    ///
+    /// Defaults to the compile-time level. Raising it above that has no
+    /// effect.
+    static void SetLevel(Level level);
+
+    /// \brief Write each message to stdout as it is logged
+    ///
+    /// This is the default.
+    static void UseStdout();
+
+    /// \brief Pass each message to callback as it is logged
+    ///
+    /// The callback is made on the thread that logged the message, which may
+    /// be an event thread, so it should not block.
+    static void UseCallback(Callback callback, void* ctx);
+
+    /// \brief Queue messages in a lock-free ring to be collected with Drain
+    ///
+    /// Logging threads never block or allocate. When the ring is full, new
+    /// messages are dropped and counted. The ring is created by the first
+    /// call, with room for capacity messages rounded up to a power of two.
+    /// Later calls switch back to it but don't resize it.
+    static void UseRing(size_t capacity);
+
+    /// \brief Pass queued messages to callback, oldest first
+    ///
+    /// May be called from any thread, for example a dedicated logging thread
+    /// or the one calling PumpEvents.
+    /// \returns The number of messages passed to callback
+    static size_t Drain(Callback callback, void* ctx);
+
+    /// \returns The number of messages dropped because the ring was full
+    static uint64_t GetDropped();
+};
+
+#endif // LIBBTCNET_LOGGING_H
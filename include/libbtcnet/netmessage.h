@@ -0,0 +1,128 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_NETMESSAGE_H
+#define LIBBTCNET_NETMESSAGE_H
+
+#include <stddef.h>
+#include <vector>
+
+class CMessageStorage;
+class CPayloadStorage;
+
+/// \brief A contiguous, non-owning range of bytes
+struct CBufferSpan {
+    const unsigned char* data;
+    size_t size;
+};
+
+/// \brief A received message that has not been copied out of the network buffers
+///
+/// Messages from the same read share a single reference-counted storage, so
+/// copying a CNetMessage is cheap and the underlying memory is released once
+/// the last reference is gone. The bytes of a message may be spread across
+/// several non-contiguous segments. They may be read from any thread, but a
+/// single CNetMessage instance must not be modified concurrently.
+class CNetMessage
+{
+    friend class CMessageStorage;
+
+public:
+    CNetMessage();
+    CNetMessage(const CNetMessage& rhs);
+    CNetMessage(CNetMessage&& rhs) noexcept;
+    CNetMessage& operator=(const CNetMessage& rhs);
+    CNetMessage& operator=(CNetMessage&& rhs) noexcept;
+    ~CNetMessage();
+
+    /// \returns The size of the message, including its header
+    size_t GetSize() const;
+
+    /// \brief Copy message bytes into a caller-provided buffer
+    ///
+    /// \param dest Destination buffer
+    /// \param len Maximum number of bytes to copy
+    /// \param offset Offset into the message to start copying from
+    /// \returns The number of bytes copied
+    size_t CopyOut(unsigned char* dest, size_t len, size_t offset = 0) const;
+
+    /// \brief Access the message's bytes in place
+    ///
+    /// Fills up to count spans which together cover the message in order.
+    /// \returns The number of spans needed to cover the whole message. This may
+    ///          be larger than count, in which case only count were filled.
+    size_t Peek(CBufferSpan* spans, size_t count) const;
+
+    /// \returns A pointer to the message's bytes if they are contiguous in
+    ///          memory, otherwise nullptr. See Peek and CopyOut.
+    const unsigned char* GetContiguous() const;
+
+private:
+    CNetMessage(CMessageStorage* storage, size_t offset, size_t size);
+    CMessageStorage* m_storage;
+    size_t m_offset;
+    size_t m_size;
+};
+
+/// \brief An immutable payload that can be queued on many connections at once
+///
+/// Sending a CSharedPayload references its bytes from each connection's send
+/// buffer rather than copying them. The memory is freed once every connection
+/// has finished with it and no CSharedPayload refers to it anymore. Copies
+/// are cheap and may be used from any thread.
+class CSharedPayload
+{
+    friend class ConnectionBase;
+    friend class CSendQueue;
+
+public:
+    CSharedPayload();
+    /// Copies the data once
+    CSharedPayload(const unsigned char* data, size_t size);
+    /// Takes ownership of the data without copying it
+    explicit CSharedPayload(std::vector<unsigned char>&& data);
+    CSharedPayload(const CSharedPayload& rhs);
+    CSharedPayload(CSharedPayload&& rhs) noexcept;
+    CSharedPayload& operator=(const CSharedPayload& rhs);
+    CSharedPayload& operator=(CSharedPayload&& rhs) noexcept;
+    ~CSharedPayload();
+
+    const unsigned char* GetData() const;
+    size_t GetSize() const;
+
+private:
+    CPayloadStorage* m_storage;
+};
+
+/// \brief All of the messages from a single read, stored back to back
+///
+/// The messages share one contiguous buffer and are found through an index of
+/// offsets, so walking a batch touches memory in order and costs two
+/// allocations however many messages it holds.
+class CMessageBatch
+{
+    friend struct CReceivedMessages;
+
+public:
+    CMessageBatch();
+
+    /// \returns The number of messages in the batch
+    size_t GetCount() const;
+
+    /// \returns The combined size of all messages, including their headers
+    size_t GetTotalSize() const;
+
+    /// \returns The bytes of message index, which must be less than GetCount()
+    CBufferSpan GetMessage(size_t index) const;
+
+    /// \returns The start of the buffer holding every message in order
+    const unsigned char* GetData() const;
+
+private:
+    std::vector<unsigned char> m_data;
+    // GetCount() + 1 entries. Message i spans [m_offsets[i], m_offsets[i + 1]).
+    std::vector<size_t> m_offsets;
+};
+
+#endif // LIBBTCNET_NETMESSAGE_H
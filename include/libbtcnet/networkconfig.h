@@ -5,20 +5,72 @@
 #ifndef LIBBTCNET_NETWORKCONFIG_H
 #define LIBBTCNET_NETWORKCONFIG_H
 
+#include <memory>
 #include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/// \brief Determines the size of a message from its header
+///
+/// Implement this for framing that can't be described by CNetworkConfig's
+/// size encodings. It is called from the library's read callback, so it must
+/// not block, and it may be called from any thread the handler runs on.
+class CFrameDecoder
+{
+public:
+    virtual ~CFrameDecoder();
+
+    /// \returns The number of bytes needed before Decode may be called
+    virtual size_t GetMinHeaderSize() const = 0;
+
+    /// \returns The most bytes that Decode may need to see
+    virtual size_t GetMaxHeaderSize() const = 0;
+
+    /// \brief Decode a message's size
+    ///
+    /// \param header The start of the message
+    /// \param len The number of available bytes, at least GetMinHeaderSize()
+    ///        and at most GetMaxHeaderSize()
+    /// \param framesize Set to the full size of the message, including its
+    ///        header, or to 0 if more bytes are needed
+    /// \returns false if the header is malformed
+    virtual bool Decode(const unsigned char* header, size_t len, uint64_t& framesize) const = 0;
+};
 
 // TODO: This is a placeholder that needs to be replaced with something more
 //       self-explanatory. A non-trivial class seems like overkill for now
 //       though.
 
 struct CNetworkConfig {
+    enum SizeEncoding {
+        /// Fixed-width little-endian integer of header_msg_size_size bytes
+        SIZE_LITTLE_ENDIAN = 1 << 0,
+        /// Fixed-width big-endian integer of header_msg_size_size bytes
+        SIZE_BIG_ENDIAN = 1 << 1,
+        /// Bitcoin's CompactSize. header_msg_size_size must be 9, and
+        /// header_size is the size of the header with a 9-byte size field.
+        SIZE_COMPACT = 1 << 2,
+        /// Unsigned LEB128. header_msg_size_size must be 10, and header_size
+        /// is the size of the header with a 10-byte size field.
+        SIZE_VARINT = 1 << 3
+    };
+
+    CNetworkConfig();
+
     int header_msg_size_offset;
+    /// 1 to 8 for the fixed-width encodings. Connections and binds with a size
+    /// that doesn't suit header_msg_size_encoding are refused.
     int header_msg_size_size;
+    SizeEncoding header_msg_size_encoding;
     int header_size;
     unsigned int message_max_size;
     std::vector<unsigned char> message_start;
     int chunk_size;
 
+    /// If set, used instead of the header_msg_size_* fields to find the size
+    /// of each message. message_start is still checked.
+    std::shared_ptr<const CFrameDecoder> frame_decoder;
+
     int protocol_version;
     int protocol_handshake_version;
     int service_flags;
@@ -0,0 +1,63 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_STATS_H
+#define LIBBTCNET_STATS_H
+
+#include <stdint.h>
+
+/// \brief Traffic counters for one connection, or for several combined
+class CConnectionStats
+{
+public:
+    CConnectionStats();
+    uint64_t nBytesRead;
+    uint64_t nBytesWritten;
+    /// Complete messages (or chunks) received
+    uint64_t nMessagesReceived;
+    /// Messages with a corrupt or oversized header. See OnMalformedMessage.
+    uint64_t nMalformedMessages;
+    /// Bytes discarded to find the next message after a corrupt header. See
+    /// CConnectionOptions::fResyncOnBadStart.
+    uint64_t nBytesSkipped;
+    /// Times the send buffer was found to be over its limit. See
+    /// OnWriteBufferFull.
+    uint64_t nWriteBufferFull;
+};
+
+/// \brief Durations of one kind of operation, in microseconds
+class CLatencyStats
+{
+public:
+    CLatencyStats();
+    uint64_t nCount;
+    uint64_t nTotal;
+    uint64_t nMax;
+};
+
+/// \brief Handler-wide counters, accumulated since Start
+class CHandlerStats
+{
+public:
+    CHandlerStats();
+    /// All connections combined, including those that have since closed
+    CConnectionStats connections;
+    uint64_t nIncomingAccepted;
+    uint64_t nOutgoingConnected;
+    /// Failed outgoing connection attempts, including proxy failures
+    uint64_t nConnectFailures;
+    /// Failed lookups, for connections and resolve-only requests alike
+    uint64_t nDnsFailures;
+    /// Lookups answered from the DNS cache, or by one already in progress
+    uint64_t nDnsCacheHits;
+    /// Attempts made to replace a failed or dropped connection
+    uint64_t nReconnects;
+    /// From the start of each outgoing attempt, including any lookup, until
+    /// it connected
+    CLatencyStats connectLatency;
+    /// Every lookup that completed, successfully or not
+    CLatencyStats dnsLatency;
+};
+
+#endif // LIBBTCNET_STATS_H
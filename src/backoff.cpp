@@ -0,0 +1,79 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "backoff.h"
+#include "libbtcnet/connection.h"
+
+#include <algorithm>
+#include <random>
+
+namespace
+{
+// Jitter only needs to keep separate processes from retrying in step, so a
+// per-thread xorshift seeded once from the system is plenty.
+uint64_t jitter_random()
+{
+    static thread_local uint64_t state = 0;
+    while (state == 0) {
+        std::random_device rd;
+        state = (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+// Uniform in [low, high].
+uint64_t random_between(uint64_t low, uint64_t high)
+{
+    if (high <= low)
+        return low;
+    return low + jitter_random() % (high - low + 1);
+}
+} // namespace
+
+CBackoff::CBackoff()
+    : m_failures(0), m_previous(0)
+{
+}
+
+uint64_t CBackoff::next(const CConnectionOptions& opts)
+{
+    const uint64_t base = static_cast<uint64_t>(std::max(opts.nRetryInterval, 0)) * 1000;
+    const uint64_t cap = std::max(base, static_cast<uint64_t>(std::max(opts.nRetryMaxInterval, 0)) * 1000);
+    const uint64_t multiplier = static_cast<uint64_t>(std::max(opts.nRetryMultiplier, 1));
+
+    uint64_t millis;
+    if (opts.nRetryJitter == CConnectionOptions::DECORRELATED_JITTER) {
+        // Each delay is drawn from between the base and a multiple of the
+        // previous one, rather than from a fixed schedule.
+        uint64_t previous = std::max(m_previous, base);
+        uint64_t high = previous > cap / multiplier ? cap : previous * multiplier;
+        millis = std::min(cap, random_between(base, high));
+    } else {
+        millis = base;
+        for (int i = 0; i < m_failures && millis < cap; i++)
+            millis = millis > cap / multiplier ? cap : millis * multiplier;
+        millis = std::min(millis, cap);
+        if (opts.nRetryJitter == CConnectionOptions::FULL_JITTER)
+            millis = random_between(0, millis);
+    }
+
+    if (m_failures < 64)
+        m_failures++;
+    m_previous = millis;
+    return millis;
+}
+
+uint64_t CBackoff::base(const CConnectionOptions& opts)
+{
+    return static_cast<uint64_t>(std::max(opts.nRetryInterval, 0)) * 1000;
+}
+
+void CBackoff::reset()
+{
+    m_failures = 0;
+    m_previous = 0;
+}
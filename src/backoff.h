@@ -0,0 +1,37 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_BACKOFF_H
+#define LIBBTCNET_SRC_BACKOFF_H
+
+#include <stdint.h>
+
+class CConnectionOptions;
+
+// How long to wait before retrying a connection or lookup, following its
+// options' retry policy. Each connection keeps its own, so a host that keeps
+// failing backs off without slowing retries to any other.
+class CBackoff
+{
+public:
+    CBackoff();
+
+    // The delay in milliseconds before the next attempt, counting the one that
+    // just failed.
+    uint64_t next(const CConnectionOptions& opts);
+
+    // The delay for moving on to another address of the same target, which
+    // doesn't count as a failure of the target.
+    static uint64_t base(const CConnectionOptions& opts);
+
+    // Call once the target is reachable again.
+    void reset();
+
+private:
+    int m_failures;
+    // The previous delay in milliseconds, for DECORRELATED_JITTER.
+    uint64_t m_previous;
+};
+
+#endif // LIBBTCNET_SRC_BACKOFF_H
@@ -11,6 +11,11 @@
 #include <event2/bufferevent.h>
 #include <event2/util.h>
 #include <functional>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 CBareConnection::~CBareConnection() = default;
 
 void CBareConnection::conn_event(bufferevent* bev, short event, void* ctx)
@@ -30,12 +35,27 @@ void CBareConnection::conn_event(bufferevent* bev, short event, void* ctx)
     }
 }
 
-void CBareConnection::BareConnect(const event_type<event_base>& base, int bev_opts, evutil_socket_t socket, sockaddr* addr, int addrlen, const timeval& connTimeout)
+void CBareConnection::BareConnect(const event_type<event_base>& base, int bev_opts, evutil_socket_t socket, const sockaddr* addr, int addrlen, const timeval& connTimeout)
 {
     assert(!m_bev);
     assert(addr != nullptr);
     assert(addrlen > 0);
 
+#ifndef _WIN32
+    // libevent never reports a connect that completes immediately, which
+    // connecting to a Unix socket always does. Connect here instead, and let
+    // libevent treat the socket as though the connect were still in progress.
+    if (socket == BAD_SOCKET && addr->sa_family == AF_UNIX) {
+        evutil_socket_t sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock != BAD_SOCKET && evutil_make_socket_nonblocking(sock) == 0 && (::connect(sock, addr, addrlen) == 0 || errno == EINPROGRESS)) {
+            socket = sock;
+            addr = nullptr;
+        } else if (sock != BAD_SOCKET) {
+            evutil_closesocket(sock);
+        }
+    }
+#endif
+
     m_bev = event_type<bufferevent>(bufferevent_socket_new(base, socket, bev_opts));
 
     int ret;
@@ -46,5 +66,5 @@ void CBareConnection::BareConnect(const event_type<event_base>& base, int bev_op
     assert(ret == 0);
     (void)ret;
     bufferevent_setcb(m_bev, nullptr, nullptr, conn_event, this);
-    bufferevent_socket_connect(m_bev, addr, addrlen);
+    bufferevent_socket_connect(m_bev, addr, addr != nullptr ? addrlen : 0);
 }
@@ -22,7 +22,7 @@ protected:
     virtual ~CBareConnection();
     virtual void OnConnectSuccess(event_type<bufferevent>&& bev) = 0;
     virtual void OnConnectFailure(short type, int err) = 0;
-    void BareConnect(const event_type<event_base>& base, int bev_opts, evutil_socket_t socket, sockaddr* addr, int addrlen, const timeval& connTimeout);
+    void BareConnect(const event_type<event_base>& base, int bev_opts, evutil_socket_t socket, const sockaddr* addr, int addrlen, const timeval& connTimeout);
 
 private:
     static void conn_event(bufferevent* bev, short event, void* ctx);
@@ -224,7 +224,12 @@ std::string CConnectionBase::ToString() const
 }
 
 CConnectionOptions::CConnectionOptions()
-    : fWhitelisted(false), fOneShot(false), fPersistent(false), doResolve(NO_RESOLVE), nRetries(0), nConnTimeout(5), nRecvTimeout(60 * 20), nSendTimeout(60 * 20), nInitialTimeout(60), nMaxSendBuffer(5000000), nRetryInterval(1), nMaxLookupResults(0), nFamily(NONE)
+    : fWhitelisted(false), fOneShot(false), fPersistent(false), doResolve(NO_RESOLVE), nRetries(0), nConnTimeout(5), nRecvTimeout(60 * 20), nSendTimeout(60 * 20), nInitialTimeout(60), nMaxSendBuffer(5000000), nRetryInterval(1), nRetryMaxInterval(0), nRetryMultiplier(2), nRetryJitter(NO_JITTER), nMaxLookupResults(0), nFamily(NONE), nParallelConnects(1), nConnectStagger(250), fResyncOnBadStart(false)
+{
+}
+
+CNetworkConfig::CNetworkConfig()
+    : header_msg_size_offset(0), header_msg_size_size(0), header_msg_size_encoding(SIZE_LITTLE_ENDIAN), header_size(0), message_max_size(0), chunk_size(0), protocol_version(0), protocol_handshake_version(0), service_flags(0)
 {
 }
 
@@ -271,7 +276,7 @@ const CNetworkConfig& CConnection::GetNetConfig() const
     return netConfig;
 }
 
-bool CConnection::CanConnectDirect(sockaddr* sock, CConnectionOptions::Family family)
+bool CConnection::CanConnectDirect(const sockaddr* sock, CConnectionOptions::Family family)
 {
     assert(sock != nullptr);
 #ifndef _WIN32
@@ -3,12 +3,19 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "connectionbase.h"
+#include "framer.h"
 #include "message.h"
+#include "messagestorage.h"
+#include "received.h"
+#include "sendqueue.h"
+#include "uring.h"
 #include "event2/buffer.h"
 #include "event2/bufferevent.h"
 #include "event2/event.h"
 #include "eventtypes.h"
+#include <algorithm>
 #include <assert.h>
+#include <errno.h>
 #include "logger.h"
 #include <stdio.h>
 
@@ -16,6 +23,7 @@
 #include <ws2tcpip.h>
 #else
 #include <netinet/tcp.h>
+#include <sys/socket.h>
 #endif
 
 struct BufferEventLocker {
@@ -32,12 +40,152 @@ private:
     bufferevent* m_bev;
 };
 
+// Locks the buffer written to the socket, whichever of the bufferevent and the
+// raw stream it belongs to.
+struct OutputLocker {
+    OutputLocker(const event_type<bufferevent>& bev, CRawStream* raw) : m_bev(raw == nullptr ? static_cast<bufferevent*>(bev) : nullptr), m_raw(raw)
+    {
+        if (m_raw != nullptr) {
+            m_raw->lock();
+            output = m_raw->output();
+        } else {
+            bufferevent_lock(m_bev);
+            output = bufferevent_get_output(m_bev);
+        }
+    }
+    ~OutputLocker()
+    {
+        if (m_raw != nullptr)
+            m_raw->unlock();
+        else
+            bufferevent_unlock(m_bev);
+    }
+
+    evbuffer* output;
+
+private:
+    bufferevent* m_bev;
+    CRawStream* m_raw;
+};
+
+namespace
+{
+template <typename Framer>
+struct select_min_header_size {
+    typedef size_t (*type)(const CNetworkConfig&);
+    static type get() { return &min_header_size<Framer>; }
+};
+
+// Whether a failed read only means trying again once the socket is readable.
+bool read_retriable(int err)
+{
+#if defined(_WIN32)
+    return err == WSAEWOULDBLOCK || err == WSAEINTR;
+#else
+    return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+#endif
+}
+
+// Room for a message read directly, rounded up to a power of two so that the
+// block can be kept for messages of similar sizes.
+size_t direct_block_size(size_t msgsize, size_t max_size)
+{
+    size_t size = 1;
+    while (size < msgsize)
+        size <<= 1;
+    if (max_size != 0 && size > max_size)
+        size = std::max(max_size, msgsize);
+    return size;
+}
+} // namespace
+
+template <typename Framer>
+struct ConnectionBase::CMessageReader {
+    typedef bufferevent_data_cb type;
+    static type get() { return &ConnectionBase::read_cb_message<Framer>; }
+};
+
+template <typename Framer>
+struct ConnectionBase::CRawMessageReader {
+    typedef CRawStream::read_func type;
+    static type get() { return &ConnectionBase::raw_read_message<Framer>; }
+};
+
 ConnectionBase::ConnectionBase(CConnectionHandlerInt& handler, CConnection&& conn, ConnID id)
-    : m_handler(handler), m_event_base(handler.GetEventBase()), m_connection(std::move(conn)), m_id(id), m_reconnect_func(m_event_base, -1, 0, std::bind(&ConnectionBase::Connect, this)), m_disconnect_func(m_event_base, -1, 0, std::bind(&ConnectionBase::DisconnectInt, this, 0)), m_disconnect_wait_func(m_event_base, -1, 0, std::bind(&ConnectionBase::DisconnectWhenFinishedInt, this)), m_check_write_buffer_func(m_event_base, -1, 0, std::bind(&ConnectionBase::CheckWriteBufferInt, this)), m_ping_timeout_func(m_event_base, -1, 0, std::bind(&ConnectionBase::PingTimeoutInt, this)), read_cb_ptr(nullptr)
+    : m_handler(handler), m_event_base(handler.GetEventBase()), m_connection(std::move(conn)), m_id(id), m_connect_start(stats_now_micros()), m_sample_bytes(false), m_input_seen(0), m_output_seen(0), m_bytes_read_reported(0), m_bytes_written_reported(0), m_uring(false), m_direct_block(nullptr), m_direct_size(0), m_direct_filled(0), m_recv_paused(false), read_cb_ptr(nullptr), raw_read_cb_ptr(nullptr), m_pool(nullptr), m_shard(nullptr), m_disconnecting(false)
+{
+    m_reconnect_timer.reset(handler.GetTimers(), std::bind(&ConnectionBase::ReconnectInt, this));
+    ResetEvents(m_event_base, handler.GetTimers());
+    if (m_handler.GetOptions().nDelivery == CHandlerOptions::DELIVER_POOLED)
+        m_pool = new CMessagePool((m_handler.GetBevOpts() & BEV_OPT_THREADSAFE) != 0);
+}
+
+// (Re)create the events that run on the base servicing the connection's I/O.
+void ConnectionBase::ResetEvents(const event_type<event_base>& base, CTimerWheel& timers)
+{
+    m_enable_func.reset(base, -1, 0, std::bind(&ConnectionBase::EnableInt, this));
+    m_disconnect_func.reset(base, -1, 0, std::bind(&ConnectionBase::DisconnectInt, this, 0));
+    m_disconnect_wait_func.reset(base, -1, 0, std::bind(&ConnectionBase::DisconnectWhenFinishedInt, this));
+    m_check_write_buffer_func.reset(base, -1, 0, std::bind(&ConnectionBase::CheckWriteBufferInt, this));
+    m_ping_timer.reset(timers, std::bind(&ConnectionBase::PingTimeoutInt, this));
+    if (m_handler.GetOptions().fByteCallbacks && m_handler.GetOptions().nByteCallbackInterval > 0)
+        m_report_bytes_func.reset(base, -1, EV_PERSIST, std::bind(&ConnectionBase::ReportBytesInt, this));
+}
+
+// Hand an established connection over to a shard. This must happen before
+// PrepareIO, while nothing is pending on the bufferevent.
+void ConnectionBase::MoveToShard(CShard& shard)
+{
+    assert(m_bev);
+    const event_type<event_base>& base = shard.GetEventBase();
+    int ret = bufferevent_base_set(base, m_bev);
+    assert(ret == 0);
+    (void)ret;
+    ResetEvents(base, shard.GetTimers());
+    // The initial timeouts were set up for the old base.
+    const CConnectionOptions& opts = m_connection.GetOptions();
+    SetTimeouts(base, opts.nInitialTimeout, opts.nInitialTimeout);
+    m_first_data_func.reset(base, bufferevent_getfd(m_bev), EV_READ | EV_WRITE, std::bind(&ConnectionBase::FirstDataInt, this));
+    m_shard = &shard;
+    shard.AddConnection();
+}
+
+CShard* ConnectionBase::GetShard() const
 {
+    return m_shard;
 }
 
-ConnectionBase::~ConnectionBase() = default;
+const event_type<event_base>& ConnectionBase::GetIOBase() const
+{
+    return m_shard != nullptr ? m_shard->GetEventBase() : m_event_base;
+}
+
+const CConnectionCounters& ConnectionBase::GetCounters() const
+{
+    return m_counters;
+}
+
+uint64_t ConnectionBase::GetConnectStart() const
+{
+    return m_connect_start;
+}
+
+// Bring the byte counts up to date. May be called from any thread.
+void ConnectionBase::RefreshCounters()
+{
+    if (!m_bev || !m_sample_bytes)
+        return;
+    BufferEventLocker lock(m_bev);
+    SampleBytes();
+}
+
+ConnectionBase::~ConnectionBase()
+{
+    FreeBufferEvent();
+    // Messages still held by the application keep the pool alive.
+    if (m_pool != nullptr)
+        m_pool->Release();
+}
 
 void ConnectionBase::Disconnect()
 {
@@ -51,48 +199,247 @@ void ConnectionBase::DisconnectWhenFinished()
 
 void ConnectionBase::ResetPingTimeout(int seconds)
 {
-    if (seconds != 0) {
-        timeval timeout = {seconds, 0};
-        m_ping_timeout_func.add(&timeout);
-    } else
-        m_ping_timeout_func.del();
+    if (seconds > 0)
+        m_ping_timer.add(static_cast<uint64_t>(seconds) * 1000);
+    else
+        m_ping_timer.del();
 }
 
 void ConnectionBase::PauseRecv()
 {
+    if (m_raw) {
+        m_raw->pause(true);
+        return;
+    }
     assert(m_bev);
     BufferEventLocker lock(m_bev);
-    bufferevent_disable(m_bev, EV_READ);
+    m_recv_paused = true;
+    if (m_direct_size != 0)
+        event_del_noblock(m_direct_event);
+    else
+        bufferevent_disable(m_bev, EV_READ);
 }
 
 void ConnectionBase::UnpauseRecv()
 {
+    if (m_raw) {
+        m_raw->pause(false);
+        return;
+    }
     assert(m_bev);
     BufferEventLocker lock(m_bev);
-    bufferevent_enable(m_bev, EV_READ);
+    m_recv_paused = false;
+    if (m_direct_size != 0)
+        AddDirectRead();
+    else
+        bufferevent_enable(m_bev, EV_READ);
+}
+
+// Settle how an established connection does its I/O, which may replace the
+// bufferevent. Before the connection can be found by other threads.
+void ConnectionBase::PrepareIO()
+{
+    CUringEngine* uring = m_shard != nullptr ? m_shard->GetUring() : m_handler.GetUring();
+    if (uring != nullptr)
+        UseUring(*uring);
+    else if (WantsRawStream())
+        UseRawStream();
 }
 
+// Start reading and writing. This happens on the base servicing the
+// connection's I/O, so that it's ordered with a disconnect asked for in the
+// meantime.
 void ConnectionBase::Enable()
 {
+    m_enable_func.active();
+}
+
+void ConnectionBase::EnableInt()
+{
+    if (m_disconnecting)
+        return;
+    if (m_report_bytes_func) {
+        const int interval = m_handler.GetOptions().nByteCallbackInterval;
+        timeval timeout = {interval / 1000, (interval % 1000) * 1000};
+        m_report_bytes_func.add(&timeout);
+    }
+    if (m_raw) {
+        const CNetworkConfig& netconfig = m_connection.GetNetConfig();
+        m_raw->start(netconfig.chunk_size > 0 ? netconfig.chunk_size : select_framer<select_min_header_size>(netconfig)(netconfig));
+        return;
+    }
     m_first_data_func.add(nullptr);
-    bufferevent_enable(m_bev, EV_READ | EV_WRITE);
+    // Reading may have been paused already.
+    BufferEventLocker lock(m_bev);
+    bufferevent_enable(m_bev, m_recv_paused ? EV_WRITE : EV_READ | EV_WRITE);
 }
 
-void ConnectionBase::Retry(ConnID newId)
+// Hand the socket to the io_uring engine, replacing its bufferevent with one
+// fed by the engine. Nothing has been read from it yet.
+void ConnectionBase::UseUring(CUringEngine& engine)
 {
+    evutil_socket_t sock = bufferevent_getfd(m_bev);
+    bufferevent_setfd(m_bev, -1);
     m_bev.free();
+    m_bev = engine.wrap(sock, m_connection.GetOptions().nSendTimeout);
+    m_uring = true;
+    SetupBufferEvent(GetIOBase());
+}
+
+// Whitelisted connections skip the bufferevent when asked to, as long as
+// there's something to frame their data and the base can drive them.
+bool ConnectionBase::WantsRawStream() const
+{
+    if (!m_handler.GetOptions().fWhitelistFastPath || !m_connection.GetOptions().fWhitelisted || read_cb_ptr == nullptr)
+        return false;
+    if ((m_shard != nullptr ? m_shard->GetUring() : m_handler.GetUring()) != nullptr)
+        return false;
+    return CRawStream::supported(GetIOBase());
+}
+
+// Drive the socket directly, in place of its bufferevent. Nothing has been
+// read from it yet.
+void ConnectionBase::UseRawStream()
+{
+    const CNetworkConfig& netconfig = m_connection.GetNetConfig();
+    const CConnectionOptions& opts = m_connection.GetOptions();
+    evutil_socket_t sock = bufferevent_getfd(m_bev);
+    bufferevent_setfd(m_bev, -1);
+    m_bev.free();
+    // This watches the same socket, and edge- and level-triggered events on
+    // one socket don't mix. All it does is swap the initial timeouts for the
+    // usual ones once the socket is writable, which a connected socket is
+    // straight away.
+    m_first_data_func.free();
+
+    m_raw.reset(new CRawStream(GetIOBase(), m_shard != nullptr ? m_shard->GetTimers() : m_handler.GetTimers(), sock, (m_handler.GetBevOpts() & BEV_OPT_THREADSAFE) != 0));
+    raw_read_cb_ptr = netconfig.chunk_size > 0 ? &raw_read_chunk : select_framer<CRawMessageReader>(netconfig);
+    m_raw->setcb(raw_read_cb_ptr, nullptr, raw_event_cb, raw_bytes, this);
+    m_raw->set_timeouts(opts.nRecvTimeout, opts.nSendTimeout);
+    m_raw->set_write_watermark(opts.nMaxSendBuffer);
+    // Bytes are counted as they are read and written.
+    m_sample_bytes = false;
+}
+
+// Whether a bad message start is skipped past rather than disconnected over.
+bool ConnectionBase::Resyncs(const CNetworkConfig& netconfig) const
+{
+    return m_connection.GetOptions().fResyncOnBadStart && !netconfig.message_start.empty();
+}
+
+// Take over reading a message that has only begun to arrive, as long as it's
+// large enough to be worth it. From within the read callback.
+bool ConnectionBase::StartDirectRead(evbuffer* input, size_t msgsize)
+{
+    const int min_size = m_handler.GetOptions().nDirectReadSize;
+    if (min_size <= 0 || msgsize < static_cast<size_t>(min_size) || m_uring || m_rate_cfg)
+        return false;
+    if (!m_direct_event) {
+        m_direct_event = event_type<event>(event_new(GetIOBase(), bufferevent_getfd(m_bev), EV_READ | EV_PERSIST, direct_read_cb, this));
+        assert(m_direct_event);
+    }
+    // Reuse the last block unless messages still reference it.
+    if (m_direct_block == nullptr || !m_direct_block->Unique() || m_direct_block->capacity() < msgsize) {
+        if (m_direct_block != nullptr)
+            m_direct_block->Release();
+        m_direct_block = new CBlockStorage(direct_block_size(msgsize, m_connection.GetNetConfig().message_max_size));
+    }
+    const size_t buffered = evbuffer_get_length(input);
+    assert(buffered < msgsize);
+    int ret = evbuffer_remove(input, m_direct_block->data(), buffered);
+    assert(ret == static_cast<int>(buffered));
+    (void)ret;
+    m_direct_size = msgsize;
+    m_direct_filled = buffered;
+    // The message has left the input.
+    m_frame_state = CFrameState();
+    bufferevent_disable(m_bev, EV_READ);
+    if (!m_recv_paused)
+        AddDirectRead();
+    return true;
+}
+
+void ConnectionBase::AddDirectRead()
+{
+    const int recv_seconds = m_connection.GetOptions().nRecvTimeout;
+    timeval timeout = {recv_seconds, 0};
+    event_add(m_direct_event, recv_seconds > 0 ? &timeout : nullptr);
+}
+
+// Give up on the message being read directly, if there is one. Reading is
+// left for the caller to resume.
+void ConnectionBase::StopDirectRead()
+{
+    if (m_direct_size == 0)
+        return;
+    event_del_noblock(m_direct_event);
+    m_direct_size = 0;
+    m_direct_filled = 0;
+}
+
+void ConnectionBase::FreeBufferEvent()
+{
+    m_direct_event.free();
+    m_direct_size = 0;
+    m_direct_filled = 0;
+    if (m_direct_block != nullptr) {
+        m_direct_block->Release();
+        m_direct_block = nullptr;
+    }
+    m_raw.reset();
+    if (m_uring)
+        CUringEngine::release(m_bev);
+    else
+        m_bev.free();
+    m_uring = false;
+}
+
+// Everything bound to a shard's base, freed on the shard's thread.
+void ConnectionBase::FreeShardIO()
+{
+    FreeBufferEvent();
+    m_enable_func.free();
+    m_disconnect_func.free();
+    m_disconnect_wait_func.free();
+    m_check_write_buffer_func.free();
+    m_first_data_func.free();
+    m_report_bytes_func.free();
+    m_ping_timer.del();
+}
+
+void ConnectionBase::Retry(ConnID newId)
+{
+    if (m_shard != nullptr) {
+        m_shard->Call(std::bind(&ConnectionBase::FreeShardIO, this));
+        m_shard = nullptr;
+        // The next attempt starts out on the handler's base.
+        ResetEvents(m_event_base, m_handler.GetTimers());
+    } else {
+        FreeBufferEvent();
+    }
     m_rate_cfg.free();
-    m_bytes_read = 0;
-    m_bytes_written = 0;
+    m_counters.reset();
+    m_input_seen = 0;
+    m_output_seen = 0;
+    m_bytes_read_reported = 0;
+    m_bytes_written_reported = 0;
 
     m_id = newId;
-    DEBUG_PRINT(LOGVERBOSE, "id:", m_id, "queuing reconnect");
-    timeval timeout{m_connection.GetOptions().nRetryInterval, 0};
-    m_reconnect_func.add(&timeout);
+    const uint64_t delay = IsMidAttempt() ? CBackoff::base(m_connection.GetOptions()) : m_backoff.next(m_connection.GetOptions());
+    DEBUG_PRINT(LOGVERBOSE, "id:", m_id, "queuing reconnect in", delay, "ms");
+    m_reconnect_timer.add(delay);
+}
+
+void ConnectionBase::ReconnectInt()
+{
+    m_connect_start = stats_now_micros();
+    Connect();
 }
 
 void ConnectionBase::SetRateLimit(const CRateLimit& limit)
 {
+    if (m_raw)
+        return;
     assert(m_bev != nullptr);
 
     event_type<ev_token_bucket_cfg> rate_cfg_new(ev_token_bucket_cfg_new(limit.nMaxReadRate, limit.nMaxBurstRead, limit.nMaxWriteRate, limit.nMaxBurstWrite, nullptr));
@@ -107,6 +454,11 @@ void ConnectionBase::OnConnectionFailure(ConnectionFailureType type, int error,
     m_handler.OnConnectionFailure(m_id, type, error, std::move(failed), retry);
 }
 
+bool ConnectionBase::IsMidAttempt() const
+{
+    return false;
+}
+
 const CConnection& ConnectionBase::GetBaseConnection() const
 {
     return m_connection;
@@ -114,28 +466,56 @@ const CConnection& ConnectionBase::GetBaseConnection() const
 
 void ConnectionBase::DisconnectInt(int /*reason*/)
 {
+    // On a shard, the handler only hears about the disconnect later. Make sure
+    // it only hears about it once.
+    if (m_disconnecting)
+        return;
+    m_disconnecting = true;
     DEBUG_PRINT(LOGINFO, "id:", m_id, "disconnecting");
+    m_enable_func.del();
     m_disconnect_func.del();
-    m_reconnect_func.del();
+    m_reconnect_timer.del();
     m_disconnect_wait_func.del();
     m_check_write_buffer_func.del();
-    m_ping_timeout_func.del();
+    m_ping_timer.del();
     m_first_data_func.del();
-    {
+    m_report_bytes_func.del();
+    if (m_raw) {
+        m_raw->stop();
+    } else {
         BufferEventLocker lock(m_bev);
+        StopDirectRead();
         bufferevent_disable(m_bev, EV_READ | EV_WRITE);
         bufferevent_setcb(m_bev, nullptr, nullptr, nullptr, nullptr);
+        SampleBytes();
     }
+    ReportBytes();
     bool reconnect = m_connection.GetOptions().fPersistent && this->IsOutgoing();
     m_handler.OnDisconnected(m_id, reconnect);
 }
 
 void ConnectionBase::DisconnectWhenFinishedInt()
 {
-    assert(m_bev);
+    assert(m_bev || m_raw);
+    if (m_disconnecting)
+        return;
     bool now;
-    {
+    if (m_raw) {
+        m_raw->lock();
+        now = evbuffer_get_length(m_raw->output()) == 0;
+        m_raw->unlock();
+        if (now) {
+            m_raw->stop();
+        } else {
+            DEBUG_PRINT(LOGINFO, "id:", m_id, "disconnecting when finished");
+            m_raw->pause(true);
+            m_raw->set_write_watermark(0);
+            m_raw->setcb(nullptr, raw_close_on_finished, raw_event_cb, raw_bytes, this);
+            m_raw->flush();
+        }
+    } else {
         BufferEventLocker lock(m_bev);
+        StopDirectRead();
         evbuffer* output = bufferevent_get_output(m_bev);
         if (evbuffer_get_length(output) != 0u) {
             DEBUG_PRINT(LOGINFO, "id:", m_id, "disconnecting when finished");
@@ -155,6 +535,8 @@ void ConnectionBase::DisconnectWhenFinishedInt()
 
 void ConnectionBase::SetRateLimitGroup(event_type<bufferevent_rate_limit_group>& group)
 {
+    if (WantsRawStream())
+        return;
     bufferevent_add_to_rate_limit_group(m_bev, group);
 }
 
@@ -181,26 +563,30 @@ bool ConnectionBase::SetSocketOpts(evutil_socket_t sock)
 void ConnectionBase::InitConnection()
 {
     assert(m_bev);
-    const CConnection& conn = m_connection;
-    const CConnectionOptions& opts = conn.GetOptions();
-    const CNetworkConfig& netconfig = m_connection.GetNetConfig();
-
     evutil_socket_t sock = bufferevent_getfd(m_bev);
     SetSocketOpts(sock);
+    m_disconnecting = false;
+    m_recv_paused = false;
+    m_frame_state = CFrameState();
+
+    // Set an event for resetting the timeout to the normal send/receive values.
+    // This will fire once any data is read from/written to the connection.
+    m_first_data_func.reset(m_event_base, sock, EV_READ | EV_WRITE, std::bind(&ConnectionBase::FirstDataInt, this));
+
+    SetupBufferEvent(m_event_base);
+}
+
+void ConnectionBase::SetupBufferEvent(const event_type<event_base>& base)
+{
+    const CConnectionOptions& opts = m_connection.GetOptions();
+    const CNetworkConfig& netconfig = m_connection.GetNetConfig();
 
     bufferevent_disable(m_bev, EV_READ | EV_WRITE);
 
     // Set the connection's initial timeout. If not connected before this
     // expires, the bufferevent's event callback will fire and it will be
     // disconnected.
-    timeval initialTimeout;
-    initialTimeout.tv_sec = opts.nInitialTimeout;
-    initialTimeout.tv_usec = 0;
-    bufferevent_set_timeouts(m_bev, &initialTimeout, &initialTimeout);
-
-    // Set an event for resetting the timeout to the normal send/receive values.
-    // This will fire once any data is read from/written to the connection.
-    m_first_data_func.reset(m_event_base, sock, EV_READ | EV_WRITE, std::bind(&ConnectionBase::FirstDataInt, this));
+    SetTimeouts(base, opts.nInitialTimeout, opts.nInitialTimeout);
 
     size_t min_read;
     size_t max_read;
@@ -210,9 +596,9 @@ void ConnectionBase::InitConnection()
         read_cb_ptr = &read_cb_chunk;
         min_read = netconfig.chunk_size;
         max_read = 0;
-    } else if (netconfig.header_size > 0) {
-        read_cb_ptr = &read_cb_message;
-        min_read = netconfig.header_msg_size_offset + netconfig.header_msg_size_size;
+    } else if (netconfig.header_size > 0 || netconfig.frame_decoder) {
+        read_cb_ptr = select_framer<CMessageReader>(netconfig);
+        min_read = select_framer<select_min_header_size>(netconfig)(netconfig);
         max_read = netconfig.message_max_size;
     } else {
         read_cb_ptr = nullptr;
@@ -224,26 +610,56 @@ void ConnectionBase::InitConnection()
 
     bufferevent_setcb(m_bev, read_cb_ptr, nullptr, event_cb, this);
 
-    // Add an additional set of callbacks responsible for reporting _all_
-    // socket reads/writes, as opposed to the bufferevent read callback, which
-    // has a watermark set.
     evbuffer* input = bufferevent_get_input(m_bev);
     evbuffer* output = bufferevent_get_output(m_bev);
-    evbuffer_add_cb(input, read_data, this);
-    evbuffer_add_cb(output, wrote_data, this);
+    const CHandlerOptions& handler_opts = m_handler.GetOptions();
+    if (handler_opts.fByteCallbacks && handler_opts.nByteCallbackInterval == 0) {
+        // Add an additional set of callbacks responsible for reporting _all_
+        // socket reads/writes, as opposed to the bufferevent read callback,
+        // which has a watermark set.
+        m_sample_bytes = false;
+        evbuffer_add_cb(input, read_data, this);
+        evbuffer_add_cb(output, wrote_data, this);
+    } else {
+        m_sample_bytes = true;
+        m_input_seen = evbuffer_get_length(input);
+        m_output_seen = evbuffer_get_length(output);
+    }
 }
 
 void ConnectionBase::FirstDataInt()
 {
-    timeval recvTimeout = {m_connection.GetOptions().nRecvTimeout, 0};
-    timeval sendTimeout = {m_connection.GetOptions().nSendTimeout, 0};
-    bufferevent_set_timeouts(m_bev, &recvTimeout, &sendTimeout);
+    SetTimeouts(GetIOBase(), m_connection.GetOptions().nRecvTimeout, m_connection.GetOptions().nSendTimeout);
+}
+
+// The bufferevent re-adds its timeouts after every read and write. Common
+// timeouts keep all of a base's timeouts of the same length in one queue
+// rather than in libevent's heap, so that costs O(1) rather than O(log n).
+// They belong to a base, so must be set again after moving to another.
+void ConnectionBase::SetTimeouts(const event_type<event_base>& base, int recv_seconds, int send_seconds)
+{
+    timeval recv_tv = {recv_seconds, 0};
+    timeval send_tv = {send_seconds, 0};
+    const timeval* recv_timeout = nullptr;
+    const timeval* send_timeout = nullptr;
+    if (recv_seconds > 0) {
+        recv_timeout = event_base_init_common_timeout(base, &recv_tv);
+        if (recv_timeout == nullptr)
+            recv_timeout = &recv_tv;
+    }
+    if (send_seconds > 0) {
+        send_timeout = event_base_init_common_timeout(base, &send_tv);
+        if (send_timeout == nullptr)
+            send_timeout = &send_tv;
+    }
+    bufferevent_set_timeouts(m_bev, recv_timeout, send_timeout);
 }
 
 void ConnectionBase::OnOutgoingConnected(event_type<bufferevent>&& bev, CConnection resolved)
 {
     m_bev = std::move(bev);
     DEBUG_PRINT(LOGINFO, "id:", m_id, "outgoing connection: initial:", m_connection.GetHost(), "resolved:", resolved.GetHost());
+    m_backoff.reset();
     InitConnection();
 
     m_handler.OnOutgoingConnected(m_id, m_connection, std::move(resolved));
@@ -264,26 +680,99 @@ void ConnectionBase::OnIncomingConnected(event_type<bufferevent>&& bev, sockaddr
 // May not be on main thread!
 bool ConnectionBase::Write(const unsigned char* data, size_t size)
 {
-    bool ret = bufferevent_write(m_bev, data, size) == 0;
+    bool ret;
+    {
+        OutputLocker lock(m_bev, m_raw.get());
+        SampleBytes();
+        ret = evbuffer_add(lock.output, data, size) == 0;
+        SampleBytes();
+    }
+    if (ret)
+        m_check_write_buffer_func.active();
+    return ret;
+}
+
+// May not be on main thread!
+bool ConnectionBase::WriteBatch(const CBufferSpan* bufs, size_t count)
+{
+    if (count == 0)
+        return true;
+    // The batch is built aside and then moved over whole, so that it is
+    // queued in one go and a failure part way through queues none of it.
+    event_type<evbuffer> batch(evbuffer_new());
+    bool ret = static_cast<bool>(batch);
+    for (size_t i = 0; i < count && ret; ++i)
+        ret = evbuffer_add(batch, bufs[i].data, bufs[i].size) == 0;
+    if (ret) {
+        OutputLocker lock(m_bev, m_raw.get());
+        SampleBytes();
+        ret = evbuffer_add_buffer(lock.output, batch) == 0;
+        SampleBytes();
+    }
+    if (ret)
+        m_check_write_buffer_func.active();
+    return ret;
+}
+
+// May not be on main thread!
+bool ConnectionBase::WritePayload(const CSharedPayload& payload)
+{
+    CPayloadStorage* storage = payload.m_storage;
+    if (storage == nullptr || storage->m_data.empty())
+        return true;
+
+    // The output buffer holds a reference until the data has been written or
+    // the buffer is freed.
+    storage->AddRef();
+    bool ret;
+    {
+        OutputLocker lock(m_bev, m_raw.get());
+        SampleBytes();
+        ret = evbuffer_add_reference(lock.output, storage->m_data.data(), storage->m_data.size(), CPayloadStorage::release_cb, storage) == 0;
+        SampleBytes();
+    }
     if (ret)
         m_check_write_buffer_func.active();
+    else
+        storage->Release();
     return ret;
 }
 
+// Runs on the thread servicing the connection's I/O.
+void ConnectionBase::FlushSendQueue(CSendQueue& queue)
+{
+    assert(m_bev || m_raw);
+    {
+        OutputLocker lock(m_bev, m_raw.get());
+        SampleBytes();
+        queue.flush(lock.output);
+        SampleBytes();
+    }
+    CheckWriteBufferInt();
+}
+
 void ConnectionBase::CheckWriteBufferInt()
 {
     DEBUG_PRINT(LOGVERBOSE, "id:", m_id, "Checking write buffer");
-    assert(m_bev);
+    assert(m_bev || m_raw);
+    if (m_disconnecting)
+        return;
+    // Nothing else sends for a raw stream.
+    if (m_raw)
+        m_raw->flush();
     bool full = false;
     size_t buflen;
     int maxsend = m_connection.GetOptions().nMaxSendBuffer;
     {
-        BufferEventLocker lock(m_bev);
-        evbuffer* output = bufferevent_get_output(m_bev);
-        buflen = evbuffer_get_length(output);
+        OutputLocker lock(m_bev, m_raw.get());
+        buflen = evbuffer_get_length(lock.output);
         if (static_cast<int>(buflen) >= maxsend) {
             full = true;
-            bufferevent_setcb(m_bev, read_cb_ptr, write_cb, event_cb, this);
+            m_counters.write_buffer_full.add(1);
+            if (m_raw)
+                m_raw->setcb(raw_read_cb_ptr, raw_write_cb, raw_event_cb, raw_bytes, this);
+            else
+                bufferevent_setcb(m_bev, read_cb_ptr, write_cb, event_cb, this);
         }
     }
     if (full)
@@ -292,17 +781,65 @@ void ConnectionBase::CheckWriteBufferInt()
 
 void ConnectionBase::PingTimeoutInt()
 {
+    if (m_disconnecting)
+        return;
     m_handler.OnPingTimeout(m_id);
 }
 
+// With nByteCallbackInterval, report anything not yet reported.
+void ConnectionBase::ReportBytes()
+{
+    if (m_report_bytes_func)
+        ReportBytesInt();
+}
+
+// Report the bytes moved since the last report. Runs every
+// nByteCallbackInterval milliseconds and once more on disconnect.
+void ConnectionBase::ReportBytesInt()
+{
+    if (m_bev) {
+        BufferEventLocker lock(m_bev);
+        SampleBytes();
+    }
+    const uint64_t read = m_counters.bytes_read.get();
+    if (read != m_bytes_read_reported) {
+        m_handler.OnBytesRead(m_id, static_cast<size_t>(read - m_bytes_read_reported), static_cast<size_t>(read));
+        m_bytes_read_reported = read;
+    }
+    const uint64_t written = m_counters.bytes_written.get();
+    if (written != m_bytes_written_reported) {
+        m_handler.OnBytesWritten(m_id, static_cast<size_t>(written - m_bytes_written_reported), static_cast<size_t>(written));
+        m_bytes_written_reported = written;
+    }
+}
+
+// Count the socket's traffic since the last call from the buffers' lengths.
+// The input only grows by reading from the socket and the output only shrinks
+// by writing to it, so this is exact as long as it is also called before and
+// after every change made to them from here. The bufferevent must be locked.
+void ConnectionBase::SampleBytes()
+{
+    if (!m_sample_bytes)
+        return;
+    const size_t input = evbuffer_get_length(bufferevent_get_input(m_bev));
+    if (input > m_input_seen)
+        m_counters.bytes_read.add(input - m_input_seen);
+    m_input_seen = input;
+    const size_t output = evbuffer_get_length(bufferevent_get_output(m_bev));
+    if (output < m_output_seen)
+        m_counters.bytes_written.add(m_output_seen - output);
+    m_output_seen = output;
+}
+
 void ConnectionBase::read_data(struct evbuffer* /*unused*/, const struct evbuffer_cb_info* info, void* ctx)
 {
     assert(ctx);
     if (info->n_added != 0u) {
         ConnectionBase* base = static_cast<ConnectionBase*>(ctx);
-        base->m_bytes_read += info->n_added;
-        base->m_handler.m_interface.OnBytesRead(base->m_id, info->n_added, base->m_bytes_read);
-        DEBUG_PRINT(LOGALL, "id:", base->m_id, "Read:", info->n_added, "bytes. Total:", base->m_bytes_read);
+        base->m_counters.bytes_read.add(info->n_added);
+        const uint64_t total = base->m_counters.bytes_read.get();
+        base->m_handler.OnBytesRead(base->m_id, info->n_added, total);
+        DEBUG_PRINT(LOGALL, "id:", base->m_id, "Read:", info->n_added, "bytes. Total:", total);
     }
 }
 
@@ -311,9 +848,10 @@ void ConnectionBase::wrote_data(struct evbuffer* /*unused*/, const struct evbuff
     assert(ctx);
     if (info->n_deleted != 0u) {
         ConnectionBase* base = static_cast<ConnectionBase*>(ctx);
-        base->m_bytes_written += info->n_deleted;
-        base->m_handler.m_interface.OnBytesWritten(base->m_id, info->n_deleted, base->m_bytes_written);
-        DEBUG_PRINT(LOGALL, "id:", base->m_id, "Wrote:", info->n_deleted, "bytes. Total:", base->m_bytes_written);
+        base->m_counters.bytes_written.add(info->n_deleted);
+        const uint64_t total = base->m_counters.bytes_written.get();
+        base->m_handler.OnBytesWritten(base->m_id, info->n_deleted, total);
+        DEBUG_PRINT(LOGALL, "id:", base->m_id, "Wrote:", info->n_deleted, "bytes. Total:", total);
     }
 }
 
@@ -327,6 +865,16 @@ void ConnectionBase::event_cb(bufferevent* /*unused*/, short type, void* ctx)
         base->DisconnectInt(0);
 }
 
+void ConnectionBase::DeliverMessages(CReceivedMessages&& received)
+{
+    if (!received.buffers.empty())
+        m_handler.OnReceiveMessages(m_id, std::move(received.buffers), received.totalsize);
+    else if (!received.vectors.empty())
+        m_handler.OnReceiveMessages(m_id, std::move(received.vectors), received.totalsize);
+    else if (received.batch.GetCount() != 0)
+        m_handler.OnReceiveMessages(m_id, std::move(received.batch));
+}
+
 void ConnectionBase::read_cb_chunk(bufferevent* bev, void* ctx)
 {
     assert(ctx);
@@ -337,79 +885,97 @@ void ConnectionBase::read_cb_chunk(bufferevent* bev, void* ctx)
     assert(netconfig.chunk_size > 0);
     size_t chunk_size = netconfig.chunk_size;
 
-    std::list<std::vector<unsigned char> > msgs;
-    size_t remaining;
+    CReceivedMessages received;
     evbuffer* input;
     {
         BufferEventLocker lock(bev);
         input = bufferevent_get_input(bev);
-        remaining = evbuffer_get_length(input);
-        while (remaining >= chunk_size) {
-            msgs.emplace_back(chunk_size);
-            evbuffer_remove(input, msgs.back().data(), chunk_size);
-            remaining -= chunk_size;
-        }
+        base->SampleBytes();
+        size_t count = evbuffer_get_length(input) / chunk_size;
+        base->m_msg_sizes.assign(count, chunk_size);
+        base->m_counters.messages_received.add(count);
+        received.totalsize = count * chunk_size;
+        if (count != 0)
+            received.extract(input, base->m_msg_sizes, base->m_handler.GetOptions().nDelivery, base->m_pool);
+        base->SampleBytes();
     }
     evbuffer_expand(input, chunk_size);
-    if (!msgs.empty())
-        base->m_handler.OnReceiveMessages(base->m_id, std::move(msgs), msgs.size() * chunk_size);
+    if (received.totalsize != 0u)
+        base->DeliverMessages(std::move(received));
 }
 
 
+template <typename Framer>
 void ConnectionBase::read_cb_message(bufferevent* bev, void* ctx)
 {
     assert(ctx);
     assert(bev);
     ConnectionBase* base = static_cast<ConnectionBase*>(ctx);
     const CNetworkConfig& netconfig = base->m_connection.GetNetConfig();
-    std::list<std::vector<unsigned char> > msgs;
-    size_t totalsize = 0;
+    CReceivedMessages received;
     bool fTooBig = false;
     bool fBadMsgStart = false;
     {
         BufferEventLocker lock(bev);
         evbuffer* input = bufferevent_get_input(bev);
+        bool fResynced = false;
+        base->SampleBytes();
 
-        uint64_t msgsize = 0;
-        bool fComplete = false;
-        do {
-            msgsize = first_complete_message_size(netconfig, input, fComplete, fBadMsgStart);
-            if (netconfig.message_max_size > 0 && msgsize > netconfig.message_max_size) {
-                DEBUG_PRINT(LOGWARN, "id:", base->m_id, "Received an oversized message");
-                if (fComplete) {
-                    evbuffer_drain(input, msgsize);
-                }
-                fTooBig = true;
-                break;
-            } else if (fBadMsgStart) {
-                DEBUG_PRINT(LOGWARN, "id:", base->m_id, "Received a bad message start");
-                break;
-            } else if ((msgsize != 0u) && fComplete) {
-                msgs.emplace_back(msgsize, 0);
-                evbuffer_remove(input, msgs.back().data(), msgsize);
-                totalsize += msgsize;
-            }
-        } while (fComplete);
+        // Find all complete messages first, then remove them together.
+        std::vector<size_t>& sizes = base->m_msg_sizes;
+        sizes.clear();
+        uint64_t msgsize = find_complete_messages<Framer>(netconfig, input, base->m_frame_state, sizes, received.totalsize, fBadMsgStart, fTooBig);
+        if (fTooBig) {
+            DEBUG_PRINT(LOGWARN, "id:", base->m_id, "Received an oversized message");
+        } else if (fBadMsgStart) {
+            DEBUG_PRINT(LOGWARN, "id:", base->m_id, "Received a bad message start");
+        }
 
-        if ((msgsize != 0u) && !fBadMsgStart) {
+        if (!sizes.empty()) {
+            base->m_counters.messages_received.add(sizes.size());
+            received.extract(input, sizes, base->m_handler.GetOptions().nDelivery, base->m_pool);
+        }
+        if (fBadMsgStart && base->Resyncs(netconfig)) {
+            // The input now begins with the bad message. Whatever follows the
+            // next message_start is parsed once the callback runs again.
+            const size_t skip = resync_skip(netconfig, input);
+            evbuffer_drain(input, skip);
+            base->m_counters.bytes_skipped.add(skip);
+            base->m_counters.malformed_messages.add(1);
+            DEBUG_PRINT(LOGWARN, "id:", base->m_id, "skipped", skip, "bytes to resync");
+            fBadMsgStart = false;
+            fResynced = true;
+            msgsize = 0;
+        }
+        const bool fDirect = (msgsize != 0u) && !fBadMsgStart && !fTooBig && base->StartDirectRead(input, msgsize);
+        base->SampleBytes();
+
+        if (fDirect) {
+            DEBUG_PRINT(LOGVERBOSE, "id:", base->m_id, "reading", msgsize, "byte message directly");
+        } else if ((msgsize != 0u) && !fBadMsgStart) {
             size_t buflen = evbuffer_get_length(input);
             if (buflen < msgsize + netconfig.header_size && !fTooBig)
                 evbuffer_expand(input, msgsize + netconfig.header_size - buflen);
             bufferevent_setwatermark(bev, EV_READ, msgsize, msgsize + netconfig.message_max_size);
             DEBUG_PRINT(LOGVERBOSE, "id:", base->m_id, "watermark set to", msgsize);
         } else if (!fBadMsgStart && !fTooBig) {
-            size_t watermark = netconfig.header_msg_size_offset + netconfig.header_msg_size_size;
+            size_t watermark = min_header_size<Framer>(netconfig);
             bufferevent_setwatermark(bev, EV_READ, watermark, netconfig.message_max_size);
             DEBUG_PRINT(LOGVERBOSE, "id:", base->m_id, "watermark set to", watermark);
         }
+        // What's left may already be past the new watermark, in which case
+        // nothing more arriving would be needed to parse it.
+        if (fResynced && (bufferevent_get_enabled(bev) & EV_READ) != 0)
+            bufferevent_trigger(bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
     }
 
-    if (totalsize != 0u) {
-        DEBUG_PRINT(LOGINFO, "id:", base->m_id, "Received", msgs.size(), "messages");
-        base->m_handler.OnReceiveMessages(base->m_id, std::move(msgs), totalsize);
+    if (received.totalsize != 0u) {
+        DEBUG_PRINT(LOGINFO, "id:", base->m_id, "Received", base->m_msg_sizes.size(), "messages");
+        base->DeliverMessages(std::move(received));
     }
 
     if (fTooBig || fBadMsgStart) {
+        base->m_counters.malformed_messages.add(1);
         base->m_handler.OnMalformedMessage(base->m_id);
         base->DisconnectInt(0);
     }
@@ -431,3 +997,196 @@ void ConnectionBase::close_on_finished_writecb(bufferevent* /*unused*/, void* ct
     ConnectionBase* base = static_cast<ConnectionBase*>(ctx);
     base->DisconnectInt(0);
 }
+
+// Read more of the message begun by StartDirectRead. Once it's complete, it's
+// delivered and the bufferevent takes over again.
+void ConnectionBase::direct_read_cb(evutil_socket_t sock, short what, void* ctx)
+{
+    assert(ctx);
+    ConnectionBase* base = static_cast<ConnectionBase*>(ctx);
+    const CNetworkConfig& netconfig = base->m_connection.GetNetConfig();
+    CReceivedMessages received;
+    size_t got = 0;
+    uint64_t total = 0;
+    short error = 0;
+    {
+        BufferEventLocker lock(base->m_bev);
+        // Paused or given up on while waiting for the lock.
+        if (base->m_direct_size == 0 || base->m_recv_paused)
+            return;
+        if ((what & EV_TIMEOUT) != 0)
+            error = BEV_EVENT_TIMEOUT | BEV_EVENT_READING;
+        CBlockStorage* block = base->m_direct_block;
+        while (error == 0 && base->m_direct_filled < base->m_direct_size) {
+            const size_t want = base->m_direct_size - base->m_direct_filled;
+            const ev_ssize_t ret = recv(sock, reinterpret_cast<char*>(block->data() + base->m_direct_filled), want, 0);
+            if (ret > 0) {
+                base->m_direct_filled += static_cast<size_t>(ret);
+                got += static_cast<size_t>(ret);
+            } else if (ret == 0) {
+                error = BEV_EVENT_EOF | BEV_EVENT_READING;
+            } else if (read_retriable(EVUTIL_SOCKET_ERROR())) {
+                break;
+            } else {
+                error = BEV_EVENT_ERROR | BEV_EVENT_READING;
+            }
+        }
+        // Counted under the lock, as sampling the bufferevent's bytes from
+        // another thread is.
+        if (got != 0) {
+            base->m_counters.bytes_read.add(got);
+            total = base->m_counters.bytes_read.get();
+        }
+        if (error == 0 && base->m_direct_filled == base->m_direct_size) {
+            const size_t msgsize = base->m_direct_size;
+            base->StopDirectRead();
+            // The message is delivered from the block itself wherever a
+            // reference will do.
+            CHandlerOptions::Delivery delivery = base->m_handler.GetOptions().nDelivery;
+            if (delivery == CHandlerOptions::DELIVER_POOLED)
+                delivery = CHandlerOptions::DELIVER_BUFFERS;
+            base->m_msg_sizes.assign(1, msgsize);
+            base->m_counters.messages_received.add(1);
+            received.totalsize = msgsize;
+            received.extract(block->data(), base->m_msg_sizes, delivery, base->m_pool, block, 0);
+            bufferevent_setwatermark(base->m_bev, EV_READ, select_framer<select_min_header_size>(netconfig)(netconfig), netconfig.message_max_size);
+            if (!base->m_recv_paused)
+                bufferevent_enable(base->m_bev, EV_READ);
+        }
+    }
+    const CHandlerOptions& opts = base->m_handler.GetOptions();
+    if (got != 0 && opts.fByteCallbacks && opts.nByteCallbackInterval == 0)
+        base->m_handler.OnBytesRead(base->m_id, got, total);
+    if (error != 0) {
+        event_cb(nullptr, error, ctx);
+    } else if (received.totalsize != 0u) {
+        DEBUG_PRINT(LOGINFO, "id:", base->m_id, "Received a message directly");
+        base->DeliverMessages(std::move(received));
+    }
+}
+
+template <typename Framer>
+size_t ConnectionBase::raw_read_message(const unsigned char* data, size_t len, size_t& want, void* ctx)
+{
+    assert(ctx);
+    ConnectionBase* base = static_cast<ConnectionBase*>(ctx);
+    const CNetworkConfig& netconfig = base->m_connection.GetNetConfig();
+    CReceivedMessages received;
+    bool fTooBig = false;
+    bool fBadMsgStart = false;
+
+    std::vector<size_t>& sizes = base->m_msg_sizes;
+    sizes.clear();
+    uint64_t msgsize = find_complete_messages<Framer>(netconfig, data, len, base->m_frame_state, sizes, received.totalsize, fBadMsgStart, fTooBig);
+    if (fTooBig) {
+        DEBUG_PRINT(LOGWARN, "id:", base->m_id, "Received an oversized message");
+    } else if (fBadMsgStart) {
+        DEBUG_PRINT(LOGWARN, "id:", base->m_id, "Received a bad message start");
+    }
+
+    if (!sizes.empty()) {
+        const CHandlerOptions::Delivery delivery = base->m_handler.GetOptions().nDelivery;
+        CMessageStorage* storage = nullptr;
+        size_t offset = 0;
+        if (delivery == CHandlerOptions::DELIVER_BUFFERS)
+            storage = base->m_raw->share(data, offset);
+        base->m_counters.messages_received.add(sizes.size());
+        received.extract(data, sizes, delivery, base->m_pool, storage, offset);
+    }
+    size_t consumed = received.totalsize;
+    if (fBadMsgStart && base->Resyncs(netconfig)) {
+        // The stream calls again straight away if enough is left.
+        const size_t skip = resync_skip(netconfig, data + consumed, len - consumed);
+        consumed += skip;
+        base->m_counters.bytes_skipped.add(skip);
+        base->m_counters.malformed_messages.add(1);
+        DEBUG_PRINT(LOGWARN, "id:", base->m_id, "skipped", skip, "bytes to resync");
+        fBadMsgStart = false;
+        msgsize = 0;
+    }
+
+    if ((msgsize != 0u) && !fBadMsgStart && !fTooBig)
+        want = msgsize;
+    else
+        want = min_header_size<Framer>(netconfig);
+
+    if (received.totalsize != 0u) {
+        DEBUG_PRINT(LOGINFO, "id:", base->m_id, "Received", base->m_msg_sizes.size(), "messages");
+        base->DeliverMessages(std::move(received));
+    }
+
+    if (fTooBig || fBadMsgStart) {
+        base->m_counters.malformed_messages.add(1);
+        base->m_handler.OnMalformedMessage(base->m_id);
+        base->DisconnectInt(0);
+    }
+    return consumed;
+}
+
+size_t ConnectionBase::raw_read_chunk(const unsigned char* data, size_t len, size_t& want, void* ctx)
+{
+    assert(ctx);
+    ConnectionBase* base = static_cast<ConnectionBase*>(ctx);
+    const CNetworkConfig& netconfig = base->m_connection.GetNetConfig();
+    assert(netconfig.chunk_size > 0);
+    const size_t chunk_size = netconfig.chunk_size;
+    want = chunk_size;
+
+    const size_t count = len / chunk_size;
+    if (count == 0)
+        return 0;
+    CReceivedMessages received;
+    const CHandlerOptions::Delivery delivery = base->m_handler.GetOptions().nDelivery;
+    CMessageStorage* storage = nullptr;
+    size_t offset = 0;
+    if (delivery == CHandlerOptions::DELIVER_BUFFERS)
+        storage = base->m_raw->share(data, offset);
+    base->m_msg_sizes.assign(count, chunk_size);
+    base->m_counters.messages_received.add(count);
+    received.totalsize = count * chunk_size;
+    received.extract(data, base->m_msg_sizes, delivery, base->m_pool, storage, offset);
+    base->DeliverMessages(std::move(received));
+    return count * chunk_size;
+}
+
+void ConnectionBase::raw_write_cb(void* ctx)
+{
+    assert(ctx);
+    ConnectionBase* base = static_cast<ConnectionBase*>(ctx);
+    size_t buflen;
+    base->m_raw->lock();
+    buflen = evbuffer_get_length(base->m_raw->output());
+    base->m_raw->unlock();
+    base->m_raw->setcb(base->raw_read_cb_ptr, nullptr, raw_event_cb, raw_bytes, ctx);
+    base->m_handler.OnWriteBufferReady(base->m_id, buflen);
+}
+
+void ConnectionBase::raw_close_on_finished(void* ctx)
+{
+    assert(ctx);
+    ConnectionBase* base = static_cast<ConnectionBase*>(ctx);
+    base->DisconnectInt(0);
+}
+
+void ConnectionBase::raw_event_cb(short what, void* ctx)
+{
+    event_cb(nullptr, what, ctx);
+}
+
+void ConnectionBase::raw_bytes(size_t read, size_t written, void* ctx)
+{
+    assert(ctx);
+    ConnectionBase* base = static_cast<ConnectionBase*>(ctx);
+    const CHandlerOptions& opts = base->m_handler.GetOptions();
+    const bool report = opts.fByteCallbacks && opts.nByteCallbackInterval == 0;
+    if (read != 0u) {
+        base->m_counters.bytes_read.add(read);
+        if (report)
+            base->m_handler.OnBytesRead(base->m_id, read, base->m_counters.bytes_read.get());
+    }
+    if (written != 0u) {
+        base->m_counters.bytes_written.add(written);
+        if (report)
+            base->m_handler.OnBytesWritten(base->m_id, written, base->m_counters.bytes_written.get());
+    }
+}
@@ -5,10 +5,20 @@
 #ifndef LIBBTCNET_SRC_CONNECTIONBASE_H
 #define LIBBTCNET_SRC_CONNECTIONBASE_H
 
+#include "backoff.h"
 #include "event.h"
 #include "eventtypes.h"
+#include "framer.h"
 #include "handler.h"
+#include "rawstream.h"
+#include "stats.h"
+#include "timerwheel.h"
 #include "libbtcnet/connection.h"
+#include "libbtcnet/netmessage.h"
+
+#include <list>
+#include <memory>
+#include <vector>
 
 struct CConnFailure {
     int type;
@@ -22,6 +32,12 @@ struct evbuffer;
 struct ev_token_bucket_cfg;
 struct event;
 
+class CBlockStorage;
+class CMessagePool;
+class CSendQueue;
+class CUringEngine;
+struct CReceivedMessages;
+
 class ConnectionBase
 {
 public:
@@ -29,10 +45,13 @@ public:
     virtual void Connect() = 0;
     virtual void Cancel() = 0;
     virtual bool IsOutgoing() const = 0;
+    void PrepareIO();
     void Enable();
     void Disconnect();
     void DisconnectWhenFinished();
     bool Write(const unsigned char* data, size_t size);
+    bool WriteBatch(const CBufferSpan* bufs, size_t count);
+    bool WritePayload(const CSharedPayload& payload);
     void SetRateLimit(const CRateLimit& limit);
     void PauseRecv();
     void UnpauseRecv();
@@ -41,6 +60,14 @@ public:
     void SetRateLimitGroup(event_type<bufferevent_rate_limit_group>& group);
     const CConnection& GetBaseConnection() const;
     void ResetPingTimeout(int seconds);
+    void MoveToShard(CShard& shard);
+    CShard* GetShard() const;
+    const event_type<event_base>& GetIOBase() const;
+    void FlushSendQueue(CSendQueue& queue);
+    const CConnectionCounters& GetCounters() const;
+    void RefreshCounters();
+    void ReportBytes();
+    uint64_t GetConnectStart() const;
 
 protected:
     ConnectionBase(CConnectionHandlerInt& handler, CConnection&& conn, ConnID id);
@@ -48,23 +75,57 @@ protected:
     void OnIncomingConnected(event_type<bufferevent>&& bev, sockaddr* addr, int addrsize);
     void OnConnectionFailure(ConnectionFailureType type, int error, CConnection failed, bool retry);
     void OnDisconnected();
+    // Whether the next Connect carries on with the same attempt, for example
+    // with another of a name's addresses, rather than starting over.
+    virtual bool IsMidAttempt() const;
 
 private:
+    void ResetEvents(const event_type<event_base>& base, CTimerWheel& timers);
+    void SetTimeouts(const event_type<event_base>& base, int recv_seconds, int send_seconds);
+    void ReconnectInt();
+    void EnableInt();
     void DisconnectInt(int reason);
     void DisconnectWhenFinishedInt();
     void PauseRecvInt();
     void UnpauseRecvInt();
     void SetRateLimitInt(const CRateLimit& limit);
     void InitConnection();
+    void SetupBufferEvent(const event_type<event_base>& base);
+    void UseUring(CUringEngine& engine);
+    bool WantsRawStream() const;
+    void UseRawStream();
+    bool StartDirectRead(evbuffer* input, size_t msgsize);
+    void AddDirectRead();
+    void StopDirectRead();
+    bool Resyncs(const CNetworkConfig& netconfig) const;
+    void FreeBufferEvent();
+    void FreeShardIO();
     void CheckWriteBufferInt();
     void PingTimeoutInt();
+    void ReportBytesInt();
+    void SampleBytes();
     void FirstDataInt();
+    void DeliverMessages(CReceivedMessages&& received);
     static bool SetSocketOpts(evutil_socket_t sock);
     static void event_cb(bufferevent* /*unused*/, short type, void* ctx);
     static void read_cb_chunk(bufferevent* bev, void* ctx);
+    template <typename Framer>
     static void read_cb_message(bufferevent* bev, void* ctx);
+    template <typename Framer>
+    struct CMessageReader;
     static void write_cb(bufferevent* bev, void* ctx);
     static void close_on_finished_writecb(bufferevent* bev, void* ctx);
+    static void direct_read_cb(evutil_socket_t sock, short what, void* ctx);
+
+    template <typename Framer>
+    static size_t raw_read_message(const unsigned char* data, size_t len, size_t& want, void* ctx);
+    template <typename Framer>
+    struct CRawMessageReader;
+    static size_t raw_read_chunk(const unsigned char* data, size_t len, size_t& want, void* ctx);
+    static void raw_write_cb(void* ctx);
+    static void raw_close_on_finished(void* ctx);
+    static void raw_event_cb(short what, void* ctx);
+    static void raw_bytes(size_t read, size_t written, void* ctx);
 
     static void read_data(struct evbuffer* /*unused*/, const struct evbuffer_cb_info* info, void* ctx);
     static void wrote_data(struct evbuffer* /*unused*/, const struct evbuffer_cb_info* info, void* ctx);
@@ -76,19 +137,49 @@ protected:
 
 private:
     ConnID m_id;
-    unsigned long m_bytes_read;
-    unsigned long m_bytes_written;
+    CConnectionCounters m_counters;
+    uint64_t m_connect_start;
+    CBackoff m_backoff;
+    // Without the evbuffer callbacks, bytes are counted by comparing the
+    // buffers' lengths against what they were last time. See SampleBytes.
+    bool m_sample_bytes;
+    size_t m_input_seen;
+    size_t m_output_seen;
+    uint64_t m_bytes_read_reported;
+    uint64_t m_bytes_written_reported;
 
     event_type<bufferevent> m_bev;
+    // Whether m_bev is fed by a CUringEngine rather than being a socket's.
+    bool m_uring;
+    // Takes the place of m_bev for whitelisted connections with
+    // CHandlerOptions::fWhitelistFastPath.
+    std::unique_ptr<CRawStream> m_raw;
+    // While a message of at least CHandlerOptions::nDirectReadSize is
+    // arriving, m_bev doesn't read. m_direct_event reads the rest of it into
+    // m_direct_block instead, which is kept for the next one. Guarded by
+    // m_bev's lock, as is m_recv_paused.
+    event_type<event> m_direct_event;
+    CBlockStorage* m_direct_block;
+    size_t m_direct_size;
+    size_t m_direct_filled;
+    bool m_recv_paused;
     event_type<ev_token_bucket_cfg> m_rate_cfg;
 
-    CEvent m_reconnect_func;
+    CTimer m_reconnect_timer;
+    CEvent m_enable_func;
     CEvent m_disconnect_func;
     CEvent m_disconnect_wait_func;
     CEvent m_check_write_buffer_func;
-    CEvent m_ping_timeout_func;
+    CTimer m_ping_timer;
     CEvent m_first_data_func;
+    CEvent m_report_bytes_func;
     bufferevent_data_cb read_cb_ptr;
+    CRawStream::read_func raw_read_cb_ptr;
+    std::vector<size_t> m_msg_sizes;
+    CFrameState m_frame_state;
+    CMessagePool* m_pool;
+    CShard* m_shard;
+    bool m_disconnecting;
 };
 
 #endif // LIBBTCNET_SRC_CONNECTIONBASE_H
@@ -0,0 +1,180 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "dnscache.h"
+#include "stats.h"
+
+#include <event2/dns.h>
+
+#include <assert.h>
+
+bool CDNSCacheKey::operator<(const CDNSCacheKey& rhs) const
+{
+    if (family != rhs.family)
+        return family < rhs.family;
+    if (flags != rhs.flags)
+        return flags < rhs.flags;
+    if (port != rhs.port)
+        return port < rhs.port;
+    return host < rhs.host;
+}
+
+CDNSCache::CDNSCache(CStatCounter& hits)
+    : m_dns_base(nullptr), m_max_entries(0), m_ttl(0), m_hits(hits)
+{
+}
+
+CDNSCache::~CDNSCache()
+{
+    stop();
+}
+
+void CDNSCache::start(const event_type<evdns_base>& dns_base, int max_entries, int ttl_seconds)
+{
+    assert(m_lookups.empty());
+    assert(m_entries.empty());
+    m_dns_base = dns_base;
+    m_max_entries = ttl_seconds > 0 && max_entries > 0 ? max_entries : 0;
+    m_ttl = ttl_seconds > 0 ? static_cast<uint64_t>(ttl_seconds) * 1000000 : 0;
+}
+
+void CDNSCache::stop()
+{
+    for (auto& it : m_lookups) {
+        assert(it.second->waiters.empty());
+        it.second->request.free();
+    }
+    m_lookups.clear();
+    m_entries.clear();
+    m_lru.clear();
+    m_dns_base = nullptr;
+}
+
+void CDNSCache::lookup(CDNSResolve* client, const char* host, const char* port, const evutil_addrinfo* hints)
+{
+    assert(client != nullptr);
+    assert(client->m_lookup == nullptr);
+    assert(m_dns_base != nullptr);
+
+    CDNSCacheKey key;
+    key.host = host;
+    key.port = port;
+    key.family = hints->ai_family;
+    key.flags = hints->ai_flags;
+
+    CDNSResponse response;
+    if (find(key, response)) {
+        m_hits.add(1);
+        client->OnResolveSuccess(std::move(response));
+        return;
+    }
+
+    auto it = m_lookups.find(key);
+    if (it != m_lookups.end()) {
+        m_hits.add(1);
+        it->second->waiters.push_back(client);
+        client->m_lookup = it->second.get();
+        return;
+    }
+
+    CDNSLookup* lookup = new CDNSLookup;
+    lookup->cache = this;
+    lookup->key = key;
+    lookup->waiters.push_back(client);
+    client->m_lookup = lookup;
+    m_lookups[key].reset(lookup);
+
+    // evdns_getaddrinfo may return NULL on success, in which case the lookup
+    // has already completed and is gone.
+    evdns_getaddrinfo_request* request = evdns_getaddrinfo(m_dns_base, host, port, hints, dns_callback, lookup);
+    if (request != nullptr)
+        lookup->request.reset(request);
+}
+
+void CDNSCache::cancel(CDNSResolve* client)
+{
+    assert(client != nullptr);
+    assert(client->m_lookup != nullptr);
+    client->m_lookup->waiters.remove(client);
+    client->m_lookup = nullptr;
+}
+
+bool CDNSCache::find(const CDNSCacheKey& key, CDNSResponse& response)
+{
+    auto it = m_entries.find(key);
+    if (it == m_entries.end())
+        return false;
+    if (it->second.expires <= stats_now_micros()) {
+        m_lru.erase(it->second.lru);
+        m_entries.erase(it);
+        return false;
+    }
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    response = it->second.response;
+    return true;
+}
+
+void CDNSCache::store(const CDNSCacheKey& key, const CDNSResponse& response)
+{
+    if (m_max_entries == 0 || response.empty())
+        return;
+
+    auto it = m_entries.find(key);
+    if (it == m_entries.end()) {
+        m_lru.push_front(key);
+        it = m_entries.insert(std::make_pair(key, CEntry())).first;
+    } else {
+        m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+    }
+    it->second.response = response;
+    it->second.expires = stats_now_micros() + m_ttl;
+    it->second.lru = m_lru.begin();
+
+    if (m_entries.size() > m_max_entries) {
+        m_entries.erase(m_lru.back());
+        m_lru.pop_back();
+    }
+}
+
+void CDNSCache::complete(CDNSLookup* lookup, int result, const evutil_addrinfo* ai)
+{
+    auto it = m_lookups.find(lookup->key);
+    assert(it != m_lookups.end() && it->second.get() == lookup);
+    std::unique_ptr<CDNSLookup> done(std::move(it->second));
+    m_lookups.erase(it);
+
+    CDNSResponse response;
+    if (result == DNS_ERR_NONE) {
+        response = CDNSResponse::from_addrinfo(ai);
+        store(done->key, response);
+    }
+
+    // Each waiter may go away, or start another lookup, from its callback.
+    uint64_t now = stats_now_micros();
+    while (!done->waiters.empty()) {
+        CDNSResolve* client = done->waiters.front();
+        done->waiters.pop_front();
+        client->m_lookup = nullptr;
+        client->m_resolve_time = now - client->m_resolve_start;
+        client->m_resolve_timed = true;
+        if (result == DNS_ERR_NONE)
+            client->OnResolveSuccess(CDNSResponse(response));
+        else
+            client->OnResolveFailure(result);
+    }
+}
+
+void CDNSCache::dns_callback(int result, evutil_addrinfo* ai, void* ctx)
+{
+    if (result == EVUTIL_EAI_CANCEL) {
+        // Do nothing. Cache may no longer exist.
+        return;
+    }
+    assert(ctx != nullptr);
+    CDNSLookup* lookup = static_cast<CDNSLookup*>(ctx);
+    lookup->request.reset(nullptr);
+    lookup->cache->complete(lookup, result, ai);
+    if (ai != nullptr)
+        evutil_freeaddrinfo(ai);
+}
@@ -0,0 +1,85 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_DNSCACHE_H
+#define LIBBTCNET_SRC_DNSCACHE_H
+
+#include "eventtypes.h"
+#include "resolve.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+class CDNSResolve;
+class CStatCounter;
+struct evdns_base;
+struct evdns_getaddrinfo_request;
+
+// Lookups that would be answered the same way: the same name and port, asked
+// for with the same family and flags.
+struct CDNSCacheKey {
+    std::string host;
+    std::string port;
+    int family;
+    int flags;
+
+    bool operator<(const CDNSCacheKey& rhs) const;
+};
+
+// A lookup in progress, and everyone waiting on it.
+struct CDNSLookup {
+    CDNSCache* cache;
+    CDNSCacheKey key;
+    event_type<evdns_getaddrinfo_request> request;
+    std::list<CDNSResolve*> waiters;
+};
+
+// Shares lookups between everyone asking for the same name at once, and
+// remembers successful ones for a while afterwards so that retries and
+// repeated connections to the same host don't go back to the network.
+//
+// evdns_getaddrinfo does not pass on record TTLs, so answers are kept for a
+// fixed time. Only the least recently used max_entries are kept. Failures are
+// never cached. Event thread only.
+class CDNSCache
+{
+public:
+    explicit CDNSCache(CStatCounter& hits);
+    ~CDNSCache();
+
+    void start(const event_type<evdns_base>& dns_base, int max_entries, int ttl_seconds);
+    // Cancel everything in progress and forget all answers. Anyone still
+    // waiting must have cancelled already.
+    void stop();
+
+    void lookup(CDNSResolve* client, const char* host, const char* port, const evutil_addrinfo* hints);
+    void cancel(CDNSResolve* client);
+
+private:
+    struct CEntry {
+        CDNSResponse response;
+        uint64_t expires;
+        std::list<CDNSCacheKey>::iterator lru;
+    };
+
+    bool find(const CDNSCacheKey& key, CDNSResponse& response);
+    void store(const CDNSCacheKey& key, const CDNSResponse& response);
+    void complete(CDNSLookup* lookup, int result, const evutil_addrinfo* ai);
+    static void dns_callback(int result, evutil_addrinfo* ai, void* ctx);
+
+    evdns_base* m_dns_base;
+    size_t m_max_entries;
+    uint64_t m_ttl;
+    CStatCounter& m_hits;
+
+    std::map<CDNSCacheKey, std::unique_ptr<CDNSLookup> > m_lookups;
+    std::map<CDNSCacheKey, CEntry> m_entries;
+    // Most recently used first.
+    std::list<CDNSCacheKey> m_lru;
+};
+
+#endif // LIBBTCNET_SRC_DNSCACHE_H
@@ -13,8 +13,33 @@
 #include <string.h>
 #include <assert.h>
 
+CRaceAttempt::CRaceAttempt(CDNSConnection& owner, const CDNSAddress* addr)
+    : m_owner(owner), m_addr(addr)
+{
+}
+
+void CRaceAttempt::Start(const event_type<event_base>& base, int bev_opts, const timeval& connTimeout)
+{
+    BareConnect(base, bev_opts, BAD_SOCKET, m_addr->addr(), m_addr->len, connTimeout);
+}
+
+const CDNSAddress* CRaceAttempt::GetAddress() const
+{
+    return m_addr;
+}
+
+void CRaceAttempt::OnConnectSuccess(event_type<bufferevent>&& bev)
+{
+    m_owner.OnRaceSuccess(this, std::move(bev));
+}
+
+void CRaceAttempt::OnConnectFailure(short event, int /*error*/)
+{
+    m_owner.OnRaceFailure(this, event);
+}
+
 CDNSConnection::CDNSConnection(CConnectionHandlerInt& handler, CConnection&& conn, ConnID id)
-    : ConnectionBase(handler, std::move(conn), id), m_retries(m_connection.GetOptions().nRetries), m_dns_base(handler.GetDNSBase())
+    : ConnectionBase(handler, std::move(conn), id), m_retries(m_connection.GetOptions().nRetries), m_dns_cache(handler.GetDNSCache()), m_race_next(0), m_race_stagger_event(handler.GetEventBase(), -1, 0, std::bind(&CDNSConnection::RaceNext, this))
 {
 }
 
@@ -23,6 +48,11 @@ bool CDNSConnection::IsOutgoing() const
     return true;
 }
 
+bool CDNSConnection::IsMidAttempt() const
+{
+    return m_iter != m_resolved.end();
+}
+
 CDNSConnection::~CDNSConnection()
 {
     Cancel();
@@ -30,7 +60,7 @@ CDNSConnection::~CDNSConnection()
 
 void CDNSConnection::Connect()
 {
-    assert(!m_request);
+    assert(!IsResolving());
 
     if (m_iter == m_resolved.end())
         DoResolve();
@@ -40,7 +70,7 @@ void CDNSConnection::Connect()
 
 void CDNSConnection::DoResolve()
 {
-    assert(!m_request);
+    assert(!IsResolving());
     assert(m_resolved.empty());
     assert(m_iter == m_resolved.end());
 
@@ -53,29 +83,32 @@ void CDNSConnection::DoResolve()
     hint.ai_flags |= opts.doResolve == CConnectionOptions::NO_RESOLVE ? EVUTIL_AI_NUMERICHOST : EVUTIL_AI_ADDRCONFIG;
 
     if (m_connection.CanResolve() && SetResolveFamily(opts.nFamily, &hint))
-        m_request = Resolve(m_dns_base, m_connection.GetHost().c_str(), std::to_string(m_connection.GetPort()).c_str(), &hint);
+        Resolve(m_dns_cache, m_connection.GetHost(), std::to_string(m_connection.GetPort()), &hint);
     else
         OnResolveFailure(0);
 }
 
 void CDNSConnection::OnResolveFailure(int error)
 {
+    RecordResolveTime(m_handler.GetCounters().dns_latency);
     assert(m_resolved.empty());
     assert(m_iter == m_resolved.end());
 
-    m_request.reset(nullptr);
     OnConnectionFailure(ConnectionFailureType::RESOLVE, error, m_connection, m_retries > 0 ? m_retries-- != 0 : m_retries != 0);
 }
 
 void CDNSConnection::OnResolveSuccess(CDNSResponse&& response)
 {
+    RecordResolveTime(m_handler.GetCounters().dns_latency);
     assert(m_resolved.empty());
     assert(m_iter == m_resolved.end());
 
-    m_request.reset(nullptr);
     m_resolved = std::move(response);
     m_iter = m_resolved.begin();
-    ConnectResolved();
+    if (m_connection.GetOptions().nParallelConnects > 1)
+        StartRace();
+    else
+        ConnectResolved();
 }
 
 void CDNSConnection::OnConnectSuccess(event_type<bufferevent>&& bev)
@@ -83,9 +116,9 @@ void CDNSConnection::OnConnectSuccess(event_type<bufferevent>&& bev)
     assert(bev);
     assert(!m_resolved.empty());
     assert(m_iter != m_resolved.end());
-    assert(!m_request);
+    assert(!IsResolving());
 
-    CConnection resolved(m_connection.GetOptions(), m_connection.GetNetConfig(), m_iter->ai_addr, m_iter->ai_addrlen);
+    CConnection resolved(m_connection.GetOptions(), m_connection.GetNetConfig(), m_iter->addr(), m_iter->len);
     m_resolved.clear();
     m_iter = m_resolved.end();
     m_retries = m_connection.GetOptions().nRetries;
@@ -93,11 +126,11 @@ void CDNSConnection::OnConnectSuccess(event_type<bufferevent>&& bev)
 }
 void CDNSConnection::OnConnectFailure(short event, int /*error*/)
 {
-    assert(!m_request);
+    assert(!IsResolving());
     assert(m_iter != m_resolved.end());
     assert(!m_resolved.empty());
 
-    CConnection resolved(m_connection.GetOptions(), m_connection.GetNetConfig(), m_iter->ai_addr, m_iter->ai_addrlen);
+    CConnection resolved(m_connection.GetOptions(), m_connection.GetNetConfig(), m_iter->addr(), m_iter->len);
     if (++m_iter == m_resolved.end())
         m_resolved.clear();
     OnConnectionFailure(ConnectionFailureType::CONNECT, event, std::move(resolved), m_iter != m_resolved.end() || m_retries != 0);
@@ -112,15 +145,119 @@ void CDNSConnection::ConnectResolved()
     timeval connTimeout;
     connTimeout.tv_sec = opts.nConnTimeout;
     connTimeout.tv_usec = 0;
-    if (CConnection::CanConnectDirect(m_iter->ai_addr, opts.nFamily))
-        BareConnect(m_event_base, m_handler.GetBevOpts(), BAD_SOCKET, m_iter->ai_addr, m_iter->ai_addrlen, connTimeout);
+    if (CConnection::CanConnectDirect(m_iter->addr(), opts.nFamily))
+        BareConnect(m_event_base, m_handler.GetBevOpts(), BAD_SOCKET, m_iter->addr(), m_iter->len, connTimeout);
     else
         OnConnectFailure(0, 0);
 }
 
-void CDNSConnection::Cancel()
+void CDNSConnection::StartRace()
 {
-    m_request.free();
+    assert(m_attempts.empty());
+    assert(!m_resolved.empty());
+
+    // Alternate address families, starting with whichever the resolver
+    // listed first, so that a broken path for one family costs at most one
+    // stagger interval.
+    std::vector<const CDNSAddress*> first;
+    std::vector<const CDNSAddress*> second;
+    int first_family = m_resolved.begin()->addr()->sa_family;
+    for (auto it = m_resolved.begin(); it != m_resolved.end(); ++it) {
+        if (it->addr()->sa_family == first_family)
+            first.push_back(&*it);
+        else
+            second.push_back(&*it);
+    }
+    m_race_order.clear();
+    for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+        if (i < first.size())
+            m_race_order.push_back(first[i]);
+        if (i < second.size())
+            m_race_order.push_back(second[i]);
+    }
+    m_race_next = 0;
+    RaceNext();
+}
+
+void CDNSConnection::RaceNext()
+{
+    const CConnectionOptions& opts = m_connection.GetOptions();
+    if (static_cast<int>(m_attempts.size()) >= opts.nParallelConnects)
+        return;
+
+    m_race_stagger_event.del();
+    const CDNSAddress* failed = nullptr;
+    while (m_race_next < m_race_order.size()) {
+        const CDNSAddress* addr = m_race_order[m_race_next++];
+        if (!CConnection::CanConnectDirect(addr->addr(), opts.nFamily)) {
+            failed = addr;
+            continue;
+        }
+        timeval connTimeout;
+        connTimeout.tv_sec = opts.nConnTimeout;
+        connTimeout.tv_usec = 0;
+        m_attempts.emplace_back(new CRaceAttempt(*this, addr));
+        m_attempts.back()->Start(m_event_base, m_handler.GetBevOpts(), connTimeout);
+        break;
+    }
+
+    if (m_race_next < m_race_order.size()) {
+        timeval stagger;
+        stagger.tv_sec = opts.nConnectStagger / 1000;
+        stagger.tv_usec = (opts.nConnectStagger % 1000) * 1000;
+        m_race_stagger_event.add(&stagger);
+    } else if (m_attempts.empty()) {
+        // Nothing was connectable.
+        assert(failed != nullptr);
+        CConnection resolved(opts, m_connection.GetNetConfig(), failed->addr(), failed->len);
+        CancelRace();
+        OnConnectionFailure(ConnectionFailureType::CONNECT, 0, std::move(resolved), m_retries != 0);
+    }
+}
+
+void CDNSConnection::OnRaceSuccess(CRaceAttempt* attempt, event_type<bufferevent>&& bev)
+{
+    // bev belongs to attempt, which is about to be destroyed along with the
+    // others.
+    event_type<bufferevent> winner(std::move(bev));
+    assert(winner);
+    const CDNSAddress* addr = attempt->GetAddress();
+    CConnection resolved(m_connection.GetOptions(), m_connection.GetNetConfig(), addr->addr(), addr->len);
+    CancelRace();
+    m_retries = m_connection.GetOptions().nRetries;
+    OnOutgoingConnected(std::move(winner), std::move(resolved));
+}
+
+void CDNSConnection::OnRaceFailure(CRaceAttempt* attempt, short event)
+{
+    const CDNSAddress* addr = attempt->GetAddress();
+    for (auto it = m_attempts.begin(); it != m_attempts.end(); ++it) {
+        if (it->get() == attempt) {
+            m_attempts.erase(it);
+            break;
+        }
+    }
+    if (!m_attempts.empty() || m_race_next < m_race_order.size()) {
+        RaceNext();
+        return;
+    }
+    CConnection resolved(m_connection.GetOptions(), m_connection.GetNetConfig(), addr->addr(), addr->len);
+    CancelRace();
+    OnConnectionFailure(ConnectionFailureType::CONNECT, event, std::move(resolved), m_retries != 0);
+}
+
+void CDNSConnection::CancelRace()
+{
+    m_race_stagger_event.del();
+    m_attempts.clear();
+    m_race_order.clear();
+    m_race_next = 0;
     m_resolved.clear();
     m_iter = m_resolved.end();
 }
+
+void CDNSConnection::Cancel()
+{
+    CancelResolve();
+    CancelRace();
+}
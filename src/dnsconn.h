@@ -7,14 +7,39 @@
 
 #include "bareconn.h"
 #include "connectionbase.h"
+#include "event.h"
 #include "resolve.h"
 
+#include <list>
+#include <memory>
+#include <vector>
+
 class CConnection;
+class CDNSConnection;
 struct event_base;
 struct bufferevent;
 
+// One of several simultaneous attempts to connect to a resolved address.
+class CRaceAttempt final : public CBareConnection
+{
+public:
+    CRaceAttempt(CDNSConnection& owner, const CDNSAddress* addr);
+    void Start(const event_type<event_base>& base, int bev_opts, const timeval& connTimeout);
+    const CDNSAddress* GetAddress() const;
+
+protected:
+    void OnConnectSuccess(event_type<bufferevent>&& bev) final;
+    void OnConnectFailure(short event, int error) final;
+
+private:
+    CDNSConnection& m_owner;
+    const CDNSAddress* const m_addr;
+};
+
 class CDNSConnection final : public ConnectionBase, public CBareConnection, public CDNSResolve
 {
+    friend class CRaceAttempt;
+
 public:
     CDNSConnection(CConnectionHandlerInt& handler, CConnection&& conn, ConnID id);
     ~CDNSConnection() final;
@@ -27,15 +52,26 @@ protected:
     void OnConnectFailure(short event, int error) final;
     void OnResolveSuccess(CDNSResponse&& response) final;
     void OnResolveFailure(int error) final;
+    bool IsMidAttempt() const final;
 
 private:
     void DoResolve();
     void ConnectResolved();
+    void StartRace();
+    void RaceNext();
+    void OnRaceSuccess(CRaceAttempt* attempt, event_type<bufferevent>&& bev);
+    void OnRaceFailure(CRaceAttempt* attempt, short event);
+    void CancelRace();
     int m_retries;
     CDNSResponse m_resolved;
     CDNSResponse::iterator m_iter;
-    event_type<evdns_getaddrinfo_request> m_request;
-    const event_type<evdns_base>& m_dns_base;
+    CDNSCache& m_dns_cache;
+
+    // With nParallelConnects, the addresses in the order they are tried.
+    std::vector<const CDNSAddress*> m_race_order;
+    size_t m_race_next;
+    std::list<std::unique_ptr<CRaceAttempt> > m_attempts;
+    CEvent m_race_stagger_event;
 };
 
 #endif // LIBBTCNET_SRC_DNSCONN_H
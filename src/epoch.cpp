@@ -0,0 +1,137 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "epoch.h"
+
+#include <assert.h>
+#include <limits>
+
+#ifndef NO_THREADS
+#include <thread>
+#endif
+
+// One per thread that has ever entered a given manager. Records are never
+// freed before the manager, so readers can walk the list without locks.
+struct CEpochManager::CRecord {
+    CRecord* next;
+    // 0 while the thread is outside of a guard.
+    std::atomic<uint64_t> epoch;
+#ifndef NO_THREADS
+    std::thread::id owner;
+#endif
+};
+
+namespace
+{
+std::atomic<uint64_t> g_next_manager_id(1);
+
+// Each thread remembers its record for the manager it used last. Managers are
+// identified by id rather than address, so a stale entry can never match.
+struct CRecordCache {
+    uint64_t manager;
+    void* record;
+};
+thread_local CRecordCache g_record_cache = {0, nullptr};
+} // namespace
+
+CEpochManager::CEpochManager()
+    : m_id(g_next_manager_id.fetch_add(1, std::memory_order_relaxed)), m_epoch(1), m_records(nullptr)
+{
+}
+
+CEpochManager::~CEpochManager()
+{
+    assert(m_retired.empty());
+    CRecord* record = m_records.load(std::memory_order_acquire);
+    while (record != nullptr) {
+        CRecord* next = record->next;
+        assert(record->epoch.load(std::memory_order_relaxed) == 0);
+        delete record;
+        record = next;
+    }
+}
+
+CEpochManager::CRecord* CEpochManager::get_record()
+{
+    if (g_record_cache.manager == m_id)
+        return static_cast<CRecord*>(g_record_cache.record);
+
+    CRecord* record = m_records.load(std::memory_order_acquire);
+#ifndef NO_THREADS
+    const std::thread::id self = std::this_thread::get_id();
+    while (record != nullptr && record->owner != self)
+        record = record->next;
+#endif
+    if (record == nullptr) {
+        record = new CRecord;
+        record->epoch.store(0, std::memory_order_relaxed);
+#ifndef NO_THREADS
+        record->owner = self;
+#endif
+        CRecord* head = m_records.load(std::memory_order_relaxed);
+        do {
+            record->next = head;
+        } while (!m_records.compare_exchange_weak(head, record, std::memory_order_release, std::memory_order_relaxed));
+    }
+    g_record_cache.manager = m_id;
+    g_record_cache.record = record;
+    return record;
+}
+
+CEpochManager::CRecord* CEpochManager::enter()
+{
+    CRecord* record = get_record();
+    assert(record->epoch.load(std::memory_order_relaxed) == 0);
+    record->epoch.store(m_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    // Publish the epoch before reading anything it protects.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return record;
+}
+
+void CEpochManager::exit(CRecord* record)
+{
+    record->epoch.store(0, std::memory_order_release);
+}
+
+void CEpochManager::retire(void* obj, void (*deleter)(void*))
+{
+    // The object is already unlinked, so any reader still holding it entered
+    // at or before the current epoch.
+    m_retired.push_back({m_epoch.load(std::memory_order_seq_cst), obj, deleter});
+}
+
+bool CEpochManager::reclaim()
+{
+    if (m_retired.empty())
+        return true;
+
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (CRecord* record = m_records.load(std::memory_order_acquire); record != nullptr; record = record->next) {
+        uint64_t epoch = record->epoch.load(std::memory_order_seq_cst);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < m_retired.size(); ++i) {
+        if (m_retired[i].epoch < oldest)
+            m_retired[i].deleter(m_retired[i].obj);
+        else
+            m_retired[kept++] = m_retired[i];
+    }
+    m_retired.resize(kept);
+
+    // Readers entering from now on can't see anything retired so far.
+    m_epoch.fetch_add(1, std::memory_order_seq_cst);
+    return m_retired.empty();
+}
+
+void CEpochManager::reclaim_all()
+{
+    while (!reclaim()) {
+#ifndef NO_THREADS
+        std::this_thread::yield();
+#endif
+    }
+}
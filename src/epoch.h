@@ -0,0 +1,80 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_EPOCH_H
+#define LIBBTCNET_SRC_EPOCH_H
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+// Epoch-based reclamation. Readers on any thread hold a CEpochGuard while
+// they use objects found through a lock-free structure. The owning thread
+// unlinks objects and retires them, and they are only deleted once no reader
+// that could have seen them is still inside a guard.
+//
+// retire() and reclaim() must only be called from the owning thread.
+class CEpochManager
+{
+    friend class CEpochGuard;
+
+public:
+    CEpochManager();
+    ~CEpochManager();
+
+    template <typename T>
+    void retire(T* obj)
+    {
+        retire(obj, &delete_obj<T>);
+    }
+
+    // Delete whatever is no longer reachable by a reader. Returns true if
+    // nothing is left waiting.
+    bool reclaim();
+
+    // Wait for readers until everything retired has been deleted.
+    void reclaim_all();
+
+private:
+    struct CRecord;
+    struct CRetired {
+        uint64_t epoch;
+        void* obj;
+        void (*deleter)(void*);
+    };
+
+    template <typename T>
+    static void delete_obj(void* obj)
+    {
+        delete static_cast<T*>(obj);
+    }
+
+    void retire(void* obj, void (*deleter)(void*));
+    CRecord* enter();
+    static void exit(CRecord* record);
+    CRecord* get_record();
+
+    const uint64_t m_id;
+    std::atomic<uint64_t> m_epoch;
+    std::atomic<CRecord*> m_records;
+    std::vector<CRetired> m_retired;
+
+    CEpochManager(const CEpochManager&) = delete;
+    CEpochManager& operator=(const CEpochManager&) = delete;
+};
+
+class CEpochGuard
+{
+public:
+    explicit CEpochGuard(CEpochManager& manager) : m_record(manager.enter()) {}
+    ~CEpochGuard() { CEpochManager::exit(m_record); }
+
+private:
+    CEpochManager::CRecord* m_record;
+
+    CEpochGuard(const CEpochGuard&) = delete;
+    CEpochGuard& operator=(const CEpochGuard&) = delete;
+};
+
+#endif // LIBBTCNET_SRC_EPOCH_H
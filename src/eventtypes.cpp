@@ -55,6 +55,12 @@ void event_type<bufferevent>::obj_free(bufferevent* tofree)
     bufferevent_free(tofree);
 }
 
+template <>
+void event_type<evbuffer>::obj_free(evbuffer* tofree)
+{
+    evbuffer_free(tofree);
+}
+
 template <>
 void event_type<evconnlistener>::obj_free(evconnlistener* tofree)
 {
@@ -15,6 +15,7 @@ struct bufferevent_rate_limit_group;
 struct event_base;
 struct evdns_base;
 struct bufferevent;
+struct evbuffer;
 struct evconnlistener;
 struct evdns_getaddrinfo_request;
 
@@ -0,0 +1,373 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_FRAMER_H
+#define LIBBTCNET_SRC_FRAMER_H
+
+#include "libbtcnet/networkconfig.h"
+
+#include <event2/buffer.h>
+
+#include <algorithm>
+#include <assert.h>
+#include <limits>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// Size fields. Read() returns false for a malformed field, and sets used to 0
+// if more bytes are needed.
+
+template <size_t Bytes, bool BigEndian>
+struct CFixedSizeField {
+    static size_t MinSize(const CNetworkConfig& /*unused*/) { return Bytes; }
+    static size_t MaxSize(const CNetworkConfig& /*unused*/) { return Bytes; }
+    static bool Read(const CNetworkConfig& /*unused*/, const unsigned char* buf, size_t len, uint64_t& value, size_t& used)
+    {
+        used = 0;
+        if (len < Bytes)
+            return true;
+        value = 0;
+        for (size_t i = 0; i < Bytes; ++i)
+            value |= static_cast<uint64_t>(buf[BigEndian ? Bytes - 1 - i : i]) << (8 * i);
+        used = Bytes;
+        return true;
+    }
+};
+
+// Fixed-width fields of an unusual width, read at runtime.
+template <bool BigEndian>
+struct CFixedSizeField<0, BigEndian> {
+    static size_t MinSize(const CNetworkConfig& config) { return config.header_msg_size_size; }
+    static size_t MaxSize(const CNetworkConfig& config) { return config.header_msg_size_size; }
+    static bool Read(const CNetworkConfig& config, const unsigned char* buf, size_t len, uint64_t& value, size_t& used)
+    {
+        const size_t bytes = config.header_msg_size_size;
+        used = 0;
+        if (len < bytes)
+            return true;
+        value = 0;
+        for (size_t i = 0; i < bytes; ++i)
+            value |= static_cast<uint64_t>(buf[BigEndian ? bytes - 1 - i : i]) << (8 * i);
+        used = bytes;
+        return true;
+    }
+};
+
+struct CCompactSizeField {
+    static size_t MinSize(const CNetworkConfig& /*unused*/) { return 1; }
+    static size_t MaxSize(const CNetworkConfig& /*unused*/) { return 9; }
+    static bool Read(const CNetworkConfig& /*unused*/, const unsigned char* buf, size_t len, uint64_t& value, size_t& used)
+    {
+        used = 0;
+        if (len < 1)
+            return true;
+        if (buf[0] < 0xfd) {
+            value = buf[0];
+            used = 1;
+            return true;
+        }
+        const size_t bytes = buf[0] == 0xfd ? 2 : buf[0] == 0xfe ? 4 : 8;
+        if (len < 1 + bytes)
+            return true;
+        value = 0;
+        for (size_t i = 0; i < bytes; ++i)
+            value |= static_cast<uint64_t>(buf[1 + i]) << (8 * i);
+        used = 1 + bytes;
+        return true;
+    }
+};
+
+struct CVarIntSizeField {
+    static size_t MinSize(const CNetworkConfig& /*unused*/) { return 1; }
+    static size_t MaxSize(const CNetworkConfig& /*unused*/) { return 10; }
+    static bool Read(const CNetworkConfig& /*unused*/, const unsigned char* buf, size_t len, uint64_t& value, size_t& used)
+    {
+        used = 0;
+        value = 0;
+        for (size_t i = 0; i < len && i < 10; ++i) {
+            uint64_t bits = buf[i] & 0x7f;
+            if (i == 9 && bits > 1)
+                return false;
+            value |= bits << (7 * i);
+            if ((buf[i] & 0x80) == 0) {
+                used = i + 1;
+                return true;
+            }
+        }
+        return len < 10;
+    }
+};
+
+// Frames described by a size field at header_msg_size_offset. The reported
+// size includes the header. Variable-width size fields shrink the header by
+// however many bytes they don't use.
+template <typename SizeField>
+struct CHeaderFramer {
+    static size_t MinHeaderSize(const CNetworkConfig& config)
+    {
+        return config.header_msg_size_offset + SizeField::MinSize(config);
+    }
+    static size_t MaxHeaderSize(const CNetworkConfig& config)
+    {
+        return config.header_msg_size_offset + SizeField::MaxSize(config);
+    }
+    static bool Decode(const CNetworkConfig& config, const unsigned char* header, size_t len, uint64_t& framesize)
+    {
+        const size_t offset = config.header_msg_size_offset;
+        assert(len >= offset);
+        uint64_t payload = 0;
+        size_t used = 0;
+        framesize = 0;
+        if (!SizeField::Read(config, header + offset, len - offset, payload, used))
+            return false;
+        if (used == 0)
+            return true;
+        const uint64_t headersize = config.header_size - SizeField::MaxSize(config) + used;
+        if (payload > std::numeric_limits<uint64_t>::max() - headersize)
+            return false;
+        framesize = headersize + payload;
+        return true;
+    }
+};
+
+// The virtual fallback, for CNetworkConfig::frame_decoder.
+struct CCustomFramer {
+    static size_t MinHeaderSize(const CNetworkConfig& config)
+    {
+        return config.frame_decoder->GetMinHeaderSize();
+    }
+    static size_t MaxHeaderSize(const CNetworkConfig& config)
+    {
+        return config.frame_decoder->GetMaxHeaderSize();
+    }
+    static bool Decode(const CNetworkConfig& config, const unsigned char* header, size_t len, uint64_t& framesize)
+    {
+        return config.frame_decoder->Decode(header, len, framesize);
+    }
+};
+
+typedef CHeaderFramer<CFixedSizeField<4, false> > CLE32Framer;
+typedef CHeaderFramer<CFixedSizeField<4, true> > CBE32Framer;
+
+// What is known of the message at the front of a connection's input, carried
+// from one read to the next so that its header is only parsed once.
+struct CFrameState {
+    CFrameState() : msgsize(0) {}
+    // The message's size, once its header has been checked. 0 until then.
+    uint64_t msgsize;
+};
+
+// Headers split across chains are copied out to here, unless longer.
+constexpr size_t max_stack_header_size = 64;
+
+// The number of bytes that must be buffered before a message's size can be
+// determined.
+template <typename Framer>
+inline size_t min_header_size(const CNetworkConfig& config)
+{
+    return std::max(Framer::MinHeaderSize(config), config.message_start.size());
+}
+
+// Check the start of a message, of which header_len bytes are available out
+// of nTotal buffered, and read its size if it is known yet.
+template <typename Framer>
+uint64_t decode_message_header(const CNetworkConfig& config, const unsigned char* header, size_t header_len, size_t nTotal, bool& fComplete, bool& fBadMsgStart)
+{
+    if (!config.message_start.empty() && memcmp(header, &config.message_start[0], config.message_start.size()) != 0) {
+        fBadMsgStart = true;
+        return 0;
+    }
+
+    uint64_t nMessageSize = 0;
+    if (!Framer::Decode(config, header, std::min(header_len, Framer::MaxHeaderSize(config)), nMessageSize)) {
+        fBadMsgStart = true;
+        return 0;
+    }
+    if (nMessageSize != 0 && nTotal >= nMessageSize)
+        fComplete = true;
+    return nMessageSize;
+}
+
+// See first_complete_message_size. This is the implementation, specialised
+// for each framer.
+template <typename Framer>
+uint64_t next_complete_message_size(const CNetworkConfig& config, evbuffer* input, evbuffer_ptr* pos, size_t nTotal, bool& fComplete, bool& fBadMsgStart)
+{
+    fComplete = false;
+    fBadMsgStart = false;
+
+    if (nTotal < min_header_size<Framer>(config))
+        return 0;
+
+    const size_t header_len = std::min(nTotal, std::max(Framer::MaxHeaderSize(config), config.message_start.size()));
+    const unsigned char* header;
+    unsigned char stack_header[max_stack_header_size];
+    std::vector<unsigned char> partial_header;
+    evbuffer_iovec v;
+    if (evbuffer_peek(input, header_len, pos, &v, 1) == 1) {
+        header = static_cast<const unsigned char*>(v.iov_base);
+    } else {
+        unsigned char* copy = stack_header;
+        if (header_len > sizeof(stack_header)) {
+            partial_header.resize(header_len);
+            copy = &partial_header[0];
+        }
+        ev_ssize_t ret = evbuffer_copyout_from(input, pos, copy, header_len);
+        assert(ret == static_cast<ev_ssize_t>(header_len));
+        (void)ret;
+        header = copy;
+    }
+    return decode_message_header<Framer>(config, header, header_len, nTotal, fComplete, fBadMsgStart);
+}
+
+// Find the complete messages at the front of input. Their sizes are appended
+// to sizes, and their combined size is added to totalsize. Returns the size of
+// the message following them if it is known yet, otherwise 0. Stops at a
+// malformed message, setting fBadMsgStart, or at one larger than
+// config.message_max_size, setting fTooBig.
+//
+// state carries the size of the message following them to the next call,
+// which expects the complete messages to have been removed by then. Until
+// that message is complete, calls return at once.
+template <typename Framer>
+uint64_t find_complete_messages(const CNetworkConfig& config, evbuffer* input, CFrameState& state, std::vector<size_t>& sizes, size_t& totalsize, bool& fBadMsgStart, bool& fTooBig)
+{
+    fTooBig = false;
+    fBadMsgStart = false;
+    size_t remaining = evbuffer_get_length(input);
+    if (remaining < state.msgsize)
+        return state.msgsize;
+    evbuffer_ptr pos;
+    evbuffer_ptr_set(input, &pos, 0, EVBUFFER_PTR_SET);
+    if (state.msgsize != 0) {
+        sizes.push_back(state.msgsize);
+        totalsize += state.msgsize;
+        remaining -= state.msgsize;
+        evbuffer_ptr_set(input, &pos, state.msgsize, EVBUFFER_PTR_ADD);
+    }
+
+    uint64_t msgsize = 0;
+    bool fComplete = false;
+    do {
+        msgsize = next_complete_message_size<Framer>(config, input, &pos, remaining, fComplete, fBadMsgStart);
+        if (config.message_max_size > 0 && msgsize > config.message_max_size) {
+            fTooBig = true;
+            break;
+        } else if (fBadMsgStart) {
+            break;
+        } else if (msgsize != 0 && fComplete) {
+            sizes.push_back(msgsize);
+            totalsize += msgsize;
+            remaining -= msgsize;
+            evbuffer_ptr_set(input, &pos, msgsize, EVBUFFER_PTR_ADD);
+        }
+    } while (fComplete);
+    state.msgsize = fTooBig || fBadMsgStart ? 0 : msgsize;
+    return msgsize;
+}
+
+// The same, for messages read into contiguous memory, which are parsed where
+// they lie.
+template <typename Framer>
+uint64_t find_complete_messages(const CNetworkConfig& config, const unsigned char* data, size_t len, CFrameState& state, std::vector<size_t>& sizes, size_t& totalsize, bool& fBadMsgStart, bool& fTooBig)
+{
+    fTooBig = false;
+    fBadMsgStart = false;
+    if (len < state.msgsize)
+        return state.msgsize;
+    if (state.msgsize != 0) {
+        sizes.push_back(state.msgsize);
+        totalsize += state.msgsize;
+        data += state.msgsize;
+        len -= state.msgsize;
+        state.msgsize = 0;
+    }
+    const size_t min_header = min_header_size<Framer>(config);
+    const size_t max_header = std::max(Framer::MaxHeaderSize(config), config.message_start.size());
+
+    uint64_t msgsize = 0;
+    bool fComplete = false;
+    do {
+        fComplete = false;
+        if (len < min_header)
+            return 0;
+        msgsize = decode_message_header<Framer>(config, data, std::min(len, max_header), len, fComplete, fBadMsgStart);
+        if (config.message_max_size > 0 && msgsize > config.message_max_size) {
+            fTooBig = true;
+            break;
+        } else if (fBadMsgStart) {
+            break;
+        } else if (msgsize != 0 && fComplete) {
+            sizes.push_back(msgsize);
+            totalsize += msgsize;
+            data += msgsize;
+            len -= msgsize;
+        }
+    } while (fComplete);
+    state.msgsize = fTooBig || fBadMsgStart ? 0 : msgsize;
+    return msgsize;
+}
+
+// Whether a config describes framing that select_framer can handle. Configs
+// that fail this are rejected before any connection uses them.
+inline bool valid_framing(const CNetworkConfig& config)
+{
+    if (config.frame_decoder || config.chunk_size > 0)
+        return true;
+    switch (config.header_msg_size_encoding) {
+    case CNetworkConfig::SIZE_COMPACT:
+        return config.header_msg_size_size == 9;
+    case CNetworkConfig::SIZE_VARINT:
+        return config.header_msg_size_size == 10;
+    case CNetworkConfig::SIZE_BIG_ENDIAN:
+    case CNetworkConfig::SIZE_LITTLE_ENDIAN:
+        return config.header_msg_size_size > 0 && config.header_msg_size_size <= 8;
+    }
+    return false;
+}
+
+// Choose the framer for a config, which must pass valid_framing. Selector<Framer>::get() is returned for the
+// chosen framer, so that callers can pick a specialised function once per
+// connection rather than branching on every read.
+template <template <typename> class Selector>
+typename Selector<CLE32Framer>::type select_framer(const CNetworkConfig& config)
+{
+    if (config.frame_decoder)
+        return Selector<CCustomFramer>::get();
+
+    switch (config.header_msg_size_encoding) {
+    case CNetworkConfig::SIZE_COMPACT:
+        assert(config.header_msg_size_size == 9);
+        return Selector<CHeaderFramer<CCompactSizeField> >::get();
+    case CNetworkConfig::SIZE_VARINT:
+        assert(config.header_msg_size_size == 10);
+        return Selector<CHeaderFramer<CVarIntSizeField> >::get();
+    case CNetworkConfig::SIZE_BIG_ENDIAN:
+        switch (config.header_msg_size_size) {
+        case 2:
+            return Selector<CHeaderFramer<CFixedSizeField<2, true> > >::get();
+        case 4:
+            return Selector<CBE32Framer>::get();
+        default:
+            assert(config.header_msg_size_size > 0 && config.header_msg_size_size <= 8);
+            return Selector<CHeaderFramer<CFixedSizeField<0, true> > >::get();
+        }
+    case CNetworkConfig::SIZE_LITTLE_ENDIAN:
+        break;
+    }
+
+    switch (config.header_msg_size_size) {
+    case 2:
+        return Selector<CHeaderFramer<CFixedSizeField<2, false> > >::get();
+    case 4:
+        return Selector<CLE32Framer>::get();
+    default:
+        assert(config.header_msg_size_size > 0 && config.header_msg_size_size <= 8);
+        return Selector<CHeaderFramer<CFixedSizeField<0, false> > >::get();
+    }
+}
+
+#endif // LIBBTCNET_SRC_FRAMER_H
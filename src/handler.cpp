@@ -8,6 +8,7 @@
 #include "libbtcnet/handler.h"
 
 #include "eventtypes.h"
+#include "framer.h"
 #include "logger.h"
 #include "listener.h"
 #include "incomingconn.h"
@@ -15,6 +16,7 @@
 #include "dnsconn.h"
 #include "resolveonly.h"
 #include "proxyconn.h"
+#include "sendqueue.h"
 #include "threads.h"
 
 #include <event2/bufferevent.h>
@@ -22,14 +24,12 @@
 #include <event2/event.h>
 #include <event2/util.h>
 
+#include <algorithm>
 #include <assert.h>
 #include <string.h>
-#include <limits>
-
-static constexpr int g_max_simultaneous_connecting = 8;
 
 CConnectionHandlerInt::CConnectionHandlerInt(CConnectionHandler& handler, bool enable_threading)
-    : m_interface(handler), m_connection_index(0), m_bytes_read(0), m_bytes_written(0), m_outgoing_conn_count(0), m_incoming_conn_count(0), m_outgoing_conn_limit(0), m_enable_threading(enable_threading), m_shutdown(false)
+    : m_interface(handler), m_bytes_read(0), m_bytes_written(0), m_dns_cache(m_counters.dns_cache_hits), m_outgoing_conn_count(0), m_incoming_conn_count(0), m_outgoing_conn_limit(0), m_connecting_limit(0), m_enable_threading(enable_threading), m_shutdown(false)
 {
     bool result = true;
     if (m_enable_threading)
@@ -40,7 +40,7 @@ CConnectionHandlerInt::CConnectionHandlerInt(CConnectionHandler& handler, bool e
 
 CConnectionHandlerInt::~CConnectionHandlerInt() = default;
 
-void CConnectionHandlerInt::Start(int outgoing_limit)
+void CConnectionHandlerInt::Start(int outgoing_limit, const CHandlerOptions& opts)
 {
     int result = 0;
     m_shutdown = false;
@@ -58,6 +58,10 @@ void CConnectionHandlerInt::Start(int outgoing_limit)
     assert(!m_shutdown_event);
 
     m_outgoing_conn_limit = outgoing_limit;
+    m_options = opts;
+    m_options.nConnecting = std::max(m_options.nConnecting, 1);
+    m_connecting_limit = m_options.nConnecting;
+    m_options.fLockFreeSend = m_options.fLockFreeSend && m_enable_threading;
 
     event_type<event_config> cfg(event_config_new());
     result = event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
@@ -71,14 +75,19 @@ void CConnectionHandlerInt::Start(int outgoing_limit)
         assert(result == 0);
         (void)result;
     }
-    cfg.free();
 
     m_dns_base = evdns_base_new(m_event_base, 1);
     result = evdns_base_set_option(m_dns_base, "randomize-case", "0");
     assert(result == 0);
     (void)result;
+    m_dns_cache.start(m_dns_base, m_options.nDnsCacheSize, m_options.nDnsCacheSeconds);
 
     event_base_priority_init(m_event_base, 3);
+    m_timers.start(m_event_base, m_enable_threading);
+    if (m_options.nIOEngine == CHandlerOptions::IO_URING && !m_uring.start(m_event_base, GetBevOpts())) {
+        DEBUG_PRINT(LOGWARN, "io_uring unavailable, falling back to bufferevents");
+        m_options.nIOEngine = CHandlerOptions::IO_BUFFEREVENT;
+    }
 
     m_request_event.reset(m_event_base, -1, EV_PERSIST, std::bind(&CConnectionHandlerInt::RequestOutgoingInt, this));
     m_shutdown_event.reset(m_event_base, -1, 0, std::bind(&CConnectionHandlerInt::ShutdownInt, this));
@@ -91,6 +100,19 @@ void CConnectionHandlerInt::Start(int outgoing_limit)
     m_outgoing_rate_limit = bufferevent_rate_limit_group_new(m_event_base, m_outgoing_rate_cfg);
     m_incoming_rate_limit = bufferevent_rate_limit_group_new(m_event_base, m_incoming_rate_cfg);
 
+    assert(m_shards.empty());
+    if (m_enable_threading && m_options.nShards > 0) {
+        m_main_queue.reset(m_event_base);
+        for (int i = 0; i < m_options.nShards; i++) {
+            std::unique_ptr<CShard> shard(new CShard);
+            result = shard->Start(cfg, m_options.nIOEngine == CHandlerOptions::IO_URING, GetBevOpts());
+            assert(result);
+            (void)result;
+            m_shards.push_back(std::move(shard));
+        }
+    }
+    cfg.free();
+
     timeval request_timeout = {0, 500000};
     m_request_event.add(&request_timeout);
     m_interface.OnStartup();
@@ -106,12 +128,18 @@ void CConnectionHandlerInt::ShutdownInt()
 
     DEBUG_PRINT(LOGINFO, "shutdown started");
 
-    std::map<ConnID, std::unique_ptr<ConnectionBase> > disconnecting;
+    // Quiesce the shards so that their connections can be torn down from
+    // here, then catch up on anything they had queued.
+    StopShards();
+    if (m_main_queue)
+        m_main_queue.run();
+
+    CSlotMap<ConnectionBase> disconnecting;
     {
         optional_lock(m_conn_mutex, m_enable_threading);
         disconnecting.swap(m_connected);
     }
-    std::map<ConnID, std::unique_ptr<CConnListener> > binds;
+    CSlotMap<CConnListener> binds;
     {
         optional_lock(m_bind_mutex, m_enable_threading);
         binds.swap(m_binds);
@@ -119,24 +147,38 @@ void CConnectionHandlerInt::ShutdownInt()
 
     m_shutdown = true;
 
-    for (auto iter = disconnecting.begin(); iter != disconnecting.end(); disconnecting.erase(iter++)) {
-        if (iter->second->IsOutgoing())
+    disconnecting.consume([this](ConnID id, std::unique_ptr<ConnectionBase>&& conn) {
+        {
+            optional_lock(m_conn_mutex, m_enable_threading);
+            conn->RefreshCounters();
+            conn->GetCounters().add_to(m_closed_stats);
+        }
+        conn->ReportBytes();
+        DetachSendQueue(id);
+        if (conn->IsOutgoing())
             m_outgoing_conn_count--;
         else
             m_incoming_conn_count--;
-        m_interface.OnDisconnected(iter->first, false);
-    }
-
-    for (auto iter = m_connecting.begin(); iter != m_connecting.end(); m_connecting.erase(iter++)) {
-        if (iter->second->IsOutgoing()) {
-            const CConnection& conn = iter->second->GetBaseConnection();
-            m_interface.OnConnectionFailure(conn, conn, false);
+        m_interface.OnDisconnected(id, false);
+        ReleaseConnectionIndex(id);
+    });
+
+    m_connecting.consume([this](ConnID id, std::unique_ptr<ConnectionBase>&& conn) {
+        if (conn->IsOutgoing()) {
+            const CConnection& base = conn->GetBaseConnection();
+            m_interface.OnConnectionFailure(base, base, false);
         }
-    }
+        ReleaseConnectionIndex(id);
+    });
 
-    m_dns_resolves.clear();
-    binds.clear();
+    m_dns_resolves.consume([this](ConnID id, std::unique_ptr<CResolveOnly>&& /*unused*/) {
+        ReleaseConnectionIndex(id);
+    });
+    binds.consume([this](ConnID id, std::unique_ptr<CConnListener>&& /*unused*/) {
+        ReleaseConnectionIndex(id);
+    });
 
+    m_dns_cache.stop();
     m_dns_base.free();
     m_outgoing_rate_limit.free();
     m_incoming_rate_limit.free();
@@ -144,6 +186,11 @@ void CConnectionHandlerInt::ShutdownInt()
     m_outgoing_rate_cfg.free();
     m_request_event.free();
     m_shutdown_event.free();
+    m_timers.stop();
+    m_uring.stop();
+    m_epochs.reclaim_all();
+    m_shards.clear();
+    m_main_queue.free();
 
     assert(m_connecting.empty());
     assert(disconnecting.empty());
@@ -167,6 +214,61 @@ const event_type<evdns_base>& CConnectionHandlerInt::GetDNSBase() const
     return m_dns_base;
 }
 
+CDNSCache& CConnectionHandlerInt::GetDNSCache()
+{
+    assert(IsEventThread());
+    return m_dns_cache;
+}
+
+CTimerWheel& CConnectionHandlerInt::GetTimers()
+{
+    return m_timers;
+}
+
+CUringEngine* CConnectionHandlerInt::GetUring()
+{
+    return m_uring.running() ? &m_uring : nullptr;
+}
+
+CHandlerCounters& CConnectionHandlerInt::GetCounters()
+{
+    return m_counters;
+}
+
+CHandlerStats CConnectionHandlerInt::GetStats()
+{
+    CHandlerStats stats;
+    {
+        optional_lock(m_conn_mutex, m_enable_threading);
+        stats.connections = m_closed_stats;
+        m_connected.for_each([&stats](ConnID /*unused*/, ConnectionBase& conn) {
+            conn.RefreshCounters();
+            conn.GetCounters().add_to(stats.connections);
+        });
+    }
+    stats.nIncomingAccepted = m_counters.incoming_accepted.get();
+    stats.nOutgoingConnected = m_counters.outgoing_connected.get();
+    stats.nConnectFailures = m_counters.connect_failures.get();
+    stats.nDnsFailures = m_counters.dns_failures.get();
+    stats.nDnsCacheHits = m_counters.dns_cache_hits.get();
+    stats.nReconnects = m_counters.reconnects.get();
+    m_counters.connect_latency.snapshot(stats.connectLatency);
+    m_counters.dns_latency.snapshot(stats.dnsLatency);
+    return stats;
+}
+
+bool CConnectionHandlerInt::GetConnectionStats(ConnID id, CConnectionStats& stats)
+{
+    optional_lock(m_conn_mutex, m_enable_threading);
+    ConnectionBase* conn = m_connected.find(id);
+    if (conn == nullptr)
+        return false;
+    conn->RefreshCounters();
+    stats = CConnectionStats();
+    conn->GetCounters().add_to(stats);
+    return true;
+}
+
 bool CConnectionHandlerInt::IsEventThread() const
 {
 #ifdef NO_THREADS
@@ -178,46 +280,83 @@ bool CConnectionHandlerInt::IsEventThread() const
 #endif
 }
 
+// Connections only call back from another thread when they are on a shard.
+bool CConnectionHandlerInt::QueueCallbacks() const
+{
+    return !IsEventThread() && m_options.nDispatch == CHandlerOptions::DISPATCH_MERGED;
+}
+
+// The shard with the fewest connections, or nullptr if not sharding.
+CShard* CConnectionHandlerInt::SelectShard() const
+{
+    CShard* ret = nullptr;
+    for (const auto& shard : m_shards) {
+        if (ret == nullptr || shard->GetConnectionCount() < ret->GetConnectionCount())
+            ret = shard.get();
+    }
+    return ret;
+}
+
+void CConnectionHandlerInt::StopShards()
+{
+    assert(IsEventThread());
+    for (const auto& shard : m_shards)
+        shard->Stop();
+}
+
 void CConnectionHandlerInt::OnResolveComplete(ConnID id, const CConnection& conn, std::list<CConnection> resolved)
 {
     assert(IsEventThread());
     m_interface.OnDnsResponse(conn, std::move(resolved));
     m_dns_resolves.erase(id);
+    ReleaseConnectionIndex(id);
 }
 
 void CConnectionHandlerInt::OnResolveFailure(ConnID id, const CConnection& conn, int /*error*/, bool retry)
 {
     assert(IsEventThread());
+    m_counters.dns_failures.add(1);
     retry = retry && !m_shutdown;
     bool ret = m_interface.OnDnsFailure(conn, retry);
-    auto it = m_dns_resolves.find(id);
-    assert(it != m_dns_resolves.end());
-    if (retry && ret)
-        it->second->Retry();
-    else
-        m_dns_resolves.erase(it);
+    CResolveOnly* resolve = m_dns_resolves.find(id);
+    assert(resolve != nullptr);
+    if (retry && ret) {
+        resolve->Retry();
+    } else {
+        m_dns_resolves.erase(id);
+        ReleaseConnectionIndex(id);
+    }
     if (m_request_event)
         m_request_event.active();
 }
 
 void CConnectionHandlerInt::OnWriteBufferReady(ConnID id, size_t bufsize)
 {
-    assert(IsEventThread());
-    m_interface.OnWriteBufferReady(id, bufsize);
+    if (QueueCallbacks())
+        m_main_queue.post(std::bind(&CConnectionHandlerInt::OnWriteBufferReady, this, id, bufsize));
+    else
+        m_interface.OnWriteBufferReady(id, bufsize);
 }
 
 void CConnectionHandlerInt::OnDisconnected(ConnID id, bool reconnect)
 {
-    assert(IsEventThread());
+    if (!IsEventThread()) {
+        m_main_queue.post(std::bind(&CConnectionHandlerInt::OnDisconnected, this, id, reconnect));
+        return;
+    }
     std::unique_ptr<ConnectionBase> moved;
     reconnect = reconnect && !m_shutdown;
     {
         optional_lock(m_conn_mutex, m_enable_threading);
-        auto it = m_connected.find(id);
-        assert(it != m_connected.end());
-        moved.swap(it->second);
-        m_connected.erase(it);
+        moved = m_connected.take(id);
+        if (moved)
+            moved->GetCounters().add_to(m_closed_stats);
     }
+    assert(moved);
+    DetachSendQueue(id);
+
+    if (moved->GetShard() != nullptr)
+        moved->GetShard()->RemoveConnection();
 
     bool outgoing = moved->IsOutgoing();
     if (outgoing)
@@ -226,10 +365,11 @@ void CConnectionHandlerInt::OnDisconnected(ConnID id, bool reconnect)
         m_incoming_conn_count--;
 
     bool ret = m_interface.OnDisconnected(id, reconnect);
+    ReleaseConnectionIndex(id);
     if (reconnect && ret) {
+        m_counters.reconnects.add(1);
         ConnID newId = GetNextConnectionIndex();
-        auto it = m_connecting.emplace_hint(m_connecting.end(), newId, std::move(moved));
-        it->second->Retry(newId);
+        m_connecting.insert(newId, std::move(moved))->Retry(newId);
     } else if (m_request_event)
         m_request_event.active();
 }
@@ -240,40 +380,46 @@ void CConnectionHandlerInt::OnIncomingConnection(const CConnection& bind, evutil
 
     ConnID id = GetNextConnectionIndex();
     std::unique_ptr<ConnectionBase> ptr(new CIncomingConn(*this, bind, id, sock, address, socklen));
-    {
-        auto it = m_connecting.emplace_hint(m_connecting.end(), id, std::move(ptr));
-        it->second->Connect();
-    }
+    m_connecting.insert(id, std::move(ptr))->Connect();
 }
 
 void CConnectionHandlerInt::OnListenFailure(ConnID id, const CConnection& bind)
 {
     assert(IsEventThread());
     m_interface.OnBindFailure(bind);
-    optional_lock(m_bind_mutex, m_enable_threading);
-    m_binds.erase(id);
+    {
+        optional_lock(m_bind_mutex, m_enable_threading);
+        m_binds.erase(id);
+    }
+    ReleaseConnectionIndex(id);
 }
 
 void CConnectionHandlerInt::OnConnectionFailure(ConnID id, ConnectionFailureType type, int /*error*/, CConnection failed, bool retry)
 {
     assert(IsEventThread());
-    auto it = m_connecting.find(id);
-    assert(it != m_connecting.end());
-    auto ptr = std::move(it->second);
-    m_connecting.erase(it);
+    std::unique_ptr<ConnectionBase> ptr(m_connecting.take(id));
+    assert(ptr);
     retry = retry && !m_shutdown;
     bool ret = false;
 
+    if ((type & ConnectionFailureType::RESOLVE) != 0) {
+        m_counters.dns_failures.add(1);
+    } else {
+        m_counters.connect_failures.add(1);
+        AdjustConnectingLimit(false);
+    }
+
     if ((type & ConnectionFailureType::PROXY) != 0)
         ret = m_interface.OnProxyFailure(failed, retry);
     else if ((type & ConnectionFailureType::RESOLVE) != 0)
         ret = m_interface.OnDnsFailure(std::move(failed), retry);
     else
         ret = m_interface.OnConnectionFailure(failed, failed, retry);
+    ReleaseConnectionIndex(id);
     if (retry && ret) {
+        m_counters.reconnects.add(1);
         ConnID newId = GetNextConnectionIndex();
-        auto newit = m_connecting.emplace_hint(m_connecting.end(), newId, std::move(ptr));
-        newit->second->Retry(newId);
+        m_connecting.insert(newId, std::move(ptr))->Retry(newId);
     } else if (m_request_event)
         m_request_event.active();
 }
@@ -282,88 +428,184 @@ void CConnectionHandlerInt::OnIncomingConnected(ConnID id, const CConnection& co
 {
     assert(IsEventThread());
     DEBUG_PRINT(LOGVERBOSE, "id:", id);
-    auto it = m_connecting.find(id);
-    assert(it != m_connecting.end());
-    std::unique_ptr<ConnectionBase> moved(nullptr);
-    it->second.swap(moved);
-    m_connecting.erase(it);
+    std::unique_ptr<ConnectionBase> moved(m_connecting.take(id));
+    assert(moved);
+    m_counters.incoming_accepted.add(1);
 
-    if (!m_interface.OnIncomingConnection(id, conn, resolved_conn))
+    if (!m_interface.OnIncomingConnection(id, conn, resolved_conn)) {
+        moved.reset();
+        ReleaseConnectionIndex(id);
         return;
+    }
+    CShard* shard = SelectShard();
+    if (shard != nullptr)
+        moved->MoveToShard(*shard);
     moved->SetRateLimitGroup(m_incoming_rate_limit);
-    moved->Enable();
+    moved->PrepareIO();
+    // Findable before anything can arrive on it, which may be on a shard's
+    // thread.
+    AttachSendQueue(*moved, id);
+    ConnectionBase* enabled;
     {
         optional_lock(m_conn_mutex, m_enable_threading);
-        m_connected.emplace_hint(m_connected.end(), id, std::move(moved));
+        enabled = m_connected.insert(id, std::move(moved));
     }
     m_incoming_conn_count++;
+    enabled->Enable();
 }
 
 void CConnectionHandlerInt::OnOutgoingConnected(ConnID id, const CConnection& conn, const CConnection& resolved_conn)
 {
     assert(IsEventThread());
     DEBUG_PRINT(LOGVERBOSE, "id:", id);
-    auto it = m_connecting.find(id);
-    assert(it != m_connecting.end());
-    std::unique_ptr<ConnectionBase> moved(nullptr);
-    it->second.swap(moved);
-    m_connecting.erase(it);
+    std::unique_ptr<ConnectionBase> moved(m_connecting.take(id));
+    assert(moved);
+    m_counters.outgoing_connected.add(1);
+    m_counters.connect_latency.add(stats_now_micros() - moved->GetConnectStart());
+    AdjustConnectingLimit(true);
+
+    // An attempt has finished, so there is room for another.
+    if (m_request_event)
+        m_request_event.active();
 
-    if (!m_interface.OnOutgoingConnection(id, conn, resolved_conn))
+    if (!m_interface.OnOutgoingConnection(id, conn, resolved_conn)) {
+        moved.reset();
+        ReleaseConnectionIndex(id);
         return;
+    }
+    CShard* shard = SelectShard();
+    if (shard != nullptr)
+        moved->MoveToShard(*shard);
     moved->SetRateLimitGroup(m_outgoing_rate_limit);
-    moved->Enable();
+    moved->PrepareIO();
+    AttachSendQueue(*moved, id);
+    ConnectionBase* enabled;
     {
         optional_lock(m_conn_mutex, m_enable_threading);
-        m_connected.emplace_hint(m_connected.end(), id, std::move(moved));
+        enabled = m_connected.insert(id, std::move(moved));
     }
     m_outgoing_conn_count++;
+    // Nothing is received until this returns. Disconnecting from within it
+    // only takes effect once back on the event loop, so enabled is still
+    // valid afterwards.
     m_interface.OnReadyForFirstSend(id);
+    enabled->Enable();
 }
 
 bool CConnectionHandlerInt::OnReceiveMessages(ConnID id, std::list<std::vector<unsigned char> >&& msgs, size_t totalsize)
 {
-    assert(IsEventThread());
+    if (QueueCallbacks()) {
+        m_main_queue.post(std::bind(&CConnectionHandlerInt::ReceiveQueuedVectors, this, id, std::move(msgs), totalsize));
+        return true;
+    }
     return m_interface.OnReceiveMessages(id, std::move(msgs), totalsize);
 }
 
+bool CConnectionHandlerInt::OnReceiveMessages(ConnID id, std::vector<CNetMessage>&& msgs, size_t totalsize)
+{
+    if (QueueCallbacks()) {
+        m_main_queue.post(std::bind(&CConnectionHandlerInt::ReceiveQueuedBuffers, this, id, std::move(msgs), totalsize));
+        return true;
+    }
+    return m_interface.OnReceiveMessageBuffers(id, std::move(msgs), totalsize);
+}
+
+bool CConnectionHandlerInt::OnReceiveMessages(ConnID id, CMessageBatch&& batch)
+{
+    if (QueueCallbacks()) {
+        m_main_queue.post(std::bind(&CConnectionHandlerInt::ReceiveQueuedBatch, this, id, std::move(batch)));
+        return true;
+    }
+    return m_interface.OnReceiveMessageBatch(id, std::move(batch));
+}
+
+void CConnectionHandlerInt::ReceiveQueuedVectors(ConnID id, std::list<std::vector<unsigned char> >& msgs, size_t totalsize)
+{
+    m_interface.OnReceiveMessages(id, std::move(msgs), totalsize);
+}
+
+void CConnectionHandlerInt::ReceiveQueuedBuffers(ConnID id, std::vector<CNetMessage>& msgs, size_t totalsize)
+{
+    m_interface.OnReceiveMessageBuffers(id, std::move(msgs), totalsize);
+}
+
+void CConnectionHandlerInt::ReceiveQueuedBatch(ConnID id, CMessageBatch& batch)
+{
+    m_interface.OnReceiveMessageBatch(id, std::move(batch));
+}
+
 void CConnectionHandlerInt::OnWriteBufferFull(ConnID id, size_t bufsize)
 {
-    assert(IsEventThread());
-    m_interface.OnWriteBufferFull(id, bufsize);
+    if (QueueCallbacks())
+        m_main_queue.post(std::bind(&CConnectionHandlerInt::OnWriteBufferFull, this, id, bufsize));
+    else
+        m_interface.OnWriteBufferFull(id, bufsize);
 }
 
 void CConnectionHandlerInt::OnPingTimeout(ConnID id)
 {
-    m_interface.OnPingTimeout(id);
+    if (QueueCallbacks())
+        m_main_queue.post(std::bind(&CConnectionHandlerInt::OnPingTimeout, this, id));
+    else
+        m_interface.OnPingTimeout(id);
 }
 
 void CConnectionHandlerInt::OnMalformedMessage(ConnID id)
 {
-    m_interface.OnMalformedMessage(id);
+    if (QueueCallbacks())
+        m_main_queue.post(std::bind(&CConnectionHandlerInt::OnMalformedMessage, this, id));
+    else
+        m_interface.OnMalformedMessage(id);
+}
+
+void CConnectionHandlerInt::OnBytesRead(ConnID id, size_t bytes, size_t total_bytes)
+{
+    if (QueueCallbacks())
+        m_main_queue.post(std::bind(&CConnectionHandlerInt::OnBytesRead, this, id, bytes, total_bytes));
+    else
+        m_interface.OnBytesRead(id, bytes, total_bytes);
+}
+
+void CConnectionHandlerInt::OnBytesWritten(ConnID id, size_t bytes, size_t total_bytes)
+{
+    if (QueueCallbacks())
+        m_main_queue.post(std::bind(&CConnectionHandlerInt::OnBytesWritten, this, id, bytes, total_bytes));
+    else
+        m_interface.OnBytesWritten(id, bytes, total_bytes);
 }
 
 bool CConnectionHandlerInt::Bind(CConnection conn)
 {
     assert(IsEventThread());
+    if (!valid_framing(conn.GetNetConfig())) {
+        DEBUG_PRINT(LOGWARN, "not binding, invalid message size field");
+        return false;
+    }
     ConnID id = GetNextConnectionIndex();
     std::unique_ptr<CConnListener> listener(new CConnListener(*this, m_event_base, id, std::move(conn)));
     bool ret = listener->Bind();
     if (ret) {
         optional_lock(m_bind_mutex, m_enable_threading);
-        auto it = m_binds.emplace_hint(m_binds.end(), id, std::move(listener));
-        it->second->Enable();
+        m_binds.insert(id, std::move(listener))->Enable();
+    } else {
+        listener.reset();
+        ReleaseConnectionIndex(id);
     }
     return ret;
 }
 
 ConnID CConnectionHandlerInt::GetNextConnectionIndex()
 {
-    assert(m_connection_index >= 0);
-    if (m_connection_index != std::numeric_limits<decltype(m_connection_index)>::max())
-        return m_connection_index++;
-    m_connection_index = 0;
-    return std::numeric_limits<decltype(m_connection_index)>::max();
+    assert(IsEventThread());
+    return m_conn_ids.alloc();
+}
+
+// Only call once nothing is left in any table under this id. Ids must not be
+// reused while they may still be passed to the interface.
+void CConnectionHandlerInt::ReleaseConnectionIndex(ConnID id)
+{
+    assert(IsEventThread());
+    m_conn_ids.release(id);
 }
 
 void CConnectionHandlerInt::StartConnection(CConnection&& conn)
@@ -373,11 +615,15 @@ void CConnectionHandlerInt::StartConnection(CConnection&& conn)
     if (conn.IsDNS() && conn.GetOptions().doResolve == CConnectionOptions::RESOLVE_ONLY) {
         if (conn.GetProxy().IsSet()) {
             /* TODO */
+            ReleaseConnectionIndex(id);
         } else {
             std::unique_ptr<CResolveOnly> ptr(new CResolveOnly(*this, std::move(conn), id));
-            auto it = m_dns_resolves.emplace_hint(m_dns_resolves.end(), id, std::move(ptr));
-            it->second->Resolve();
+            m_dns_resolves.insert(id, std::move(ptr))->Resolve();
         }
+    } else if (!valid_framing(conn.GetNetConfig())) {
+        DEBUG_PRINT(LOGWARN, "not connecting, invalid message size field");
+        ReleaseConnectionIndex(id);
+        m_interface.OnConnectionFailure(conn, conn, false);
     } else {
         ConnectionBase* ptr;
         if (conn.GetProxy().IsSet())
@@ -386,11 +632,15 @@ void CConnectionHandlerInt::StartConnection(CConnection&& conn)
             ptr = new CDNSConnection(*this, std::move(conn), id);
         else
             ptr = new CDirectConnection(*this, std::move(conn), id);
-        auto it = m_connecting.emplace_hint(m_connecting.end(), id, std::unique_ptr<ConnectionBase>(ptr));
-        it->second->Connect();
+        m_connecting.insert(id, std::unique_ptr<ConnectionBase>(ptr))->Connect();
     }
 }
 
+const CHandlerOptions& CConnectionHandlerInt::GetOptions() const
+{
+    return m_options;
+}
+
 bufferevent_options CConnectionHandlerInt::GetBevOpts() const
 {
     assert(IsEventThread());
@@ -400,7 +650,9 @@ bufferevent_options CConnectionHandlerInt::GetBevOpts() const
 void CConnectionHandlerInt::RequestOutgoingInt()
 {
     assert(IsEventThread());
-    size_t need = static_cast<size_t>(std::min(g_max_simultaneous_connecting, m_outgoing_conn_limit - m_outgoing_conn_count - static_cast<int>(m_connecting.size())));
+    m_epochs.reclaim();
+    int connecting = static_cast<int>(m_connecting.size());
+    int need = std::min(m_connecting_limit - connecting, m_outgoing_conn_limit - m_outgoing_conn_count - connecting);
     if (need > 0) {
         std::list<CConnection> conns(m_interface.OnNeedOutgoingConnections(need));
         auto end = conns.begin();
@@ -412,6 +664,16 @@ void CConnectionHandlerInt::RequestOutgoingInt()
     }
 }
 
+void CConnectionHandlerInt::AdjustConnectingLimit(bool connected)
+{
+    if (m_options.nMaxConnecting <= m_options.nConnecting)
+        return;
+    if (connected)
+        m_connecting_limit = std::min(m_connecting_limit + 1, m_options.nMaxConnecting);
+    else
+        m_connecting_limit = std::max(m_connecting_limit / 2, m_options.nConnecting);
+}
+
 bool CConnectionHandlerInt::PumpEvents(bool block)
 {
     assert(IsEventThread());
@@ -433,12 +695,12 @@ void CConnectionHandlerInt::CloseConnection(ConnID id, bool immediately)
 {
     if (id >= 0) {
         optional_lock(m_conn_mutex, m_enable_threading);
-        auto it = m_connected.find(id);
-        if (it != m_connected.end()) {
+        ConnectionBase* conn = m_connected.find(id);
+        if (conn != nullptr) {
             if (immediately)
-                it->second->Disconnect();
+                conn->Disconnect();
             else
-                it->second->DisconnectWhenFinished();
+                conn->DisconnectWhenFinished();
         }
     }
 }
@@ -447,9 +709,9 @@ void CConnectionHandlerInt::PauseRecv(ConnID id)
 {
     if (id >= 0) {
         optional_lock(m_conn_mutex, m_enable_threading);
-        auto it = m_connected.find(id);
-        if (it != m_connected.end())
-            it->second->PauseRecv();
+        ConnectionBase* conn = m_connected.find(id);
+        if (conn != nullptr)
+            conn->PauseRecv();
     }
 }
 
@@ -457,33 +719,155 @@ void CConnectionHandlerInt::UnpauseRecv(ConnID id)
 {
     if (id >= 0) {
         optional_lock(m_conn_mutex, m_enable_threading);
-        auto it = m_connected.find(id);
-        if (it != m_connected.end())
-            it->second->UnpauseRecv();
+        ConnectionBase* conn = m_connected.find(id);
+        if (conn != nullptr)
+            conn->UnpauseRecv();
     }
 }
 
+void CConnectionHandlerInt::AttachSendQueue(ConnectionBase& conn, ConnID id)
+{
+    assert(IsEventThread());
+    if (!m_options.fLockFreeSend)
+        return;
+    std::unique_ptr<CSendQueue> queue(new CSendQueue(conn.GetIOBase(), conn, id));
+    // Beyond the table's capacity the connection just uses the locked path.
+    if (m_send_queues.insert(id, queue.get()))
+        queue.release();
+}
+
+void CConnectionHandlerInt::DetachSendQueue(ConnID id)
+{
+    assert(IsEventThread());
+    CSendQueue* queue = m_send_queues.find(id);
+    if (queue == nullptr)
+        return;
+    m_send_queues.erase(id);
+    queue->detach();
+    // Senders may still be pushing to it.
+    m_epochs.retire(queue);
+}
+
 bool CConnectionHandlerInt::Send(ConnID id, const unsigned char* data, size_t size)
 {
     bool ret = false;
+    if (id >= 0 && m_options.fLockFreeSend) {
+        CEpochGuard guard(m_epochs);
+        CSendQueue* queue = m_send_queues.find(id);
+        if (queue != nullptr) {
+            queue->push(data, size);
+            return true;
+        }
+    }
     if (id >= 0) {
         optional_lock(m_conn_mutex, m_enable_threading);
-        auto it = m_connected.find(id);
-        if (it == m_connected.end())
+        ConnectionBase* conn = m_connected.find(id);
+        if (conn == nullptr)
             ret = false;
         else
-            ret = it->second->Write(data, size);
+            ret = conn->Write(data, size);
     }
     return ret;
 }
 
+bool CConnectionHandlerInt::SendBatch(ConnID id, const CBufferSpan* bufs, size_t count)
+{
+    bool ret = false;
+    if (id >= 0 && m_options.fLockFreeSend) {
+        CEpochGuard guard(m_epochs);
+        CSendQueue* queue = m_send_queues.find(id);
+        if (queue != nullptr) {
+            queue->push(bufs, count);
+            return true;
+        }
+    }
+    if (id >= 0) {
+        optional_lock(m_conn_mutex, m_enable_threading);
+        ConnectionBase* conn = m_connected.find(id);
+        if (conn != nullptr)
+            ret = conn->WriteBatch(bufs, count);
+    }
+    return ret;
+}
+
+size_t CConnectionHandlerInt::SendToMany(const ConnID* ids, size_t count, const unsigned char* data, size_t size)
+{
+    // Queued sends are written later, so share one copy rather than making
+    // one per connection.
+    if (m_options.fLockFreeSend)
+        return SendToMany(ids, count, CSharedPayload(data, size));
+    size_t sent = 0;
+    optional_lock(m_conn_mutex, m_enable_threading);
+    for (size_t i = 0; i < count; ++i) {
+        if (ids[i] < 0)
+            continue;
+        ConnectionBase* conn = m_connected.find(ids[i]);
+        if (conn != nullptr && conn->Write(data, size))
+            ++sent;
+    }
+    return sent;
+}
+
+bool CConnectionHandlerInt::Send(ConnID id, const CSharedPayload& payload)
+{
+    bool ret = false;
+    if (id >= 0 && m_options.fLockFreeSend) {
+        CEpochGuard guard(m_epochs);
+        CSendQueue* queue = m_send_queues.find(id);
+        if (queue != nullptr) {
+            queue->push(payload);
+            return true;
+        }
+    }
+    if (id >= 0) {
+        optional_lock(m_conn_mutex, m_enable_threading);
+        ConnectionBase* conn = m_connected.find(id);
+        if (conn != nullptr)
+            ret = conn->WritePayload(payload);
+    }
+    return ret;
+}
+
+size_t CConnectionHandlerInt::SendToMany(const ConnID* ids, size_t count, const CSharedPayload& payload)
+{
+    size_t sent = 0;
+    if (m_options.fLockFreeSend) {
+        CEpochGuard guard(m_epochs);
+        for (size_t i = 0; i < count; ++i) {
+            CSendQueue* queue = m_send_queues.find(ids[i]);
+            if (queue != nullptr) {
+                queue->push(payload);
+                ++sent;
+                continue;
+            }
+            // No queue, so fall back to the locked path.
+            if (ids[i] < 0)
+                continue;
+            optional_lock(m_conn_mutex, m_enable_threading);
+            ConnectionBase* conn = m_connected.find(ids[i]);
+            if (conn != nullptr && conn->WritePayload(payload))
+                ++sent;
+        }
+        return sent;
+    }
+    optional_lock(m_conn_mutex, m_enable_threading);
+    for (size_t i = 0; i < count; ++i) {
+        if (ids[i] < 0)
+            continue;
+        ConnectionBase* conn = m_connected.find(ids[i]);
+        if (conn != nullptr && conn->WritePayload(payload))
+            ++sent;
+    }
+    return sent;
+}
+
 void CConnectionHandlerInt::SetRateLimit(ConnID id, const CRateLimit& limit)
 {
     if (id >= 0) {
         optional_lock(m_conn_mutex, m_enable_threading);
-        auto it = m_connected.find(id);
-        if (it != m_connected.end())
-            it->second->SetRateLimit(limit);
+        ConnectionBase* conn = m_connected.find(id);
+        if (conn != nullptr)
+            conn->SetRateLimit(limit);
     }
 }
 
@@ -517,8 +901,8 @@ void CConnectionHandlerInt::ResetPingTimeout(ConnID id, int seconds)
 {
     if (id >= 0) {
         optional_lock(m_conn_mutex, m_enable_threading);
-        auto it = m_connected.find(id);
-        if (it != m_connected.end())
-            it->second->ResetPingTimeout(seconds);
+        ConnectionBase* conn = m_connected.find(id);
+        if (conn != nullptr)
+            conn->ResetPingTimeout(seconds);
     }
 }
@@ -7,11 +7,18 @@
 
 #include "libbtcnet/handler.h"
 #include "threads.h"
+#include "dnscache.h"
+#include "epoch.h"
 #include "event.h"
+#include "slotmap.h"
+#include "shard.h"
+#include "stats.h"
+#include "taskqueue.h"
+#include "timerwheel.h"
+#include "uring.h"
 
 #include <event2/bufferevent.h>
 #include <event2/util.h>
-#include <map>
 #include <memory>
 #include <stddef.h>
 #include <stdint.h>
@@ -39,6 +46,7 @@ class ConnectionBase;
 class CResolveOnly;
 class CConnectionBase;
 class CConnListener;
+class CSendQueue;
 class CConnectionHandlerInt
 {
     friend class ConnectionBase;
@@ -53,6 +61,10 @@ public:
     void SetOutgoingRateLimit(const CRateLimit& limit);
     void CloseConnection(ConnID id, bool immediately);
     bool Send(ConnID id, const unsigned char* data, size_t size);
+    bool SendBatch(ConnID id, const CBufferSpan* bufs, size_t count);
+    size_t SendToMany(const ConnID* ids, size_t count, const unsigned char* data, size_t size);
+    bool Send(ConnID id, const CSharedPayload& payload);
+    size_t SendToMany(const ConnID* ids, size_t count, const CSharedPayload& payload);
     void SetRateLimit(ConnID id, const CRateLimit& limit);
     void PauseRecv(ConnID id);
     void UnpauseRecv(ConnID id);
@@ -61,14 +73,24 @@ public:
     void ResetPingTimeout(ConnID id, int seconds);
     bool PumpEvents(bool block);
     void Shutdown();
-    void Start(int outgoing_limit);
+    void Start(int outgoing_limit, const CHandlerOptions& opts);
+    CHandlerStats GetStats();
+    bool GetConnectionStats(ConnID id, CConnectionStats& stats);
 
     bufferevent_options GetBevOpts() const;
+    const CHandlerOptions& GetOptions() const;
     const event_type<evdns_base>& GetDNSBase() const;
+    CDNSCache& GetDNSCache();
+    CTimerWheel& GetTimers();
+    // Null unless io_uring is in use.
+    CUringEngine* GetUring();
     const event_type<event_base>& GetEventBase() const;
+    CHandlerCounters& GetCounters();
 
 private:
     bool OnReceiveMessages(ConnID id, std::list<std::vector<unsigned char> >&& msgs, size_t totalsize);
+    bool OnReceiveMessages(ConnID id, std::vector<CNetMessage>&& msgs, size_t totalsize);
+    bool OnReceiveMessages(ConnID id, CMessageBatch&& batch);
     void OnIncomingConnected(ConnID id, const CConnection& conn, const CConnection& resolved_conn);
     void OnOutgoingConnected(ConnID id, const CConnection& conn, const CConnection& resolved_conn);
     void OnConnectionFailure(ConnID id, ConnectionFailureType type, int error, CConnection failed, bool retry);
@@ -81,30 +103,59 @@ private:
     void OnDisconnected(ConnID id, bool reconnect);
     void OnPingTimeout(ConnID id);
     void OnMalformedMessage(ConnID id);
+    void OnBytesRead(ConnID id, size_t bytes, size_t total_bytes);
+    void OnBytesWritten(ConnID id, size_t bytes, size_t total_bytes);
+    void ReceiveQueuedVectors(ConnID id, std::list<std::vector<unsigned char> >& msgs, size_t totalsize);
+    void ReceiveQueuedBuffers(ConnID id, std::vector<CNetMessage>& msgs, size_t totalsize);
+    void ReceiveQueuedBatch(ConnID id, CMessageBatch& batch);
 
     void RequestOutgoingInt();
+    void AdjustConnectingLimit(bool connected);
     void ShutdownInt();
     void BindInt();
 
     void StartConnection(CConnection&& conn);
     bool IsEventThread() const;
+    bool QueueCallbacks() const;
+    CShard* SelectShard() const;
+    void StopShards();
     ConnID GetNextConnectionIndex();
+    void ReleaseConnectionIndex(ConnID id);
+    void AttachSendQueue(ConnectionBase& conn, ConnID id);
+    void DetachSendQueue(ConnID id);
 
-    std::map<ConnID, std::unique_ptr<ConnectionBase> > m_connected;
-    std::map<ConnID, std::unique_ptr<ConnectionBase> > m_connecting;
-    std::map<ConnID, std::unique_ptr<CConnListener> > m_binds;
-    std::map<ConnID, std::unique_ptr<CResolveOnly> > m_dns_resolves;
+    // Declared first so that it outlives the timers of everything below.
+    CTimerWheel m_timers;
+
+    CSlotMap<ConnectionBase> m_connected;
+    CSlotMap<ConnectionBase> m_connecting;
+    CSlotMap<CConnListener> m_binds;
+    CSlotMap<CResolveOnly> m_dns_resolves;
 
     CConnectionHandler& m_interface;
-    ConnID m_connection_index;
+    CHandlerOptions m_options;
+    CConnIDAllocator m_conn_ids;
+
+    std::vector<std::unique_ptr<CShard> > m_shards;
+    CTaskQueue m_main_queue;
+
+    CEpochManager m_epochs;
+    CAtomicSlotTable<CSendQueue> m_send_queues;
 
     size_t m_bytes_read;
     size_t m_bytes_written;
 
+    CHandlerCounters m_counters;
+    CDNSCache m_dns_cache;
+    // Totals of connections that have closed, guarded by m_conn_mutex.
+    CConnectionStats m_closed_stats;
+
     int m_outgoing_conn_count;
     int m_incoming_conn_count;
 
     int m_outgoing_conn_limit;
+    // How many attempts may be in m_connecting. See nMaxConnecting.
+    int m_connecting_limit;
 
     bool m_enable_threading;
     bool m_shutdown;
@@ -127,6 +178,8 @@ private:
 
     CEvent m_request_event;
     CEvent m_shutdown_event;
+
+    CUringEngine m_uring;
 };
 
 #endif // LIBBTCNET_SRC_HANDLER_H
@@ -6,6 +6,11 @@
 #include "libbtcnet/connection.h"
 #include "handler.h"
 
+CHandlerOptions::CHandlerOptions()
+    : nDelivery(DELIVER_VECTORS), nShards(0), nDispatch(DISPATCH_MERGED), fLockFreeSend(false), fByteCallbacks(true), nByteCallbackInterval(0), nDnsCacheSize(256), nDnsCacheSeconds(60), nConnecting(8), nMaxConnecting(0), nIOEngine(IO_BUFFEREVENT), fWhitelistFastPath(false), nDirectReadSize(0)
+{
+}
+
 CConnectionHandler::CConnectionHandler(bool enable_threading)
 {
     m_internal = new CConnectionHandlerInt(*this, enable_threading);
@@ -57,14 +62,24 @@ bool CConnectionHandler::Bind(const CConnection& conn)
     return m_internal->Bind(conn);
 }
 
+CHandlerStats CConnectionHandler::GetStats() const
+{
+    return m_internal->GetStats();
+}
+
+bool CConnectionHandler::GetConnectionStats(ConnID id, CConnectionStats& stats) const
+{
+    return m_internal->GetConnectionStats(id, stats);
+}
+
 bool CConnectionHandler::PumpEvents(bool block)
 {
     return m_internal->PumpEvents(block);
 }
 
-void CConnectionHandler::Start(int outgoing_limit)
+void CConnectionHandler::Start(int outgoing_limit, const CHandlerOptions& opts)
 {
-    m_internal->Start(outgoing_limit);
+    m_internal->Start(outgoing_limit, opts);
 }
 
 bool CConnectionHandler::Send(ConnID id, const unsigned char* data, size_t size)
@@ -72,7 +87,47 @@ bool CConnectionHandler::Send(ConnID id, const unsigned char* data, size_t size)
     return m_internal->Send(id, data, size);
 }
 
+bool CConnectionHandler::SendBatch(ConnID id, const CBufferSpan* bufs, size_t count)
+{
+    return m_internal->SendBatch(id, bufs, count);
+}
+
+size_t CConnectionHandler::SendToMany(const ConnID* ids, size_t count, const unsigned char* data, size_t size)
+{
+    return m_internal->SendToMany(ids, count, data, size);
+}
+
+bool CConnectionHandler::Send(ConnID id, const CSharedPayload& payload)
+{
+    return m_internal->Send(id, payload);
+}
+
+size_t CConnectionHandler::SendToMany(const ConnID* ids, size_t count, const CSharedPayload& payload)
+{
+    return m_internal->SendToMany(ids, count, payload);
+}
+
 void CConnectionHandler::ResetPingTimeout(ConnID id, int seconds)
 {
     m_internal->ResetPingTimeout(id, seconds);
 }
+
+bool CConnectionHandler::OnReceiveMessageBuffers(ConnID id, std::vector<CNetMessage> msgs, size_t totalsize)
+{
+    std::list<std::vector<unsigned char> > copied;
+    for (const auto& msg : msgs) {
+        copied.emplace_back(msg.GetSize());
+        msg.CopyOut(copied.back().data(), copied.back().size());
+    }
+    return OnReceiveMessages(id, std::move(copied), totalsize);
+}
+
+bool CConnectionHandler::OnReceiveMessageBatch(ConnID id, CMessageBatch batch)
+{
+    std::list<std::vector<unsigned char> > copied;
+    for (size_t i = 0; i < batch.GetCount(); ++i) {
+        CBufferSpan msg = batch.GetMessage(i);
+        copied.emplace_back(msg.data, msg.data + msg.size);
+    }
+    return OnReceiveMessages(id, std::move(copied), batch.GetTotalSize());
+}
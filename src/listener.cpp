@@ -5,14 +5,38 @@
 #include "listener.h"
 #include "incomingconn.h"
 #include "eventtypes.h"
+#include "uring.h"
 
 #include <string.h>
 #include <event2/bufferevent.h>
 #include <event2/listener.h>
+#include <event2/util.h>
 #include <assert.h>
 
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+namespace
+{
+// Set up a listening socket as evconnlistener_new_bind would, for accepting
+// from with io_uring.
+evutil_socket_t bind_socket(const sockaddr* addr, int socklen)
+{
+    evutil_socket_t sock = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (evutil_make_socket_closeonexec(sock) != 0 || evutil_make_listen_socket_reuseable(sock) != 0 ||
+        bind(sock, addr, socklen) != 0 || listen(sock, 128) != 0) {
+        evutil_closesocket(sock);
+        return -1;
+    }
+    return sock;
+}
+} // namespace
+
 CConnListener::CConnListener(CConnectionHandlerInt& handler, const event_type<event_base>& base, ConnID id, CConnection conn)
-    : m_handler(handler), m_event_base(base), m_id(id), m_connection(std::move(conn))
+    : m_handler(handler), m_event_base(base), m_id(id), m_connection(std::move(conn)), m_uring(nullptr), m_acceptor(nullptr)
 {
 }
 
@@ -30,6 +54,7 @@ const CConnection& CConnListener::GetListenConnection() const
 bool CConnListener::Bind()
 {
     assert(!m_listener);
+    assert(m_acceptor == nullptr);
     assert(m_event_base != nullptr);
 
     sockaddr_storage addr_storage;
@@ -38,6 +63,20 @@ bool CConnListener::Bind()
     sockaddr* addr = reinterpret_cast<sockaddr*>(&addr_storage);
     m_connection.GetSockAddr(addr, &socklen);
 
+    CUringEngine* uring = m_handler.GetUring();
+    if (uring != nullptr) {
+        evutil_socket_t sock = bind_socket(addr, socklen);
+        if (sock < 0) {
+            m_handler.OnListenFailure(m_id, m_connection);
+            return false;
+        }
+        m_uring = uring;
+        m_acceptor = uring->listen(sock, [this](evutil_socket_t fd, sockaddr* address, int addrlen) {
+            m_handler.OnIncomingConnection(m_connection, fd, address, addrlen);
+        });
+        return true;
+    }
+
     m_listener.reset(evconnlistener_new_bind(m_event_base, accept_conn, this, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, addr, socklen));
     if (!m_listener) {
         m_handler.OnListenFailure(m_id, m_connection);
@@ -48,18 +87,30 @@ bool CConnListener::Bind()
 
 bool CConnListener::Enable()
 {
+    if (m_acceptor != nullptr) {
+        m_uring->pause(m_acceptor, false);
+        return true;
+    }
     assert(m_listener);
     return evconnlistener_enable(m_listener) == 0;
 }
 
 bool CConnListener::Disable()
 {
+    if (m_acceptor != nullptr) {
+        m_uring->pause(m_acceptor, true);
+        return true;
+    }
     assert(m_listener);
     return evconnlistener_disable(m_listener) == 0;
 }
 
 void CConnListener::Unbind()
 {
+    if (m_acceptor != nullptr) {
+        m_uring->unlisten(m_acceptor);
+        m_acceptor = nullptr;
+    }
     m_listener.free();
 }
 
@@ -9,6 +9,8 @@
 #include "bareconn.h"
 
 class CConnection;
+class CUringAcceptor;
+class CUringEngine;
 struct event_base;
 struct evconnlistener;
 
@@ -31,6 +33,9 @@ private:
     ConnID m_id;
     CConnection m_connection;
     event_type<evconnlistener> m_listener;
+    // Used instead of m_listener with io_uring.
+    CUringEngine* m_uring;
+    CUringAcceptor* m_acceptor;
 };
 
 #endif // LIBBTCNET_SRC_LISTENER_H
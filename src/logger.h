@@ -4,7 +4,13 @@
 
 #ifndef LIBBTCNET_SRC_LOGGER_H
 #define LIBBTCNET_SRC_LOGGER_H
-#include <iostream>
+
+#include "libbtcnet/logging.h"
+
+#include <stddef.h>
+#include <string>
+#include <type_traits>
+#include <utility>
 
 #if !defined(LOGLEVEL)
 #define LOGLEVEL LOGERR
@@ -12,36 +18,84 @@
 
 namespace logger
 {
-enum loglevel {
-    LOGNONE,
-    LOGERR,
-    LOGWARN,
-    LOGINFO,
-    LOGVERBOSE,
-    LOGALL
-};
+// A message being formatted. Lives on the stack, and anything past max_size
+// is cut off.
+class CLogLine
+{
+public:
+    static constexpr size_t max_size = 240;
+
+    CLogLine() : m_size(0) {}
 
-template <loglevel l>
-struct mylogger {
-    static inline void log()
+    void append(const char* str);
+    void append(const std::string& str);
+    void append(char c);
+    void append(double value);
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type append(T value)
     {
-        std::cout << std::endl;
+        append_signed(value);
     }
 
-    template <typename First, typename... Rest>
-    static inline void log(First&& first, Rest&&... rest)
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type append(T value)
     {
-        if (LOGLEVEL >= l) {
-            std::cout << std::forward<First>(first) << " ";
-            mylogger::log(std::forward<Rest>(rest)...);
-        }
+        append_unsigned(value);
     }
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    void append(const char* str, size_t len);
+    void append_signed(long long value);
+    void append_unsigned(unsigned long long value);
+
+    char m_data[max_size];
+    size_t m_size;
 };
+
+// The runtime level check. Cheap enough to precede every message.
+bool enabled(CLogging::Level level);
+
+void write(CLogging::Level level, const CLogLine& line);
+
+inline void format(CLogLine& /*line*/)
+{
+}
+
+template <typename First, typename... Rest>
+inline void format(CLogLine& line, First&& first, Rest&&... rest)
+{
+    line.append(' ');
+    line.append(std::forward<First>(first));
+    format(line, std::forward<Rest>(rest)...);
+}
+
+template <typename... Args>
+void log(CLogging::Level level, const char* func, Args&&... args)
+{
+    CLogLine line;
+    line.append(func);
+    format(line, std::forward<Args>(args)...);
+    write(level, line);
+}
 } // namespace logger
+
+// The level comparison is a constant, so messages beyond LOGLEVEL compile to
+// nothing. Arguments are only evaluated once a message is known to be wanted.
 #ifndef NDEBUG
-#define DEBUG_PRINT(MYLEVEL, ...) logger::mylogger<logger::loglevel::MYLEVEL>::log(__func__, __VA_ARGS__);
+#define DEBUG_PRINT(MYLEVEL, ...)                                                              \
+    do {                                                                                       \
+        if (CLogging::MYLEVEL <= CLogging::LOGLEVEL && logger::enabled(CLogging::MYLEVEL)) { \
+            logger::log(CLogging::MYLEVEL, __func__, __VA_ARGS__);                             \
+        }                                                                                      \
+    } while (0)
 #else
-#define DEBUG_PRINT(...)
+#define DEBUG_PRINT(...) \
+    do {                 \
+    } while (0)
 #endif
 
-#endif
+#endif // LIBBTCNET_SRC_LOGGER_H
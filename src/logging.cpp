@@ -0,0 +1,233 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "logger.h"
+
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+// A bounded queue of fixed-size messages which any number of threads may push
+// to and pop from without locking. Each slot's sequence number says whether it
+// is ready to be written (== position) or read (== position + 1) by whoever
+// claims that position.
+class CLogRing
+{
+public:
+    explicit CLogRing(size_t capacity)
+        : m_mask(capacity - 1), m_slots(new Slot[capacity]), m_push_pos(0), m_pop_pos(0), m_dropped(0)
+    {
+        for (size_t i = 0; i < capacity; i++)
+            m_slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(CLogging::Level level, const char* data, size_t size)
+    {
+        size_t pos = m_push_pos.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &m_slots[pos & m_mask];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            if (seq == pos) {
+                if (m_push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (seq < pos) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = m_push_pos.load(std::memory_order_relaxed);
+            }
+        }
+        slot->level = level;
+        slot->size = size;
+        memcpy(slot->data, data, size);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t drain(CLogging::Callback callback, void* ctx)
+    {
+        size_t count = 0;
+        size_t pos = m_pop_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Slot* slot = &m_slots[pos & m_mask];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            if (seq == pos + 1) {
+                if (m_pop_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    callback(slot->level, slot->data, slot->size, ctx);
+                    slot->seq.store(pos + m_mask + 1, std::memory_order_release);
+                    count++;
+                    pos++;
+                }
+            } else if (seq < pos + 1) {
+                break;
+            } else {
+                pos = m_pop_pos.load(std::memory_order_relaxed);
+            }
+        }
+        return count;
+    }
+
+    uint64_t dropped() const
+    {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        CLogging::Level level;
+        size_t size;
+        char data[logger::CLogLine::max_size];
+    };
+
+    const size_t m_mask;
+    Slot* const m_slots;
+    std::atomic<size_t> m_push_pos;
+    std::atomic<size_t> m_pop_pos;
+    std::atomic<uint64_t> m_dropped;
+};
+
+enum LogSink {
+    SINK_STDOUT,
+    SINK_CALLBACK,
+    SINK_RING
+};
+
+std::atomic<int> g_level(CLogging::LOGLEVEL);
+std::atomic<int> g_sink(SINK_STDOUT);
+std::atomic<CLogging::Callback> g_callback(nullptr);
+std::atomic<void*> g_callback_ctx(nullptr);
+// Created once and never freed, so that a thread which loaded it just before
+// the sink changed can still safely push to it.
+std::atomic<CLogRing*> g_ring(nullptr);
+} // namespace
+
+void CLogging::SetLevel(Level level)
+{
+    g_level.store(level, std::memory_order_relaxed);
+}
+
+void CLogging::UseStdout()
+{
+    g_sink.store(SINK_STDOUT, std::memory_order_release);
+}
+
+void CLogging::UseCallback(Callback callback, void* ctx)
+{
+    g_callback_ctx.store(ctx, std::memory_order_relaxed);
+    g_callback.store(callback, std::memory_order_release);
+    g_sink.store(SINK_CALLBACK, std::memory_order_release);
+}
+
+void CLogging::UseRing(size_t capacity)
+{
+    if (!g_ring.load(std::memory_order_acquire)) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        CLogRing* ring = new CLogRing(size);
+        CLogRing* expected = nullptr;
+        if (!g_ring.compare_exchange_strong(expected, ring, std::memory_order_acq_rel))
+            delete ring;
+    }
+    g_sink.store(SINK_RING, std::memory_order_release);
+}
+
+size_t CLogging::Drain(Callback callback, void* ctx)
+{
+    CLogRing* ring = g_ring.load(std::memory_order_acquire);
+    if (!ring)
+        return 0;
+    return ring->drain(callback, ctx);
+}
+
+uint64_t CLogging::GetDropped()
+{
+    CLogRing* ring = g_ring.load(std::memory_order_acquire);
+    if (!ring)
+        return 0;
+    return ring->dropped();
+}
+
+namespace logger
+{
+void CLogLine::append(const char* str, size_t len)
+{
+    if (len > max_size - m_size)
+        len = max_size - m_size;
+    memcpy(m_data + m_size, str, len);
+    m_size += len;
+}
+
+void CLogLine::append(const char* str)
+{
+    append(str, strlen(str));
+}
+
+void CLogLine::append(const std::string& str)
+{
+    append(str.data(), str.size());
+}
+
+void CLogLine::append(char c)
+{
+    append(&c, 1);
+}
+
+void CLogLine::append(double value)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%g", value);
+    if (len > 0)
+        append(buf, static_cast<size_t>(len) < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+void CLogLine::append_unsigned(unsigned long long value)
+{
+    char buf[20];
+    size_t pos = sizeof(buf);
+    do {
+        buf[--pos] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    append(buf + pos, sizeof(buf) - pos);
+}
+
+void CLogLine::append_signed(long long value)
+{
+    if (value < 0) {
+        append('-');
+        append_unsigned(0ULL - static_cast<unsigned long long>(value));
+    } else {
+        append_unsigned(value);
+    }
+}
+
+bool enabled(CLogging::Level level)
+{
+    return level <= g_level.load(std::memory_order_relaxed);
+}
+
+void write(CLogging::Level level, const CLogLine& line)
+{
+    switch (g_sink.load(std::memory_order_acquire)) {
+    case SINK_STDOUT:
+        fprintf(stdout, "%.*s\n", static_cast<int>(line.size()), line.data());
+        break;
+    case SINK_CALLBACK: {
+        CLogging::Callback callback = g_callback.load(std::memory_order_acquire);
+        void* ctx = g_callback_ctx.load(std::memory_order_relaxed);
+        if (callback)
+            callback(level, line.data(), line.size(), ctx);
+        break;
+    }
+    case SINK_RING:
+        g_ring.load(std::memory_order_acquire)->push(level, line.data(), line.size());
+        break;
+    }
+}
+} // namespace logger
@@ -3,59 +3,58 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "message.h"
+#include "framer.h"
+#include "scan.h"
 #include "libbtcnet/connection.h"
 
 #include <event2/buffer.h>
 
+#include <algorithm>
 #include <assert.h>
-#include <limits.h>
-#include <stdio.h>
-#include <string.h>
 
 namespace
 {
-static inline uint64_t get_message_length(const unsigned char* buf)
+typedef uint64_t (*message_size_fn)(const CNetworkConfig&, evbuffer*, evbuffer_ptr*, size_t, bool&, bool&);
+
+template <typename Framer>
+struct select_message_size {
+    typedef message_size_fn type;
+    static type get() { return &next_complete_message_size<Framer>; }
+};
+
+// found is where the next message_start was found in len bytes, or len if
+// it wasn't. A match can't start at 0, where the bad message is.
+size_t skip_to(size_t found, size_t len, size_t start_size)
 {
-    return static_cast<const uint64_t>(buf[0]) |
-           static_cast<const uint64_t>(buf[1]) << 8 |
-           static_cast<const uint64_t>(buf[2]) << 16 |
-           static_cast<const uint64_t>(buf[3]) << 24;
+    if (found < len)
+        return found;
+    return std::max<size_t>(1, len - std::min(len, start_size - 1));
 }
 } // namespace
 
+CFrameDecoder::~CFrameDecoder() = default;
+
 uint64_t first_complete_message_size(const CNetworkConfig& config, evbuffer* input, bool& fComplete, bool& fBadMsgStart)
 {
-    size_t nTotal = evbuffer_get_length(input);
-    uint64_t nMessageSize;
-    const int size_needed = config.header_msg_size_offset + config.header_msg_size_size;
-    fComplete = false;
-    fBadMsgStart = false;
-
-    // Assume 4-bytes until there's a reason not to.
-    assert(config.header_msg_size_size == 4);
-
-    if (nTotal < static_cast<size_t>(size_needed))
-        return 0;
-    evbuffer_iovec v;
-    if (evbuffer_peek(input, size_needed, nullptr, &v, 1) == 1) {
-        const unsigned char* ptr = static_cast<const unsigned char*>(v.iov_base);
-        if (!config.message_start.empty() && memcmp(ptr, &config.message_start[0], config.message_start.size()) != 0) {
-            fBadMsgStart = true;
-            return 0;
-        }
-        nMessageSize = get_message_length(ptr + config.header_msg_size_offset) + config.header_size;
-    } else {
-        std::vector<unsigned char> partial_header(size_needed);
-        int ret = evbuffer_copyout(input, &partial_header[0], size_needed);
-        assert(ret == size_needed);
-        (void)ret;
-        if (!config.message_start.empty() && memcmp(&partial_header[0], &config.message_start[0], config.message_start.size()) != 0) {
-            fBadMsgStart = true;
-            return 0;
-        }
-        nMessageSize = get_message_length(&partial_header[0] + config.header_msg_size_offset) + config.header_size;
-    }
-    if (nTotal >= nMessageSize)
-        fComplete = true;
-    return nMessageSize;
+    return next_complete_message_size(config, input, nullptr, evbuffer_get_length(input), fComplete, fBadMsgStart);
+}
+
+uint64_t next_complete_message_size(const CNetworkConfig& config, evbuffer* input, evbuffer_ptr* pos, size_t nTotal, bool& fComplete, bool& fBadMsgStart)
+{
+    return select_framer<select_message_size>(config)(config, input, pos, nTotal, fComplete, fBadMsgStart);
+}
+
+size_t resync_skip(const CNetworkConfig& config, evbuffer* input)
+{
+    const std::vector<unsigned char>& start = config.message_start;
+    assert(!start.empty());
+    return skip_to(find_bytes(input, 1, start.data(), start.size()), evbuffer_get_length(input), start.size());
+}
+
+size_t resync_skip(const CNetworkConfig& config, const unsigned char* data, size_t len)
+{
+    const std::vector<unsigned char>& start = config.message_start;
+    assert(!start.empty() && len != 0);
+    const size_t found = find_bytes(data + 1, len - 1, start.data(), start.size());
+    return skip_to(found == len - 1 ? len : found + 1, len, start.size());
 }
@@ -5,11 +5,29 @@
 #ifndef BTCNET_MESSAGE_H
 #define BTCNET_MESSAGE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct evbuffer;
+struct evbuffer_ptr;
 struct CNetworkConfig;
 
+// Returns the size of the first message in input, including its header, or 0
+// if not enough of the header has been received yet. fBadMsgStart is set if
+// the message start or the size field is malformed.
 uint64_t first_complete_message_size(const CNetworkConfig& config, evbuffer* input, bool& fComplete, bool& fBadMsgStart);
 
+// As above, but for the message starting at pos, with nTotal bytes available
+// from that point on. A null pos refers to the start of the buffer.
+uint64_t next_complete_message_size(const CNetworkConfig& config, evbuffer* input, evbuffer_ptr* pos, size_t nTotal, bool& fComplete, bool& fBadMsgStart);
+
+// For input starting with a bad message, the number of bytes to discard to
+// reach the next config.message_start, or if there is none yet, to leave only
+// what might be the beginning of one. Always at least 1. message_start must
+// not be empty.
+size_t resync_skip(const CNetworkConfig& config, evbuffer* input);
+
+// The same, for contiguous input.
+size_t resync_skip(const CNetworkConfig& config, const unsigned char* data, size_t len);
+
 #endif // BTCNET_MESSAGE_H
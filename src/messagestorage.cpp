@@ -0,0 +1,267 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "messagestorage.h"
+
+#include <event2/buffer.h>
+
+#include <algorithm>
+#include <assert.h>
+#include <new>
+#include <string.h>
+
+CRefCounted::CRefCounted() : m_refcount(1)
+{
+}
+
+CRefCounted::~CRefCounted() = default;
+
+void CRefCounted::AddRef()
+{
+    m_refcount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CRefCounted::Release()
+{
+    if (m_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        Destroy();
+}
+
+bool CRefCounted::Unique() const
+{
+    return m_refcount.load(std::memory_order_acquire) == 1;
+}
+
+void CRefCounted::Destroy()
+{
+    delete this;
+}
+
+void CRefCounted::ResetRef()
+{
+    m_refcount.store(1, std::memory_order_relaxed);
+}
+
+CNetMessage CMessageStorage::MakeMessage(size_t offset, size_t size)
+{
+    AddRef();
+    return CNetMessage(this, offset, size);
+}
+
+CNetMessage CMessageStorage::TakeMessage(size_t offset, size_t size)
+{
+    return CNetMessage(this, offset, size);
+}
+
+CBufferStorage::CBufferStorage(event_type<evbuffer>&& buffer) : m_buffer(std::move(buffer))
+{
+    assert(m_buffer);
+}
+
+CBufferStorage::~CBufferStorage() = default;
+
+size_t CBufferStorage::CopyOut(unsigned char* dest, size_t len, size_t offset) const
+{
+    evbuffer_ptr pos;
+    if (evbuffer_ptr_set(m_buffer, &pos, offset, EVBUFFER_PTR_SET) != 0)
+        return 0;
+    ev_ssize_t ret = evbuffer_copyout_from(m_buffer, &pos, dest, len);
+    return ret > 0 ? static_cast<size_t>(ret) : 0;
+}
+
+size_t CBufferStorage::Peek(CBufferSpan* spans, size_t count, size_t offset, size_t len) const
+{
+    evbuffer_ptr pos;
+    if (len == 0 || evbuffer_ptr_set(m_buffer, &pos, offset, EVBUFFER_PTR_SET) != 0)
+        return 0;
+
+    const int needed = evbuffer_peek(m_buffer, len, &pos, nullptr, 0);
+    assert(needed > 0);
+
+    // Fill in batches. The last extent returned by evbuffer_peek may extend
+    // past the requested length, so each one is trimmed.
+    static constexpr size_t max_batch = 16;
+    evbuffer_iovec vecs[max_batch];
+    size_t filled = 0;
+    while (filled < count && len != 0) {
+        const int batch = static_cast<int>(std::min(max_batch, count - filled));
+        int n = evbuffer_peek(m_buffer, len, &pos, vecs, batch);
+        assert(n > 0);
+        // Counts every extent needed, not just those filled in.
+        n = std::min(n, batch);
+        for (int i = 0; i < n && filled < count && len != 0; ++i) {
+            size_t size = std::min(vecs[i].iov_len, len);
+            spans[filled].data = static_cast<const unsigned char*>(vecs[i].iov_base);
+            spans[filled].size = size;
+            ++filled;
+            len -= size;
+            evbuffer_ptr_set(m_buffer, &pos, size, EVBUFFER_PTR_ADD);
+        }
+    }
+    return static_cast<size_t>(needed);
+}
+
+CBlockStorage::CBlockStorage(size_t capacity) : m_data(new unsigned char[capacity]), m_capacity(capacity)
+{
+}
+
+CBlockStorage::~CBlockStorage() = default;
+
+unsigned char* CBlockStorage::data()
+{
+    return m_data.get();
+}
+
+size_t CBlockStorage::capacity() const
+{
+    return m_capacity;
+}
+
+size_t CBlockStorage::CopyOut(unsigned char* dest, size_t len, size_t offset) const
+{
+    if (offset >= m_capacity)
+        return 0;
+    len = std::min(len, m_capacity - offset);
+    memcpy(dest, m_data.get() + offset, len);
+    return len;
+}
+
+size_t CBlockStorage::Peek(CBufferSpan* spans, size_t count, size_t offset, size_t len) const
+{
+    if (len == 0)
+        return 0;
+    if (count != 0) {
+        spans[0].data = m_data.get() + offset;
+        spans[0].size = len;
+    }
+    return 1;
+}
+
+// Size classes run from 64 bytes to 64KiB.
+static constexpr size_t g_min_pooled_size = 64;
+static constexpr size_t g_max_cached_bytes = 256 * 1024;
+
+CPooledStorage::CPooledStorage(CMessagePool* pool, size_t capacity, int size_class)
+    : m_pool(pool), m_capacity(capacity), m_size_class(size_class)
+{
+}
+
+CPooledStorage::~CPooledStorage() = default;
+
+unsigned char* CPooledStorage::data()
+{
+    return reinterpret_cast<unsigned char*>(this + 1);
+}
+
+const unsigned char* CPooledStorage::data() const
+{
+    return reinterpret_cast<const unsigned char*>(this + 1);
+}
+
+size_t CPooledStorage::CopyOut(unsigned char* dest, size_t len, size_t offset) const
+{
+    if (offset >= m_capacity)
+        return 0;
+    len = std::min(len, m_capacity - offset);
+    memcpy(dest, data() + offset, len);
+    return len;
+}
+
+size_t CPooledStorage::Peek(CBufferSpan* spans, size_t count, size_t offset, size_t len) const
+{
+    if (len == 0)
+        return 0;
+    if (count != 0) {
+        spans[0].data = data() + offset;
+        spans[0].size = len;
+    }
+    return 1;
+}
+
+void CPooledStorage::Destroy()
+{
+    if (m_pool != nullptr)
+        m_pool->recycle(this);
+    else
+        CMessagePool::free(this);
+}
+
+CMessagePool::CMessagePool(bool threadsafe) : m_cached_bytes(0), m_threadsafe(threadsafe)
+{
+}
+
+CMessagePool::~CMessagePool()
+{
+    for (auto& list : m_free) {
+        for (CPooledStorage* storage : list)
+            free(storage);
+    }
+}
+
+CPooledStorage* CMessagePool::create(CMessagePool* pool, size_t capacity, int size_class)
+{
+    void* mem = ::operator new(sizeof(CPooledStorage) + capacity);
+    return new (mem) CPooledStorage(pool, capacity, size_class);
+}
+
+void CMessagePool::free(CPooledStorage* storage)
+{
+    storage->~CPooledStorage();
+    ::operator delete(storage);
+}
+
+CPooledStorage* CMessagePool::alloc(size_t size)
+{
+    int size_class = 0;
+    size_t capacity = g_min_pooled_size;
+    while (capacity < size && size_class < num_size_classes) {
+        capacity <<= 1;
+        size_class++;
+    }
+    if (size_class == num_size_classes)
+        return create(nullptr, size, -1);
+
+    // The storage keeps the pool alive until it is recycled.
+    AddRef();
+    {
+        optional_lock(m_mutex, m_threadsafe);
+        std::vector<CPooledStorage*>& list = m_free[size_class];
+        if (!list.empty()) {
+            CPooledStorage* storage = list.back();
+            list.pop_back();
+            m_cached_bytes -= capacity;
+            return storage;
+        }
+    }
+    return create(this, capacity, size_class);
+}
+
+void CMessagePool::recycle(CPooledStorage* storage)
+{
+    bool cached = false;
+    {
+        optional_lock(m_mutex, m_threadsafe);
+        if (m_cached_bytes + storage->m_capacity <= g_max_cached_bytes) {
+            storage->ResetRef();
+            m_free[storage->m_size_class].push_back(storage);
+            m_cached_bytes += storage->m_capacity;
+            cached = true;
+        }
+    }
+    if (!cached)
+        free(storage);
+    Release();
+}
+
+CPayloadStorage::CPayloadStorage(std::vector<unsigned char>&& data) : m_data(std::move(data))
+{
+}
+
+CPayloadStorage::~CPayloadStorage() = default;
+
+void CPayloadStorage::release_cb(const void* /*unused*/, size_t /*unused*/, void* ctx)
+{
+    assert(ctx != nullptr);
+    static_cast<CPayloadStorage*>(ctx)->Release();
+}
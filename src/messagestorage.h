@@ -0,0 +1,167 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_MESSAGESTORAGE_H
+#define LIBBTCNET_SRC_MESSAGESTORAGE_H
+
+#include "libbtcnet/netmessage.h"
+#include "eventtypes.h"
+
+#include "threads.h"
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <vector>
+
+struct evbuffer;
+
+// Intrusively reference-counted. Starts with a single reference owned by the
+// creator. References may be dropped from any thread.
+class CRefCounted
+{
+public:
+    void AddRef();
+    void Release();
+    // Whether the caller holds the only reference, and so may reuse the
+    // object. Anything done through references since dropped happens first.
+    bool Unique() const;
+
+protected:
+    CRefCounted();
+    virtual ~CRefCounted();
+
+    // Called when the last reference is dropped.
+    virtual void Destroy();
+
+    // Take back ownership of an object whose last reference is gone.
+    void ResetRef();
+
+private:
+    std::atomic<int> m_refcount;
+
+    CRefCounted(const CRefCounted&) = delete;
+    CRefCounted& operator=(const CRefCounted&) = delete;
+};
+
+class CMessageStorage : public CRefCounted
+{
+public:
+    CNetMessage MakeMessage(size_t offset, size_t size);
+
+    // Like MakeMessage, but hands the caller's reference to the message.
+    CNetMessage TakeMessage(size_t offset, size_t size);
+
+    virtual size_t CopyOut(unsigned char* dest, size_t len, size_t offset) const = 0;
+    virtual size_t Peek(CBufferSpan* spans, size_t count, size_t offset, size_t len) const = 0;
+};
+
+// Owns the evbuffer chains of one batch of received messages. The chains are
+// moved out of the connection's input buffer rather than copied.
+class CBufferStorage final : public CMessageStorage
+{
+public:
+    explicit CBufferStorage(event_type<evbuffer>&& buffer);
+    size_t CopyOut(unsigned char* dest, size_t len, size_t offset) const final;
+    size_t Peek(CBufferSpan* spans, size_t count, size_t offset, size_t len) const final;
+
+private:
+    ~CBufferStorage() final;
+    event_type<evbuffer> m_buffer;
+};
+
+// A block of memory that a CRawStream, or a connection reading a large
+// message directly, reads into. Messages received into it reference it
+// directly rather than being copied out.
+class CBlockStorage final : public CMessageStorage
+{
+public:
+    explicit CBlockStorage(size_t capacity);
+    unsigned char* data();
+    size_t capacity() const;
+    size_t CopyOut(unsigned char* dest, size_t len, size_t offset) const final;
+    size_t Peek(CBufferSpan* spans, size_t count, size_t offset, size_t len) const final;
+
+private:
+    ~CBlockStorage() final;
+    std::unique_ptr<unsigned char[]> m_data;
+    const size_t m_capacity;
+};
+
+class CMessagePool;
+
+// A single received message, copied into contiguous memory which is recycled
+// by its pool once the last reference is dropped. The bytes follow the object
+// in the same allocation.
+class CPooledStorage final : public CMessageStorage
+{
+    friend class CMessagePool;
+
+public:
+    unsigned char* data();
+    const unsigned char* data() const;
+    size_t CopyOut(unsigned char* dest, size_t len, size_t offset) const final;
+    size_t Peek(CBufferSpan* spans, size_t count, size_t offset, size_t len) const final;
+
+private:
+    CPooledStorage(CMessagePool* pool, size_t capacity, int size_class);
+    ~CPooledStorage() final;
+    void Destroy() final;
+
+    CMessagePool* const m_pool;
+    const size_t m_capacity;
+    const int m_size_class;
+};
+
+// Recycles the memory of received messages, so that a connection receiving a
+// steady stream of small messages stops allocating once warmed up. Storage is
+// handed out in power-of-two size classes and kept on per-class free lists,
+// up to a limit. Messages larger than the biggest class are allocated and
+// freed individually.
+//
+// Storage may be released from any thread. Each outstanding storage holds a
+// reference to the pool, so the pool outlives its owner if need be.
+class CMessagePool final : public CRefCounted
+{
+    friend class CPooledStorage;
+
+public:
+    explicit CMessagePool(bool threadsafe);
+
+    // Returns storage with room for at least size bytes, holding a single
+    // reference owned by the caller.
+    CPooledStorage* alloc(size_t size);
+
+private:
+    static constexpr int num_size_classes = 11;
+    static CPooledStorage* create(CMessagePool* pool, size_t capacity, int size_class);
+    static void free(CPooledStorage* storage);
+
+    ~CMessagePool() final;
+    void recycle(CPooledStorage* storage);
+
+    std::vector<CPooledStorage*> m_free[num_size_classes];
+    size_t m_cached_bytes;
+    const bool m_threadsafe;
+#ifndef NO_THREADS
+    std::mutex m_mutex;
+#endif
+};
+
+// Backs a CSharedPayload. Each output buffer referencing the data holds a
+// reference, which is dropped by release_cb once the data has been written
+// or discarded.
+class CPayloadStorage final : public CRefCounted
+{
+public:
+    explicit CPayloadStorage(std::vector<unsigned char>&& data);
+    const std::vector<unsigned char> m_data;
+
+    static void release_cb(const void* /*unused*/, size_t /*unused*/, void* ctx);
+
+private:
+    ~CPayloadStorage() final;
+};
+
+#endif // LIBBTCNET_SRC_MESSAGESTORAGE_H
@@ -0,0 +1,190 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "libbtcnet/netmessage.h"
+#include "messagestorage.h"
+
+#include <assert.h>
+
+CNetMessage::CNetMessage()
+    : m_storage(nullptr), m_offset(0), m_size(0)
+{
+}
+
+CNetMessage::CNetMessage(CMessageStorage* storage, size_t offset, size_t size)
+    : m_storage(storage), m_offset(offset), m_size(size)
+{
+}
+
+CNetMessage::CNetMessage(const CNetMessage& rhs)
+    : m_storage(rhs.m_storage), m_offset(rhs.m_offset), m_size(rhs.m_size)
+{
+    if (m_storage != nullptr)
+        m_storage->AddRef();
+}
+
+CNetMessage::CNetMessage(CNetMessage&& rhs) noexcept
+    : m_storage(rhs.m_storage), m_offset(rhs.m_offset), m_size(rhs.m_size)
+{
+    rhs.m_storage = nullptr;
+    rhs.m_offset = 0;
+    rhs.m_size = 0;
+}
+
+CNetMessage& CNetMessage::operator=(const CNetMessage& rhs)
+{
+    if (rhs.m_storage != nullptr)
+        rhs.m_storage->AddRef();
+    if (m_storage != nullptr)
+        m_storage->Release();
+    m_storage = rhs.m_storage;
+    m_offset = rhs.m_offset;
+    m_size = rhs.m_size;
+    return *this;
+}
+
+CNetMessage& CNetMessage::operator=(CNetMessage&& rhs) noexcept
+{
+    if (this != &rhs) {
+        if (m_storage != nullptr)
+            m_storage->Release();
+        m_storage = rhs.m_storage;
+        m_offset = rhs.m_offset;
+        m_size = rhs.m_size;
+        rhs.m_storage = nullptr;
+        rhs.m_offset = 0;
+        rhs.m_size = 0;
+    }
+    return *this;
+}
+
+CNetMessage::~CNetMessage()
+{
+    if (m_storage != nullptr)
+        m_storage->Release();
+}
+
+size_t CNetMessage::GetSize() const
+{
+    return m_size;
+}
+
+size_t CNetMessage::CopyOut(unsigned char* dest, size_t len, size_t offset) const
+{
+    if (m_storage == nullptr || offset >= m_size)
+        return 0;
+    if (len > m_size - offset)
+        len = m_size - offset;
+    return m_storage->CopyOut(dest, len, m_offset + offset);
+}
+
+size_t CNetMessage::Peek(CBufferSpan* spans, size_t count) const
+{
+    if (m_storage == nullptr)
+        return 0;
+    return m_storage->Peek(spans, count, m_offset, m_size);
+}
+
+const unsigned char* CNetMessage::GetContiguous() const
+{
+    CBufferSpan span;
+    if (Peek(&span, 1) == 1)
+        return span.data;
+    return nullptr;
+}
+
+CSharedPayload::CSharedPayload()
+    : m_storage(nullptr)
+{
+}
+
+CSharedPayload::CSharedPayload(const unsigned char* data, size_t size)
+    : m_storage(new CPayloadStorage(std::vector<unsigned char>(data, data + size)))
+{
+}
+
+CSharedPayload::CSharedPayload(std::vector<unsigned char>&& data)
+    : m_storage(new CPayloadStorage(std::move(data)))
+{
+}
+
+CSharedPayload::CSharedPayload(const CSharedPayload& rhs)
+    : m_storage(rhs.m_storage)
+{
+    if (m_storage != nullptr)
+        m_storage->AddRef();
+}
+
+CSharedPayload::CSharedPayload(CSharedPayload&& rhs) noexcept
+    : m_storage(rhs.m_storage)
+{
+    rhs.m_storage = nullptr;
+}
+
+CSharedPayload& CSharedPayload::operator=(const CSharedPayload& rhs)
+{
+    if (rhs.m_storage != nullptr)
+        rhs.m_storage->AddRef();
+    if (m_storage != nullptr)
+        m_storage->Release();
+    m_storage = rhs.m_storage;
+    return *this;
+}
+
+CSharedPayload& CSharedPayload::operator=(CSharedPayload&& rhs) noexcept
+{
+    if (this != &rhs) {
+        if (m_storage != nullptr)
+            m_storage->Release();
+        m_storage = rhs.m_storage;
+        rhs.m_storage = nullptr;
+    }
+    return *this;
+}
+
+CSharedPayload::~CSharedPayload()
+{
+    if (m_storage != nullptr)
+        m_storage->Release();
+}
+
+const unsigned char* CSharedPayload::GetData() const
+{
+    if (m_storage == nullptr || m_storage->m_data.empty())
+        return nullptr;
+    return m_storage->m_data.data();
+}
+
+size_t CSharedPayload::GetSize() const
+{
+    if (m_storage == nullptr)
+        return 0;
+    return m_storage->m_data.size();
+}
+
+CMessageBatch::CMessageBatch()
+{
+}
+
+size_t CMessageBatch::GetCount() const
+{
+    return m_offsets.empty() ? 0 : m_offsets.size() - 1;
+}
+
+size_t CMessageBatch::GetTotalSize() const
+{
+    return m_data.size();
+}
+
+CBufferSpan CMessageBatch::GetMessage(size_t index) const
+{
+    assert(index + 1 < m_offsets.size());
+    CBufferSpan span = {m_data.data() + m_offsets[index], m_offsets[index + 1] - m_offsets[index]};
+    return span;
+}
+
+const unsigned char* CMessageBatch::GetData() const
+{
+    return m_data.data();
+}
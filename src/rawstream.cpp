@@ -0,0 +1,385 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rawstream.h"
+#include "messagestorage.h"
+#include "stats.h"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace
+{
+// Blocks hold this much unless a larger message needs more.
+constexpr size_t block_size = 64 * 1024;
+// Don't bother reading into less room than this.
+constexpr size_t min_read_size = 4096;
+// Read at most this much per event before letting other connections have a
+// turn. Being edge-triggered, the event is activated again to carry on.
+constexpr size_t read_budget = 256 * 1024;
+constexpr int max_iov = 64;
+
+uint64_t now_millis()
+{
+    return stats_now_micros() / 1000;
+}
+
+// The shorter of two timeouts, where 0 is none.
+uint64_t shortest(uint64_t a, uint64_t b)
+{
+    return a == 0 ? b : b == 0 ? a : std::min(a, b);
+}
+
+bool interrupted(int err)
+{
+#if defined(_WIN32)
+    return err == WSAEINTR;
+#else
+    return err == EINTR;
+#endif
+}
+
+bool would_block(int err)
+{
+#if defined(_WIN32)
+    return err == WSAEWOULDBLOCK;
+#else
+    return err == EAGAIN || err == EWOULDBLOCK;
+#endif
+}
+} // namespace
+
+CRawStream::CRawStream(const event_type<event_base>& base, CTimerWheel& timers, evutil_socket_t sock, bool threadsafe)
+    : m_sock(sock), m_output(evbuffer_new()), m_read_cb(nullptr), m_write_cb(nullptr), m_event_cb(nullptr), m_bytes_cb(nullptr), m_ctx(nullptr), m_block(nullptr), m_begin(0), m_end(0), m_shared(false), m_want(0), m_paused(false), m_running(false), m_early_close((event_base_get_features(base) & EV_FEATURE_EARLY_CLOSE) != 0), m_closed(false), m_reading(false), m_writing(false), m_drained(false), m_failed(false), m_write_watermark(0), m_recv_millis(0), m_send_millis(0), m_last_read(0), m_last_write(0), m_destroyed(nullptr)
+{
+    assert(m_output);
+    if (threadsafe)
+        evbuffer_enable_locking(m_output, nullptr);
+    const short flags = EV_READ | EV_WRITE | EV_ET | EV_PERSIST | (m_early_close ? EV_CLOSED : 0);
+    m_event = event_type<event>(event_new(base, sock, flags, event_cb, this));
+    assert(m_event);
+    m_timer.reset(timers, std::bind(&CRawStream::check_timeouts, this));
+}
+
+CRawStream::~CRawStream()
+{
+    // From another thread, these wait for callbacks that are running to
+    // return. From within one, it has to be told.
+    m_event.free();
+    m_timer.del();
+    if (m_destroyed != nullptr)
+        *m_destroyed = true;
+    if (m_block != nullptr)
+        m_block->Release();
+    evutil_closesocket(m_sock);
+}
+
+bool CRawStream::supported(const event_type<event_base>& base)
+{
+    return (event_base_get_features(base) & EV_FEATURE_ET) != 0;
+}
+
+void CRawStream::setcb(read_func readcb, write_func writecb, event_func eventcb, bytes_func bytescb, void* ctx)
+{
+    m_read_cb = readcb;
+    m_write_cb = writecb;
+    m_event_cb = eventcb;
+    m_bytes_cb = bytescb;
+    m_ctx = ctx;
+}
+
+void CRawStream::set_timeouts(int recv_seconds, int send_seconds)
+{
+    m_recv_millis = recv_seconds > 0 ? static_cast<uint64_t>(recv_seconds) * 1000 : 0;
+    m_send_millis = send_seconds > 0 ? static_cast<uint64_t>(send_seconds) * 1000 : 0;
+}
+
+void CRawStream::set_write_watermark(size_t watermark)
+{
+    m_write_watermark = watermark;
+}
+
+void CRawStream::start(size_t want)
+{
+    m_want = want;
+    m_running = true;
+    event_add(m_event, nullptr);
+    if (m_recv_millis != 0 || m_send_millis != 0)
+        m_timer.add(shortest(m_recv_millis, m_send_millis));
+}
+
+void CRawStream::stop()
+{
+    m_running = false;
+    event_del(m_event);
+    m_timer.del();
+    setcb(nullptr, nullptr, nullptr, nullptr, nullptr);
+}
+
+void CRawStream::pause(bool paused)
+{
+    m_paused.store(paused, std::memory_order_relaxed);
+    // Nothing more will be signalled for what arrived in the meantime.
+    if (!paused)
+        event_active(m_event, EV_READ, 0);
+}
+
+evbuffer* CRawStream::output() const
+{
+    return m_output;
+}
+
+void CRawStream::lock()
+{
+    evbuffer_lock(m_output);
+}
+
+void CRawStream::unlock()
+{
+    evbuffer_unlock(m_output);
+}
+
+void CRawStream::flush()
+{
+    if (m_running && write_some())
+        event_active(m_event, EV_WRITE, 0);
+}
+
+CMessageStorage* CRawStream::share(const unsigned char* data, size_t& offset)
+{
+    assert(m_block != nullptr && data >= m_block->data() && data < m_block->data() + m_end);
+    offset = data - m_block->data();
+    m_shared = true;
+    return m_block;
+}
+
+void CRawStream::event_cb(evutil_socket_t /*unused*/, short what, void* ctx)
+{
+    assert(ctx != nullptr);
+    CRawStream* stream = static_cast<CRawStream*>(ctx);
+    if (!stream->m_running)
+        return;
+    if ((what & EV_CLOSED) != 0)
+        stream->m_closed = true;
+    bool destroyed = false;
+    stream->m_destroyed = &destroyed;
+    stream->dispatch(destroyed);
+    if (!destroyed)
+        stream->m_destroyed = nullptr;
+}
+
+// Every callback may free the stream, or stop it, so each is followed by a
+// check for both.
+void CRawStream::dispatch(const bool& destroyed)
+{
+    if (write_some() || m_failed || m_drained) {
+        if (m_failed) {
+            m_event_cb(BEV_EVENT_ERROR | BEV_EVENT_WRITING, m_ctx);
+            return;
+        }
+        m_drained = false;
+        if (m_write_cb != nullptr) {
+            m_write_cb(m_ctx);
+            if (destroyed || !m_running)
+                return;
+        }
+    }
+
+    if (m_paused.load(std::memory_order_relaxed)) {
+        m_reading = false;
+        return;
+    }
+    if (!m_reading) {
+        m_reading = true;
+        m_last_read = now_millis();
+    }
+
+    size_t budget = read_budget;
+    while (m_read_cb != nullptr) {
+        reserve();
+        const size_t room = m_block->capacity() - m_end;
+        const ev_ssize_t got = recv(m_sock, reinterpret_cast<char*>(m_block->data() + m_end), room, 0);
+        if (got == 0) {
+            m_event_cb(BEV_EVENT_EOF | BEV_EVENT_READING, m_ctx);
+            return;
+        } else if (got < 0) {
+            const int err = EVUTIL_SOCKET_ERROR();
+            if (interrupted(err))
+                continue;
+            if (!would_block(err))
+                m_event_cb(BEV_EVENT_ERROR | BEV_EVENT_READING, m_ctx);
+            return;
+        }
+        const size_t len = static_cast<size_t>(got);
+        m_end += len;
+        m_last_read = now_millis();
+        if (m_bytes_cb != nullptr)
+            m_bytes_cb(len, 0, m_ctx);
+
+        while (m_read_cb != nullptr && m_end - m_begin >= m_want) {
+            const size_t consumed = m_read_cb(m_block->data() + m_begin, m_end - m_begin, m_want, m_ctx);
+            if (destroyed || !m_running)
+                return;
+            assert(consumed <= m_end - m_begin);
+            m_begin += consumed;
+            if (consumed == 0)
+                break;
+        }
+        if (m_begin == m_end) {
+            // Start again from the front, unless messages still reference
+            // the block. One that grew for a large message isn't kept.
+            if (m_block->capacity() > block_size) {
+                m_block->Release();
+                m_block = nullptr;
+                m_shared = false;
+                m_begin = m_end = 0;
+            } else if (!m_shared) {
+                m_begin = m_end = 0;
+            }
+        }
+
+        // A short read emptied the socket. Anything arriving later is
+        // signalled afresh.
+        if ((len < room && m_early_close && !m_closed) || m_paused.load(std::memory_order_relaxed))
+            return;
+        if (len >= budget) {
+            event_active(m_event, EV_READ, 0);
+            return;
+        }
+        budget -= len;
+    }
+}
+
+// Returns whether callbacks are owed.
+bool CRawStream::write_some()
+{
+    size_t written = 0;
+    size_t left;
+    bool failed = false;
+    lock();
+    for (;;) {
+        evbuffer_iovec vecs[max_iov];
+        int count = evbuffer_peek(m_output, -1, nullptr, vecs, max_iov);
+        if (count <= 0)
+            break;
+        count = std::min(count, max_iov);
+        size_t total = 0;
+#if defined(_WIN32)
+        // No gathering here, but raw streams aren't either, lacking
+        // edge-triggered events.
+        count = 1;
+        total = vecs[0].iov_len;
+        const ev_ssize_t ret = send(m_sock, static_cast<const char*>(vecs[0].iov_base), static_cast<int>(total), 0);
+#else
+        iovec iov[max_iov];
+        for (int i = 0; i < count; ++i) {
+            iov[i].iov_base = vecs[i].iov_base;
+            iov[i].iov_len = vecs[i].iov_len;
+            total += vecs[i].iov_len;
+        }
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        const ev_ssize_t ret = sendmsg(m_sock, &msg, MSG_NOSIGNAL);
+#endif
+        if (ret < 0) {
+            const int err = EVUTIL_SOCKET_ERROR();
+            if (interrupted(err))
+                continue;
+            failed = !would_block(err);
+            break;
+        }
+        evbuffer_drain(m_output, static_cast<size_t>(ret));
+        written += static_cast<size_t>(ret);
+        // The socket is full. The event fires once it has room.
+        if (static_cast<size_t>(ret) < total)
+            break;
+    }
+    left = evbuffer_get_length(m_output);
+    unlock();
+
+    if (written != 0 || (left != 0 && !m_writing))
+        m_last_write = now_millis();
+    m_writing = left != 0;
+    if (written != 0) {
+        if (m_bytes_cb != nullptr)
+            m_bytes_cb(0, written, m_ctx);
+        if (m_write_cb != nullptr && left <= m_write_watermark)
+            m_drained = true;
+    }
+    if (failed)
+        m_failed = true;
+    return m_failed || m_drained;
+}
+
+// Make room for the next read after the unconsumed bytes, which are kept
+// together. A shared block is never moved within.
+void CRawStream::reserve()
+{
+    const size_t pending = m_end - m_begin;
+    const size_t needed = std::max(m_want, pending + min_read_size);
+    if (m_block != nullptr) {
+        const size_t capacity = m_block->capacity();
+        if (capacity - m_begin >= needed)
+            return;
+        if (!m_shared && capacity >= needed) {
+            memmove(m_block->data(), m_block->data() + m_begin, pending);
+            m_begin = 0;
+            m_end = pending;
+            return;
+        }
+    }
+    CBlockStorage* block = new CBlockStorage(std::max(block_size, needed));
+    if (pending != 0)
+        memcpy(block->data(), m_block->data() + m_begin, pending);
+    if (m_block != nullptr)
+        m_block->Release();
+    m_block = block;
+    m_begin = 0;
+    m_end = pending;
+    m_shared = false;
+}
+
+void CRawStream::check_timeouts()
+{
+    if (!m_running)
+        return;
+    const uint64_t now = now_millis();
+    uint64_t next = shortest(m_recv_millis, m_send_millis);
+    if (m_recv_millis != 0 && m_reading && !m_paused.load(std::memory_order_relaxed)) {
+        const uint64_t idle = now - m_last_read;
+        if (idle >= m_recv_millis) {
+            m_event_cb(BEV_EVENT_TIMEOUT | BEV_EVENT_READING, m_ctx);
+            return;
+        }
+        next = std::min(next, m_recv_millis - idle);
+    }
+    if (m_send_millis != 0 && m_writing) {
+        const uint64_t idle = now - m_last_write;
+        if (idle >= m_send_millis) {
+            m_event_cb(BEV_EVENT_TIMEOUT | BEV_EVENT_WRITING, m_ctx);
+            return;
+        }
+        next = std::min(next, m_send_millis - idle);
+    }
+    m_timer.add(next);
+}
@@ -0,0 +1,135 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_RAWSTREAM_H
+#define LIBBTCNET_SRC_RAWSTREAM_H
+
+#include "eventtypes.h"
+#include "timerwheel.h"
+
+#include <event2/util.h>
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+struct evbuffer;
+struct event;
+struct event_base;
+
+class CBlockStorage;
+class CMessageStorage;
+
+// A connected socket driven by a single edge-triggered event rather than by a
+// bufferevent, for connections that need none of its extras: no rate limits,
+// deferred callbacks or buffer callbacks. Reads land in one contiguous block,
+// which the reader parses where it lies, and messages handed out without
+// copying reference the block itself. Writes are gathered straight from the
+// output buffer into one system call.
+//
+// The output may be used and reading paused from any thread. Everything else
+// belongs to the thread running the base.
+class CRawStream
+{
+public:
+    // Called with everything read but not yet consumed, once there are at
+    // least want bytes of it. Returns how many were consumed, and sets want
+    // for next time. Called again at once if it consumed some and want bytes
+    // are still left. May free the stream.
+    typedef size_t (*read_func)(const unsigned char* data, size_t len, size_t& want, void* ctx);
+    // Called once a write leaves no more than the write watermark in the
+    // output. May free the stream.
+    typedef void (*write_func)(void* ctx);
+    // Called with BEV_EVENT_* flags on EOF, errors and timeouts, as for a
+    // bufferevent. May free the stream.
+    typedef void (*event_func)(short what, void* ctx);
+    // Called with the bytes moved by each read and write. Must not free the
+    // stream.
+    typedef void (*bytes_func)(size_t read, size_t written, void* ctx);
+
+    CRawStream(const event_type<event_base>& base, CTimerWheel& timers, evutil_socket_t sock, bool threadsafe);
+    // Closes the socket.
+    ~CRawStream();
+
+    // Whether the base can drive a stream. Edge-triggered events aren't
+    // available from every backend.
+    static bool supported(const event_type<event_base>& base);
+
+    void setcb(read_func readcb, write_func writecb, event_func eventcb, bytes_func bytescb, void* ctx);
+    // In seconds, 0 for none. Reads time out while not paused, and writes
+    // while anything is waiting to be sent.
+    void set_timeouts(int recv_seconds, int send_seconds);
+    void set_write_watermark(size_t watermark);
+    // Start reading, handing over the first want bytes once they arrive.
+    void start(size_t want);
+    // No more I/O or callbacks. Anything not yet sent is kept.
+    void stop();
+    void pause(bool paused);
+
+    // Lock while using the output.
+    evbuffer* output() const;
+    void lock();
+    void unlock();
+    // Write as much of the output as the socket will take now.
+    void flush();
+
+    // From within the read callback: storage which messages within data may
+    // reference, and data's offset within it. Nothing read into it is
+    // overwritten afterwards.
+    CMessageStorage* share(const unsigned char* data, size_t& offset);
+
+private:
+    static void event_cb(evutil_socket_t /*unused*/, short what, void* ctx);
+    void dispatch(const bool& destroyed);
+    void check_timeouts();
+    bool write_some();
+    void reserve();
+
+    const evutil_socket_t m_sock;
+    event_type<event> m_event;
+    CTimer m_timer;
+    event_type<evbuffer> m_output;
+
+    read_func m_read_cb;
+    write_func m_write_cb;
+    event_func m_event_cb;
+    bytes_func m_bytes_cb;
+    void* m_ctx;
+
+    // Unconsumed input lies in [m_begin, m_end) of m_block. Once shared, the
+    // block is only ever appended to.
+    CBlockStorage* m_block;
+    size_t m_begin;
+    size_t m_end;
+    bool m_shared;
+    size_t m_want;
+
+    std::atomic<bool> m_paused;
+    bool m_running;
+    // Whether the base reports the peer closing (EV_CLOSED). Until it has,
+    // a short read means there is nothing more to read.
+    const bool m_early_close;
+    bool m_closed;
+    // Whether the read timeout is running, and the output waiting on the
+    // socket.
+    bool m_reading;
+    bool m_writing;
+    // Callbacks owed from flush, which are made from the event.
+    bool m_drained;
+    bool m_failed;
+    size_t m_write_watermark;
+    uint64_t m_recv_millis;
+    uint64_t m_send_millis;
+    uint64_t m_last_read;
+    uint64_t m_last_write;
+
+    // Set while callbacks are being made, so that freeing the stream from
+    // one of them can be noticed.
+    bool* m_destroyed;
+
+    CRawStream(const CRawStream&) = delete;
+    CRawStream& operator=(const CRawStream&) = delete;
+};
+
+#endif // LIBBTCNET_SRC_RAWSTREAM_H
@@ -0,0 +1,92 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "received.h"
+#include "eventtypes.h"
+#include "messagestorage.h"
+
+#include <event2/buffer.h>
+
+#include <assert.h>
+#include <string.h>
+
+void CReceivedMessages::extract(evbuffer* input, const std::vector<size_t>& sizes, CHandlerOptions::Delivery delivery, CMessagePool* pool)
+{
+    if (delivery == CHandlerOptions::DELIVER_BUFFERS) {
+        // Move the whole batch out at once. Only the bytes sharing the last
+        // chain with the following message are copied. Everything else just
+        // changes owners.
+        event_type<evbuffer> moved(evbuffer_new());
+        int ret = evbuffer_remove_buffer(input, moved, totalsize);
+        assert(ret == static_cast<int>(totalsize));
+        (void)ret;
+        CMessageStorage* storage = new CBufferStorage(std::move(moved));
+        buffers.reserve(sizes.size());
+        size_t offset = 0;
+        for (size_t size : sizes) {
+            buffers.push_back(storage->MakeMessage(offset, size));
+            offset += size;
+        }
+        storage->Release();
+    } else if (delivery == CHandlerOptions::DELIVER_POOLED) {
+        assert(pool != nullptr);
+        buffers.reserve(sizes.size());
+        for (size_t size : sizes) {
+            CPooledStorage* storage = pool->alloc(size);
+            evbuffer_remove(input, storage->data(), size);
+            buffers.push_back(storage->TakeMessage(0, size));
+        }
+    } else if (delivery == CHandlerOptions::DELIVER_BATCH) {
+        // One copy for the whole read.
+        batch.m_data.resize(totalsize);
+        evbuffer_remove(input, batch.m_data.data(), totalsize);
+        batch.m_offsets.reserve(sizes.size() + 1);
+        size_t offset = 0;
+        batch.m_offsets.push_back(offset);
+        for (size_t size : sizes) {
+            offset += size;
+            batch.m_offsets.push_back(offset);
+        }
+    } else {
+        for (size_t size : sizes) {
+            vectors.emplace_back(size, 0);
+            evbuffer_remove(input, vectors.back().data(), size);
+        }
+    }
+}
+
+void CReceivedMessages::extract(const unsigned char* data, const std::vector<size_t>& sizes, CHandlerOptions::Delivery delivery, CMessagePool* pool, CMessageStorage* storage, size_t offset)
+{
+    if (delivery == CHandlerOptions::DELIVER_BUFFERS) {
+        assert(storage != nullptr);
+        buffers.reserve(sizes.size());
+        for (size_t size : sizes) {
+            buffers.push_back(storage->MakeMessage(offset, size));
+            offset += size;
+        }
+    } else if (delivery == CHandlerOptions::DELIVER_POOLED) {
+        assert(pool != nullptr);
+        buffers.reserve(sizes.size());
+        for (size_t size : sizes) {
+            CPooledStorage* pooled = pool->alloc(size);
+            memcpy(pooled->data(), data, size);
+            buffers.push_back(pooled->TakeMessage(0, size));
+            data += size;
+        }
+    } else if (delivery == CHandlerOptions::DELIVER_BATCH) {
+        batch.m_data.assign(data, data + totalsize);
+        batch.m_offsets.reserve(sizes.size() + 1);
+        size_t end = 0;
+        batch.m_offsets.push_back(end);
+        for (size_t size : sizes) {
+            end += size;
+            batch.m_offsets.push_back(end);
+        }
+    } else {
+        for (size_t size : sizes) {
+            vectors.emplace_back(data, data + size);
+            data += size;
+        }
+    }
+}
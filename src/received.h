@@ -0,0 +1,39 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_RECEIVED_H
+#define LIBBTCNET_SRC_RECEIVED_H
+
+#include "libbtcnet/handler.h"
+#include "libbtcnet/netmessage.h"
+
+#include <list>
+#include <stddef.h>
+#include <vector>
+
+struct evbuffer;
+class CMessagePool;
+class CMessageStorage;
+
+// Messages removed from the input buffer by a single read callback. Only one
+// of the containers is used, depending on the handler's delivery mode.
+struct CReceivedMessages {
+    CReceivedMessages() : totalsize(0) {}
+
+    // Remove messages of the given sizes, totalling totalsize, from the front
+    // of input. pool is only used for DELIVER_POOLED.
+    void extract(evbuffer* input, const std::vector<size_t>& sizes, CHandlerOptions::Delivery delivery, CMessagePool* pool);
+
+    // The same, for messages lying contiguously from data. For
+    // DELIVER_BUFFERS they reference storage, in which data starts at offset,
+    // rather than being copied.
+    void extract(const unsigned char* data, const std::vector<size_t>& sizes, CHandlerOptions::Delivery delivery, CMessagePool* pool, CMessageStorage* storage, size_t offset);
+
+    std::list<std::vector<unsigned char> > vectors;
+    std::vector<CNetMessage> buffers;
+    CMessageBatch batch;
+    size_t totalsize;
+};
+
+#endif // LIBBTCNET_SRC_RECEIVED_H
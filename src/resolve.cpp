@@ -3,10 +3,9 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "resolve.h"
-#include "eventtypes.h"
+#include "dnscache.h"
 #include "libbtcnet/connection.h"
-
-#include <event2/dns.h>
+#include "stats.h"
 
 #if defined(_WIN32)
 #include <ws2tcpip.h>
@@ -15,95 +14,110 @@
 #include <string.h>
 #include <assert.h>
 
-CDNSResponse::iterator::iterator() : m_ai(nullptr)
+CDNSResponse::iterator::iterator() : m_addr(nullptr)
 {
 }
 
-CDNSResponse::iterator::iterator(evutil_addrinfo* ai) : m_ai(ai)
+CDNSResponse::iterator::iterator(const CDNSAddress* addr) : m_addr(addr)
 {
 }
 
 CDNSResponse::iterator& CDNSResponse::iterator::operator++()
 {
-    assert(m_ai != nullptr);
-    m_ai = m_ai->ai_next;
+    assert(m_addr != nullptr);
+    ++m_addr;
     return *this;
 }
 
 CDNSResponse::iterator CDNSResponse::iterator::operator++(int)
 {
-    assert(m_ai != nullptr);
-    iterator ret = iterator(m_ai);
-    m_ai = m_ai->ai_next;
+    assert(m_addr != nullptr);
+    iterator ret = iterator(m_addr);
+    ++m_addr;
     return ret;
 }
 
-evutil_addrinfo* CDNSResponse::iterator::operator->() const
+const CDNSAddress* CDNSResponse::iterator::operator->() const
 {
-    assert(m_ai != nullptr);
-    return m_ai;
+    assert(m_addr != nullptr);
+    return m_addr;
 }
 
-bool CDNSResponse::iterator::operator==(const iterator& rhs) const
+const CDNSAddress& CDNSResponse::iterator::operator*() const
 {
-    return m_ai == rhs.m_ai;
+    assert(m_addr != nullptr);
+    return *m_addr;
 }
 
-bool CDNSResponse::iterator::operator!=(const iterator& rhs) const
+bool CDNSResponse::iterator::operator==(const iterator& rhs) const
 {
-    return !operator==(rhs);
+    return m_addr == rhs.m_addr;
 }
 
-CDNSResponse::CDNSResponse() : m_ai(nullptr)
+bool CDNSResponse::iterator::operator!=(const iterator& rhs) const
 {
+    return !operator==(rhs);
 }
 
-CDNSResponse::CDNSResponse(evutil_addrinfo* ai) : m_ai(ai)
-{
-}
+CDNSResponse::CDNSResponse() = default;
 
-CDNSResponse::~CDNSResponse()
+CDNSResponse::CDNSResponse(std::shared_ptr<const std::vector<CDNSAddress> > addrs) : m_addrs(std::move(addrs))
 {
-    clear();
+    if (m_addrs && m_addrs->empty())
+        m_addrs.reset();
 }
 
 CDNSResponse::iterator CDNSResponse::begin() const
 {
-    return CDNSResponse::iterator(m_ai);
+    return m_addrs ? CDNSResponse::iterator(m_addrs->data()) : end();
 }
 
 CDNSResponse::iterator CDNSResponse::end() const
 {
-    return CDNSResponse::iterator(nullptr);
+    return m_addrs ? CDNSResponse::iterator(m_addrs->data() + m_addrs->size()) : CDNSResponse::iterator();
 }
 
 void CDNSResponse::clear()
 {
-    if (m_ai != nullptr)
-        evutil_freeaddrinfo(m_ai);
-    m_ai = nullptr;
+    m_addrs.reset();
 }
 
 bool CDNSResponse::empty() const
 {
-    return m_ai == nullptr;
+    return !m_addrs;
+}
+
+CDNSResponse CDNSResponse::from_addrinfo(const evutil_addrinfo* ai)
+{
+    std::shared_ptr<std::vector<CDNSAddress> > addrs = std::make_shared<std::vector<CDNSAddress> >();
+    for (; ai != nullptr; ai = ai->ai_next) {
+        if (ai->ai_addr == nullptr || ai->ai_addrlen > sizeof(sockaddr_storage))
+            continue;
+        CDNSAddress addr;
+        memset(&addr.storage, 0, sizeof(addr.storage));
+        memcpy(&addr.storage, ai->ai_addr, ai->ai_addrlen);
+        addr.len = ai->ai_addrlen;
+        addrs->push_back(addr);
+    }
+    return CDNSResponse(std::move(addrs));
 }
 
 
-CDNSResolve::~CDNSResolve() = default;
+CDNSResolve::CDNSResolve()
+    : m_lookup(nullptr), m_resolve_start(0), m_resolve_time(0), m_resolve_timed(false)
+{
+}
 
-CDNSResponse::CDNSResponse(CDNSResponse&& rhs) noexcept
+CDNSResolve::~CDNSResolve()
 {
-    m_ai = rhs.m_ai;
-    rhs.m_ai = nullptr;
+    CancelResolve();
 }
 
-CDNSResponse& CDNSResponse::operator=(CDNSResponse&& rhs) noexcept
+void CDNSResolve::RecordResolveTime(CLatencyCounter& counter)
 {
-    clear();
-    m_ai = rhs.m_ai;
-    rhs.m_ai = nullptr;
-    return *this;
+    if (m_resolve_timed)
+        counter.add(m_resolve_time);
+    m_resolve_timed = false;
 }
 
 bool CDNSResolve::SetResolveFamily(int family, evutil_addrinfo* hint)
@@ -119,27 +133,20 @@ bool CDNSResolve::SetResolveFamily(int family, evutil_addrinfo* hint)
     return true;
 }
 
-event_type<evdns_getaddrinfo_request> CDNSResolve::Resolve(const event_type<evdns_base>& dns_base, const char* host, const char* port, const evutil_addrinfo* hints)
+void CDNSResolve::Resolve(CDNSCache& cache, const std::string& host, const std::string& port, const evutil_addrinfo* hints)
 {
-    assert(host != nullptr);
-    assert(port != nullptr);
-    // evdns_getaddrinfo may return NULL on success.
-    event_type<evdns_getaddrinfo_request> result;
-    result.reset(evdns_getaddrinfo(dns_base, host, port, hints, dns_callback, this));
-    return result;
+    m_resolve_start = stats_now_micros();
+    m_resolve_timed = false;
+    cache.lookup(this, host.c_str(), port.c_str(), hints);
 }
 
-void CDNSResolve::dns_callback(int result, evutil_addrinfo* ai, void* ctx)
+void CDNSResolve::CancelResolve()
 {
-    if (result == EVUTIL_EAI_CANCEL) {
-        // Do nothing. Class may no longer exist.
-    } else if (result == DNS_ERR_NONE) {
-        assert(ctx != nullptr);
-        CDNSResolve* resolver = static_cast<CDNSResolve*>(ctx);
-        resolver->OnResolveSuccess(CDNSResponse(ai));
-    } else {
-        assert(ctx != nullptr);
-        CDNSResolve* resolver = static_cast<CDNSResolve*>(ctx);
-        resolver->OnResolveFailure(result);
-    }
+    if (m_lookup != nullptr)
+        m_lookup->cache->cancel(this);
+}
+
+bool CDNSResolve::IsResolving() const
+{
+    return m_lookup != nullptr;
 }
@@ -5,11 +5,27 @@
 #ifndef LIBBTCNET_SRC_RESOLVE_H
 #define LIBBTCNET_SRC_RESOLVE_H
 
-#include "eventtypes.h"
 #include <event2/util.h>
 
-struct evdns_base;
-struct evdns_getaddrinfo_request;
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class CDNSCache;
+class CLatencyCounter;
+struct CDNSLookup;
+
+struct CDNSAddress {
+    sockaddr_storage storage;
+    socklen_t len;
+
+    sockaddr* addr() { return reinterpret_cast<sockaddr*>(&storage); }
+    const sockaddr* addr() const { return reinterpret_cast<const sockaddr*>(&storage); }
+};
+
+// The addresses a lookup returned. Cheap to copy: the cache and everyone who
+// asked for the same name share one immutable list.
 class CDNSResponse
 {
 public:
@@ -17,45 +33,61 @@ public:
     {
     public:
         iterator();
-        explicit iterator(evutil_addrinfo* ai);
+        explicit iterator(const CDNSAddress* addr);
         iterator& operator++();
         iterator operator++(int);
         bool operator==(const iterator& rhs) const;
         bool operator!=(const iterator& rhs) const;
-        evutil_addrinfo* operator->() const;
+        const CDNSAddress* operator->() const;
+        const CDNSAddress& operator*() const;
 
     private:
-        evutil_addrinfo* m_ai;
+        const CDNSAddress* m_addr;
     };
 
     CDNSResponse();
-    CDNSResponse(CDNSResponse&& rhs) noexcept;
-    CDNSResponse(const CDNSResponse&) = delete;
-    CDNSResponse& operator=(const CDNSResponse&) = delete;
-    CDNSResponse& operator=(CDNSResponse&& rhs) noexcept;
-    explicit CDNSResponse(evutil_addrinfo* ai);
-    ~CDNSResponse();
+    explicit CDNSResponse(std::shared_ptr<const std::vector<CDNSAddress> > addrs);
     void clear();
     bool empty() const;
     CDNSResponse::iterator begin() const;
     CDNSResponse::iterator end() const;
 
+    // Copy a getaddrinfo result, which the caller still owns.
+    static CDNSResponse from_addrinfo(const evutil_addrinfo* ai);
+
 private:
-    evutil_addrinfo* m_ai;
+    std::shared_ptr<const std::vector<CDNSAddress> > m_addrs;
 };
 
 class CDNSResolve
 {
+    friend class CDNSCache;
+
 protected:
+    CDNSResolve();
     virtual ~CDNSResolve();
     virtual void OnResolveSuccess(CDNSResponse&& response) = 0;
     virtual void OnResolveFailure(int result) = 0;
-    event_type<evdns_getaddrinfo_request> Resolve(const event_type<evdns_base>& dns_base, const char* host, const char* port, const evutil_addrinfo* hints);
+
+    // Look host up through cache. If the answer is cached, or cannot be
+    // looked up, the result is delivered before this returns.
+    void Resolve(CDNSCache& cache, const std::string& host, const std::string& port, const evutil_addrinfo* hints);
+    // Stop waiting for the result of Resolve. The lookup itself carries on
+    // for the cache's benefit.
+    void CancelResolve();
+    bool IsResolving() const;
+
+    // From OnResolveSuccess or OnResolveFailure, add how long the lookup took
+    // to counter. Does nothing if the result didn't come from a lookup.
+    void RecordResolveTime(CLatencyCounter& counter);
 
     static bool SetResolveFamily(int family, evutil_addrinfo* hint);
 
 private:
-    static void dns_callback(int result, evutil_addrinfo* ai, void* ctx);
+    CDNSLookup* m_lookup;
+    uint64_t m_resolve_start;
+    uint64_t m_resolve_time;
+    bool m_resolve_timed;
 };
 
 #endif // LIBBTCNET_SRC_RESOLVE_H
@@ -13,13 +13,14 @@
 #endif
 
 CResolveOnly::CResolveOnly(CConnectionHandlerInt& handler, CConnection&& conn, ConnID id)
-    : m_id(id), m_connection(std::move(conn)), m_retries(m_connection.GetOptions().nRetries), m_handler(handler), m_retry_event(handler.GetEventBase(), -1, 0, std::bind(&CResolveOnly::Resolve, this)), m_retry_timeout({m_connection.GetOptions().nRetryInterval, 0})
+    : m_id(id), m_connection(std::move(conn)), m_retries(m_connection.GetOptions().nRetries), m_handler(handler)
 {
+    m_retry_timer.reset(handler.GetTimers(), std::bind(&CResolveOnly::Resolve, this));
 }
 
 void CResolveOnly::Resolve()
 {
-    assert(!m_request);
+    assert(!IsResolving());
     assert(m_connection.IsDNS());
 
     const CConnectionOptions& opts = m_connection.GetOptions();
@@ -31,28 +32,29 @@ void CResolveOnly::Resolve()
     hint.ai_flags |= opts.doResolve == CConnectionOptions::NO_RESOLVE ? EVUTIL_AI_NUMERICHOST : EVUTIL_AI_ADDRCONFIG;
 
     if (m_connection.CanResolve() && SetResolveFamily(opts.nFamily, &hint))
-        m_request = CDNSResolve::Resolve(m_handler.GetDNSBase(), m_connection.GetHost().c_str(), std::to_string(m_connection.GetPort()).c_str(), &hint);
+        CDNSResolve::Resolve(m_handler.GetDNSCache(), m_connection.GetHost(), std::to_string(m_connection.GetPort()), &hint);
     else
         OnResolveFailure(0);
 }
 
 void CResolveOnly::OnResolveFailure(int error)
 {
-    m_request.reset(nullptr);
+    RecordResolveTime(m_handler.GetCounters().dns_latency);
     m_handler.OnResolveFailure(m_id, m_connection, error, m_retries > 0 ? m_retries-- != 0 : m_retries != 0);
 }
 
 void CResolveOnly::OnResolveSuccess(CDNSResponse&& response)
 {
-    m_request.reset(nullptr);
+    RecordResolveTime(m_handler.GetCounters().dns_latency);
     std::list<CConnection> connections;
     for (auto it = response.begin(); it != response.end(); ++it)
-        connections.emplace_back(m_connection.GetOptions(), m_connection.GetNetConfig(), it->ai_addr, it->ai_addrlen);
+        connections.emplace_back(m_connection.GetOptions(), m_connection.GetNetConfig(), it->addr(), it->len);
     m_retries = m_connection.GetOptions().nRetries;
+    m_backoff.reset();
     m_handler.OnResolveComplete(m_id, m_connection, std::move(connections));
 }
 
 void CResolveOnly::Retry()
 {
-    m_retry_event.active();
+    m_retry_timer.add(m_backoff.next(m_connection.GetOptions()));
 }
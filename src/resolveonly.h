@@ -5,9 +5,11 @@
 #ifndef LIBBTCNET_SRC_RESOLVEONLY_H
 #define LIBBTCNET_SRC_RESOLVEONLY_H
 
+#include "backoff.h"
 #include "handler.h"
 #include "libbtcnet/connection.h"
 #include "resolve.h"
+#include "timerwheel.h"
 
 class CConnection;
 class CConnectionHandlerInt;
@@ -30,10 +32,9 @@ private:
     const ConnID m_id;
     const CConnection m_connection;
     int m_retries;
-    event_type<evdns_getaddrinfo_request> m_request;
     CConnectionHandlerInt& m_handler;
-    CEvent m_retry_event;
-    const timeval m_retry_timeout;
+    CTimer m_retry_timer;
+    CBackoff m_backoff;
 };
 
 #endif // LIBBTCNET_SRC_RESOLVEONLY_H
@@ -0,0 +1,205 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "scan.h"
+
+#include <event2/buffer.h>
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+// Needles up to this long are searched for across chains here. Longer ones
+// are left to evbuffer_search.
+constexpr size_t max_carry = 64;
+constexpr int max_extents = 16;
+
+typedef size_t (*find_func)(const unsigned char* data, size_t len, const unsigned char* needle, size_t needle_len);
+
+size_t find_scalar(const unsigned char* data, size_t len, const unsigned char* needle, size_t needle_len)
+{
+    if (len < needle_len)
+        return len;
+    const size_t last = len - needle_len;
+    for (size_t i = 0; i <= last; ++i) {
+        const void* hit = memchr(data + i, needle[0], last - i + 1);
+        if (hit == nullptr)
+            break;
+        i = static_cast<const unsigned char*>(hit) - data;
+        if (memcmp(data + i + 1, needle + 1, needle_len - 1) == 0)
+            return i;
+    }
+    return len;
+}
+
+#ifdef SCAN_X86
+// Whatever is left over after the last whole vector.
+size_t find_tail(const unsigned char* data, size_t len, size_t i, const unsigned char* needle, size_t needle_len)
+{
+    const size_t found = find_scalar(data + i, len - i, needle, needle_len);
+    return found == len - i ? len : i + found;
+}
+
+__attribute__((target("sse2"))) size_t find_sse2(const unsigned char* data, size_t len, const unsigned char* needle, size_t needle_len)
+{
+    const __m128i first = _mm_set1_epi8(static_cast<char>(needle[0]));
+    const __m128i last = _mm_set1_epi8(static_cast<char>(needle[needle_len - 1]));
+    size_t i = 0;
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + needle_len - 1));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last))));
+        while (mask != 0) {
+            const unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+            if (memcmp(data + i + bit + 1, needle + 1, needle_len - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_tail(data, len, i, needle, needle_len);
+}
+
+__attribute__((target("avx2"))) size_t find_avx2(const unsigned char* data, size_t len, const unsigned char* needle, size_t needle_len)
+{
+    const __m256i first = _mm256_set1_epi8(static_cast<char>(needle[0]));
+    const __m256i last = _mm256_set1_epi8(static_cast<char>(needle[needle_len - 1]));
+    size_t i = 0;
+    for (; i + needle_len - 1 + 32 <= len; i += 32) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + needle_len - 1));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last))));
+        while (mask != 0) {
+            const unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+            if (memcmp(data + i + bit + 1, needle + 1, needle_len - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_tail(data, len, i, needle, needle_len);
+}
+#endif
+
+find_func select_find()
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &find_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return &find_sse2;
+#endif
+    return &find_scalar;
+}
+
+find_func g_find = select_find();
+} // namespace
+
+bool use_find_impl(find_impl impl)
+{
+    switch (impl) {
+    case FIND_SCALAR:
+        g_find = &find_scalar;
+        return true;
+    case FIND_SSE2:
+#ifdef SCAN_X86
+        if (__builtin_cpu_supports("sse2")) {
+            g_find = &find_sse2;
+            return true;
+        }
+#endif
+        break;
+    case FIND_AVX2:
+#ifdef SCAN_X86
+        if (__builtin_cpu_supports("avx2")) {
+            g_find = &find_avx2;
+            return true;
+        }
+#endif
+        break;
+    }
+    return false;
+}
+
+size_t find_bytes(const unsigned char* data, size_t len, const unsigned char* needle, size_t needle_len)
+{
+    assert(needle_len != 0);
+    if (len < needle_len)
+        return len;
+    if (needle_len == 1) {
+        const void* hit = memchr(data, needle[0], len);
+        return hit == nullptr ? len : static_cast<const unsigned char*>(hit) - data;
+    }
+    return g_find(data, len, needle, needle_len);
+}
+
+size_t find_bytes(evbuffer* input, size_t from, const unsigned char* needle, size_t needle_len)
+{
+    assert(needle_len != 0);
+    const size_t total = evbuffer_get_length(input);
+    if (from >= total || total - from < needle_len)
+        return total;
+    evbuffer_ptr pos;
+    evbuffer_ptr_set(input, &pos, from, EVBUFFER_PTR_SET);
+    if (needle_len > max_carry) {
+        const evbuffer_ptr found = evbuffer_search(input, reinterpret_cast<const char*>(needle), needle_len, &pos);
+        return found.pos < 0 ? total : static_cast<size_t>(found.pos);
+    }
+
+    // Each chain is searched where it lies. An occurrence spanning chains
+    // starts within the needle_len - 1 bytes carried over from the chains
+    // before, so it's found by searching those together with the start of
+    // the next.
+    unsigned char window[2 * max_carry];
+    const size_t keep = needle_len - 1;
+    size_t carry = 0;
+    size_t offset = from;
+    size_t peeked = 0;
+    while (offset < total) {
+        // Relative to where the last batch began, to avoid walking the
+        // chains from the front each time.
+        if (peeked != 0)
+            evbuffer_ptr_set(input, &pos, peeked, EVBUFFER_PTR_ADD);
+        peeked = 0;
+        evbuffer_iovec vecs[max_extents];
+        int count = evbuffer_peek(input, -1, &pos, vecs, max_extents);
+        if (count <= 0)
+            break;
+        count = std::min(count, max_extents);
+        for (int i = 0; i < count; ++i) {
+            const unsigned char* data = static_cast<const unsigned char*>(vecs[i].iov_base);
+            const size_t len = vecs[i].iov_len;
+            if (carry != 0) {
+                const size_t head = std::min(len, keep);
+                memcpy(window + carry, data, head);
+                const size_t found = find_bytes(window, carry + head, needle, needle_len);
+                if (found < carry + head)
+                    return offset - carry + found;
+            }
+            const size_t found = find_bytes(data, len, needle, needle_len);
+            if (found < len)
+                return offset + found;
+            if (len >= keep) {
+                memcpy(window, data + len - keep, keep);
+                carry = keep;
+            } else {
+                memcpy(window + carry, data, len);
+                carry += len;
+                if (carry > keep) {
+                    memmove(window, window + carry - keep, keep);
+                    carry = keep;
+                }
+            }
+            offset += len;
+            peeked += len;
+        }
+    }
+    return total;
+}
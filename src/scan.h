@@ -0,0 +1,34 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_SCAN_H
+#define LIBBTCNET_SRC_SCAN_H
+
+#include <stddef.h>
+
+struct evbuffer;
+
+// Returns the offset of the first occurrence of needle in data, or len if
+// there is none. Uses AVX2 or SSE2 where the CPU has them, checking a vector's
+// worth of positions at a time for the needle's first and last bytes, and
+// comparing the rest only where both match.
+size_t find_bytes(const unsigned char* data, size_t len, const unsigned char* needle, size_t needle_len);
+
+// The same, over the chains of input from offset from onwards, including
+// occurrences that span chains. Returns the buffer's length if there is none.
+size_t find_bytes(evbuffer* input, size_t from, const unsigned char* needle, size_t needle_len);
+
+// The implementations find_bytes chooses between.
+enum find_impl {
+    FIND_SCALAR,
+    FIND_SSE2,
+    FIND_AVX2
+};
+
+// Make both find_bytes use impl from now on, rather than the fastest the CPU
+// has. Returns false, changing nothing, if the CPU can't run it. Only for
+// testing the implementations against each other; not threadsafe.
+bool use_find_impl(find_impl impl);
+
+#endif // LIBBTCNET_SRC_SCAN_H
@@ -0,0 +1,193 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sendqueue.h"
+#include "connectionbase.h"
+#include "messagestorage.h"
+
+#include <event2/buffer.h>
+
+#include <assert.h>
+#include <new>
+#include <string.h>
+
+// Small writes are copied into the output buffer's chains. Larger ones are
+// referenced in place and freed once written.
+static constexpr size_t g_max_copy_size = 4096;
+
+static unsigned char* node_data(CSendNode* node)
+{
+    return reinterpret_cast<unsigned char*>(node + 1);
+}
+
+CSendQueue::CSendQueue(const event_type<event_base>& base, ConnectionBase& conn, ConnID id)
+    : m_id(id), m_head(&m_stub), m_scheduled(false), m_conn(&conn), m_tail(&m_stub), m_event(base, -1, 0, std::bind(&CSendQueue::run, this))
+{
+    m_stub.next.store(nullptr, std::memory_order_relaxed);
+    m_stub.payload = nullptr;
+    m_stub.size = 0;
+}
+
+CSendQueue::~CSendQueue()
+{
+    m_event.free();
+    while (CSendNode* node = pop())
+        free_node(node);
+}
+
+ConnID CSendQueue::GetID() const
+{
+    return m_id;
+}
+
+CSendNode* CSendQueue::alloc_node(size_t size)
+{
+    void* mem = ::operator new(sizeof(CSendNode) + size);
+    CSendNode* node = new (mem) CSendNode;
+    node->next.store(nullptr, std::memory_order_relaxed);
+    node->payload = nullptr;
+    node->size = size;
+    return node;
+}
+
+void CSendQueue::free_node(CSendNode* node)
+{
+    if (node->payload != nullptr)
+        node->payload->Release();
+    node->~CSendNode();
+    ::operator delete(node);
+}
+
+void CSendQueue::free_node_cb(const void* /*unused*/, size_t /*unused*/, void* ctx)
+{
+    assert(ctx != nullptr);
+    free_node(static_cast<CSendNode*>(ctx));
+}
+
+void CSendQueue::push(const unsigned char* data, size_t size)
+{
+    if (size == 0)
+        return;
+    CSendNode* node = alloc_node(size);
+    memcpy(node_data(node), data, size);
+    enqueue(node);
+}
+
+void CSendQueue::push(const CBufferSpan* bufs, size_t count)
+{
+    // One node for the whole batch, so that it stays contiguous with respect
+    // to other threads' sends.
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i)
+        size += bufs[i].size;
+    if (size == 0)
+        return;
+    CSendNode* node = alloc_node(size);
+    unsigned char* dest = node_data(node);
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(dest, bufs[i].data, bufs[i].size);
+        dest += bufs[i].size;
+    }
+    enqueue(node);
+}
+
+void CSendQueue::push(const CSharedPayload& payload)
+{
+    CPayloadStorage* storage = payload.m_storage;
+    if (storage == nullptr || storage->m_data.empty())
+        return;
+    CSendNode* node = alloc_node(0);
+    storage->AddRef();
+    node->payload = storage;
+    node->size = storage->m_data.size();
+    enqueue(node);
+}
+
+void CSendQueue::link(CSendNode* node)
+{
+    node->next.store(nullptr, std::memory_order_relaxed);
+    CSendNode* prev = m_head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+void CSendQueue::enqueue(CSendNode* node)
+{
+    link(node);
+    // Only wake the event thread when the queue goes from idle to busy.
+    if (!m_scheduled.exchange(true, std::memory_order_acq_rel))
+        m_event.active();
+}
+
+// Returns nullptr when empty. It also returns nullptr if a push is only half
+// done, but that push will schedule another run once it has finished.
+CSendNode* CSendQueue::pop()
+{
+    CSendNode* tail = m_tail;
+    CSendNode* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &m_stub) {
+        if (next == nullptr)
+            return nullptr;
+        m_tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr) {
+        m_tail = next;
+        return tail;
+    }
+    if (tail != m_head.load(std::memory_order_acquire))
+        return nullptr;
+    link(&m_stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+        m_tail = next;
+        return tail;
+    }
+    return nullptr;
+}
+
+void CSendQueue::flush(evbuffer* output)
+{
+    while (CSendNode* node = pop()) {
+        int ret;
+        if (node->payload != nullptr) {
+            // Hand the node's reference over to the output buffer.
+            CPayloadStorage* storage = node->payload;
+            node->payload = nullptr;
+            ret = evbuffer_add_reference(output, storage->m_data.data(), storage->m_data.size(), CPayloadStorage::release_cb, storage);
+            if (ret != 0)
+                storage->Release();
+            free_node(node);
+        } else if (node->size <= g_max_copy_size) {
+            ret = evbuffer_add(output, node_data(node), node->size);
+            free_node(node);
+        } else {
+            ret = evbuffer_add_reference(output, node_data(node), node->size, free_node_cb, node);
+            if (ret != 0)
+                free_node(node);
+        }
+        (void)ret;
+    }
+}
+
+void CSendQueue::detach()
+{
+    m_conn.store(nullptr, std::memory_order_release);
+    // Waits for a run in progress on another thread.
+    m_event.del();
+}
+
+void CSendQueue::run()
+{
+    // Reset before draining. A push that finds it still set is guaranteed to
+    // be visible below.
+    m_scheduled.exchange(false, std::memory_order_acq_rel);
+    ConnectionBase* conn = m_conn.load(std::memory_order_acquire);
+    if (conn != nullptr) {
+        conn->FlushSendQueue(*this);
+    } else {
+        while (CSendNode* node = pop())
+            free_node(node);
+    }
+}
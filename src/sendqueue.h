@@ -0,0 +1,75 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_SENDQUEUE_H
+#define LIBBTCNET_SRC_SENDQUEUE_H
+
+#include "event.h"
+#include "eventtypes.h"
+#include "libbtcnet/handler.h"
+#include "libbtcnet/netmessage.h"
+
+#include <atomic>
+#include <stddef.h>
+
+struct evbuffer;
+class CPayloadStorage;
+class ConnectionBase;
+
+struct CSendNode {
+    std::atomic<CSendNode*> next;
+    // Either a shared payload, or size bytes stored right after the node.
+    CPayloadStorage* payload;
+    size_t size;
+};
+
+// A connection's outgoing data, queued by any number of threads without
+// locks (an intrusive MPSC queue after Dmitry Vyukov's design) and moved
+// into the output buffer from the connection's event thread.
+//
+// Queues are looked up and pushed to from within a CEpochGuard, and retired
+// through the handler's CEpochManager once detached from their connection.
+class CSendQueue
+{
+public:
+    CSendQueue(const event_type<event_base>& base, ConnectionBase& conn, ConnID id);
+    ~CSendQueue();
+
+    ConnID GetID() const;
+
+    // Any thread.
+    void push(const unsigned char* data, size_t size);
+    void push(const CBufferSpan* bufs, size_t count);
+    void push(const CSharedPayload& payload);
+
+    // Event thread only. Move everything queued so far into output.
+    void flush(evbuffer* output);
+
+    // Stop delivering to the connection. Anything queued afterwards is
+    // dropped.
+    void detach();
+
+private:
+    static CSendNode* alloc_node(size_t size);
+    static void free_node(CSendNode* node);
+    static void free_node_cb(const void* /*unused*/, size_t /*unused*/, void* ctx);
+
+    void enqueue(CSendNode* node);
+    void link(CSendNode* node);
+    CSendNode* pop();
+    void run();
+
+    const ConnID m_id;
+    std::atomic<CSendNode*> m_head;
+    std::atomic<bool> m_scheduled;
+    std::atomic<ConnectionBase*> m_conn;
+    CSendNode* m_tail;
+    CSendNode m_stub;
+    CEvent m_event;
+
+    CSendQueue(const CSendQueue&) = delete;
+    CSendQueue& operator=(const CSendQueue&) = delete;
+};
+
+#endif // LIBBTCNET_SRC_SENDQUEUE_H
@@ -0,0 +1,133 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "shard.h"
+#include "logger.h"
+#include "threads.h"
+
+#include <event2/event.h>
+
+#include <assert.h>
+
+#ifndef NO_THREADS
+#include <condition_variable>
+#include <mutex>
+#endif
+
+CShard::CShard() : m_connections(0)
+{
+}
+
+CShard::~CShard()
+{
+    Stop();
+    m_uring.stop();
+    m_timers.stop();
+    m_tasks.free();
+    m_stop_event.free();
+    m_event_base.free();
+}
+
+bool CShard::Start(const event_type<event_config>& cfg, bool use_uring, int bev_opts)
+{
+#ifdef NO_THREADS
+    (void)cfg;
+    (void)use_uring;
+    (void)bev_opts;
+    return false;
+#else
+    assert(!m_event_base);
+    m_event_base = event_base_new_with_config(cfg);
+    if (!m_event_base)
+        return false;
+    int result = enable_threads_for_handler(m_event_base);
+    assert(result == 0);
+    (void)result;
+    event_base_priority_init(m_event_base, 3);
+    m_timers.start(m_event_base, true);
+    if (use_uring && !m_uring.start(m_event_base, bev_opts))
+        DEBUG_PRINT(LOGWARN, "shard falling back to bufferevents");
+    m_tasks.reset(m_event_base);
+
+    // The loop is stopped from inside an event so that a Stop() racing with
+    // the thread's startup can't be missed.
+    m_stop_event.reset(m_event_base, -1, 0, std::bind(&CShard::StopInt, this));
+    m_thread = std::thread(&CShard::Run, this);
+    return true;
+#endif
+}
+
+void CShard::Stop()
+{
+#ifndef NO_THREADS
+    if (m_thread.joinable()) {
+        m_stop_event.active();
+        m_thread.join();
+    }
+#endif
+}
+
+const event_type<event_base>& CShard::GetEventBase() const
+{
+    return m_event_base;
+}
+
+CTimerWheel& CShard::GetTimers()
+{
+    return m_timers;
+}
+
+CUringEngine* CShard::GetUring()
+{
+    return m_uring.running() ? &m_uring : nullptr;
+}
+
+void CShard::Call(std::function<void()>&& func)
+{
+#ifndef NO_THREADS
+    if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id()) {
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool done = false;
+        m_tasks.post([&]() {
+            func();
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+            cond.notify_one();
+        });
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&]() { return done; });
+        return;
+    }
+#endif
+    func();
+}
+
+size_t CShard::GetConnectionCount() const
+{
+    return m_connections;
+}
+
+void CShard::AddConnection()
+{
+    m_connections++;
+}
+
+void CShard::RemoveConnection()
+{
+    assert(m_connections > 0);
+    m_connections--;
+}
+
+void CShard::Run()
+{
+    DEBUG_PRINT(LOGINFO, "shard started");
+    event_base_loop(m_event_base, EVLOOP_NO_EXIT_ON_EMPTY);
+    DEBUG_PRINT(LOGINFO, "shard stopped");
+}
+
+void CShard::StopInt()
+{
+    event_base_loopbreak(m_event_base);
+}
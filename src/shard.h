@@ -0,0 +1,71 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_SHARD_H
+#define LIBBTCNET_SRC_SHARD_H
+
+#include "event.h"
+#include "eventtypes.h"
+#include "taskqueue.h"
+#include "timerwheel.h"
+#include "uring.h"
+
+#include <functional>
+#include <stddef.h>
+
+#ifndef NO_THREADS
+#include <thread>
+#endif
+
+struct event_base;
+struct event_config;
+
+// A worker thread running its own event base. Established connections are
+// moved onto a shard so that their socket I/O and framing happen there rather
+// than on the thread calling PumpEvents.
+class CShard
+{
+public:
+    CShard();
+    ~CShard();
+
+    // The shard's base is created from cfg, as the handler's is. With
+    // use_uring, the shard's connections do their socket I/O through an
+    // io_uring where possible. bev_opts are those of its bufferevents.
+    bool Start(const event_type<event_config>& cfg, bool use_uring, int bev_opts);
+    void Stop();
+
+    const event_type<event_base>& GetEventBase() const;
+    CTimerWheel& GetTimers();
+    // Null unless io_uring is in use.
+    CUringEngine* GetUring();
+
+    // Run func on the shard's thread and wait for it to return. It runs on the
+    // calling thread instead once the shard has stopped.
+    void Call(std::function<void()>&& func);
+
+    // Only used from the main thread, to balance new connections.
+    size_t GetConnectionCount() const;
+    void AddConnection();
+    void RemoveConnection();
+
+private:
+    void Run();
+    void StopInt();
+
+    event_type<event_base> m_event_base;
+    CTimerWheel m_timers;
+    CUringEngine m_uring;
+    CTaskQueue m_tasks;
+    CEvent m_stop_event;
+    size_t m_connections;
+#ifndef NO_THREADS
+    std::thread m_thread;
+#endif
+
+    CShard(const CShard&) = delete;
+    CShard& operator=(const CShard&) = delete;
+};
+
+#endif // LIBBTCNET_SRC_SHARD_H
@@ -0,0 +1,40 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "slotmap.h"
+
+// Keeps ids non-negative. A slot whose generation reaches this is retired.
+static constexpr uint32_t g_max_generation = 0x7fffffff;
+static constexpr uint32_t g_retired = g_max_generation + 1;
+
+ConnID CConnIDAllocator::alloc()
+{
+    uint32_t index;
+    if (!m_free.empty()) {
+        index = m_free.back();
+        m_free.pop_back();
+    } else {
+        assert(m_generations.size() <= 0xffffffff);
+        index = static_cast<uint32_t>(m_generations.size());
+        m_generations.push_back(0);
+    }
+    return static_cast<ConnID>(static_cast<uint64_t>(m_generations[index]) << 32 | index);
+}
+
+void CConnIDAllocator::release(ConnID id)
+{
+    assert(id >= 0);
+    const size_t index = slot(id);
+    if (index >= m_generations.size())
+        return;
+    uint32_t& generation = m_generations[index];
+    if (generation != static_cast<uint32_t>(static_cast<uint64_t>(id) >> 32))
+        return;
+    if (generation == g_max_generation) {
+        generation = g_retired;
+        return;
+    }
+    generation++;
+    m_free.push_back(static_cast<uint32_t>(index));
+}
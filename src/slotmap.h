@@ -0,0 +1,224 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_SLOTMAP_H
+#define LIBBTCNET_SRC_SLOTMAP_H
+
+#include "libbtcnet/handler.h"
+
+#include <assert.h>
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// Hands out ConnIDs of the form (generation << 32 | slot). Released slots are
+// reused, but their generation is bumped first so that a stale id never
+// matches whatever takes the slot next. Slots whose generation is exhausted
+// are retired rather than wrapped.
+class CConnIDAllocator
+{
+public:
+    ConnID alloc();
+
+    // Releasing an id that is not live is a no-op.
+    void release(ConnID id);
+
+    static size_t slot(ConnID id)
+    {
+        return static_cast<size_t>(id & 0xffffffff);
+    }
+
+private:
+    std::vector<uint32_t> m_generations;
+    std::vector<uint32_t> m_free;
+};
+
+// A table of owned objects keyed by ConnID. Lookups index directly by the
+// id's slot and compare the stored id, so an entry inserted under a stale
+// id's slot is never returned for it.
+template <typename T>
+class CSlotMap
+{
+public:
+    CSlotMap() : m_size(0) {}
+
+    T* find(ConnID id) const
+    {
+        const size_t index = CConnIDAllocator::slot(id);
+        if (id < 0 || index >= m_slots.size())
+            return nullptr;
+        const Slot& entry = m_slots[index];
+        return entry.id == id ? entry.value.get() : nullptr;
+    }
+
+    T* insert(ConnID id, std::unique_ptr<T>&& value)
+    {
+        assert(id >= 0 && value);
+        const size_t index = CConnIDAllocator::slot(id);
+        if (index >= m_slots.size())
+            m_slots.resize(index + 1);
+        Slot& entry = m_slots[index];
+        assert(!entry.value);
+        entry.id = id;
+        entry.value = std::move(value);
+        m_size++;
+        return entry.value.get();
+    }
+
+    // Remove an entry, returning it. Returns nullptr if the id is not present.
+    std::unique_ptr<T> take(ConnID id)
+    {
+        std::unique_ptr<T> ret;
+        if (find(id) != nullptr) {
+            Slot& entry = m_slots[CConnIDAllocator::slot(id)];
+            ret = std::move(entry.value);
+            entry.id = -1;
+            m_size--;
+        }
+        return ret;
+    }
+
+    bool erase(ConnID id)
+    {
+        return take(id) != nullptr;
+    }
+
+    // Remove every entry, passing each to func(ConnID, std::unique_ptr<T>&&).
+    // func may safely insert into the map.
+    template <typename Callable>
+    void consume(Callable&& func)
+    {
+        for (size_t i = 0; i < m_slots.size() && m_size != 0; ++i) {
+            if (!m_slots[i].value)
+                continue;
+            ConnID id = m_slots[i].id;
+            std::unique_ptr<T> value(std::move(m_slots[i].value));
+            m_slots[i].id = -1;
+            m_size--;
+            func(id, std::move(value));
+        }
+    }
+
+    // Call func(ConnID, T&) for every entry.
+    template <typename Callable>
+    void for_each(Callable&& func)
+    {
+        for (size_t i = 0; i < m_slots.size(); ++i) {
+            if (m_slots[i].value)
+                func(m_slots[i].id, *m_slots[i].value);
+        }
+    }
+
+    void swap(CSlotMap& rhs)
+    {
+        m_slots.swap(rhs.m_slots);
+        std::swap(m_size, rhs.m_size);
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+private:
+    struct Slot {
+        Slot() : id(-1) {}
+        ConnID id;
+        std::unique_ptr<T> value;
+    };
+    std::vector<Slot> m_slots;
+    size_t m_size;
+};
+
+// Pointers keyed by ConnID which any thread may look up without locking.
+// Only the owning thread may insert or erase, and readers are responsible for
+// keeping the objects alive (see CEpochManager). Slots are allocated in
+// chunks that never move. T::GetID() is checked so that a reader racing with
+// a slot's reuse never gets the wrong object.
+template <typename T>
+class CAtomicSlotTable
+{
+public:
+    CAtomicSlotTable()
+    {
+        for (auto& chunk : m_chunks)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~CAtomicSlotTable()
+    {
+        for (auto& chunk : m_chunks)
+            delete chunk.load(std::memory_order_relaxed);
+    }
+
+    T* find(ConnID id) const
+    {
+        const size_t index = CConnIDAllocator::slot(id);
+        if (id < 0 || (index >> chunk_bits) >= max_chunks)
+            return nullptr;
+        const Chunk* chunk = m_chunks[index >> chunk_bits].load(std::memory_order_acquire);
+        if (chunk == nullptr)
+            return nullptr;
+        T* value = chunk->slots[index & (chunk_size - 1)].load(std::memory_order_acquire);
+        if (value == nullptr || value->GetID() != id)
+            return nullptr;
+        return value;
+    }
+
+    // Returns false if the id is beyond the table's capacity.
+    bool insert(ConnID id, T* value)
+    {
+        assert(id >= 0 && value != nullptr && value->GetID() == id);
+        const size_t index = CConnIDAllocator::slot(id);
+        if ((index >> chunk_bits) >= max_chunks)
+            return false;
+        std::atomic<Chunk*>& entry = m_chunks[index >> chunk_bits];
+        Chunk* chunk = entry.load(std::memory_order_relaxed);
+        if (chunk == nullptr) {
+            chunk = new Chunk;
+            for (auto& slot : chunk->slots)
+                slot.store(nullptr, std::memory_order_relaxed);
+            entry.store(chunk, std::memory_order_release);
+        }
+        chunk->slots[index & (chunk_size - 1)].store(value, std::memory_order_release);
+        return true;
+    }
+
+    void erase(ConnID id)
+    {
+        const size_t index = CConnIDAllocator::slot(id);
+        if (id < 0 || (index >> chunk_bits) >= max_chunks)
+            return;
+        Chunk* chunk = m_chunks[index >> chunk_bits].load(std::memory_order_relaxed);
+        if (chunk == nullptr)
+            return;
+        std::atomic<T*>& slot = chunk->slots[index & (chunk_size - 1)];
+        T* value = slot.load(std::memory_order_relaxed);
+        if (value != nullptr && value->GetID() == id)
+            slot.store(nullptr, std::memory_order_seq_cst);
+    }
+
+private:
+    static constexpr size_t chunk_bits = 12;
+    static constexpr size_t chunk_size = size_t(1) << chunk_bits;
+    static constexpr size_t max_chunks = 4096;
+
+    struct Chunk {
+        std::atomic<T*> slots[chunk_size];
+    };
+    std::atomic<Chunk*> m_chunks[max_chunks];
+
+    CAtomicSlotTable(const CAtomicSlotTable&) = delete;
+    CAtomicSlotTable& operator=(const CAtomicSlotTable&) = delete;
+};
+
+#endif // LIBBTCNET_SRC_SLOTMAP_H
@@ -0,0 +1,62 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stats.h"
+
+#include <chrono>
+
+CConnectionStats::CConnectionStats()
+    : nBytesRead(0), nBytesWritten(0), nMessagesReceived(0), nMalformedMessages(0), nBytesSkipped(0), nWriteBufferFull(0)
+{
+}
+
+CLatencyStats::CLatencyStats()
+    : nCount(0), nTotal(0), nMax(0)
+{
+}
+
+CHandlerStats::CHandlerStats()
+    : nIncomingAccepted(0), nOutgoingConnected(0), nConnectFailures(0), nDnsFailures(0), nDnsCacheHits(0), nReconnects(0)
+{
+}
+
+uint64_t stats_now_micros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CLatencyCounter::add(uint64_t micros)
+{
+    m_count.add(1);
+    m_total.add(micros);
+    if (micros > m_max.get())
+        m_max.set(micros);
+}
+
+void CLatencyCounter::snapshot(CLatencyStats& stats) const
+{
+    stats.nCount = m_count.get();
+    stats.nTotal = m_total.get();
+    stats.nMax = m_max.get();
+}
+
+void CConnectionCounters::reset()
+{
+    bytes_read.set(0);
+    bytes_written.set(0);
+    messages_received.set(0);
+    malformed_messages.set(0);
+    bytes_skipped.set(0);
+    write_buffer_full.set(0);
+}
+
+void CConnectionCounters::add_to(CConnectionStats& stats) const
+{
+    stats.nBytesRead += bytes_read.get();
+    stats.nBytesWritten += bytes_written.get();
+    stats.nMessagesReceived += messages_received.get();
+    stats.nMalformedMessages += malformed_messages.get();
+    stats.nBytesSkipped += bytes_skipped.get();
+    stats.nWriteBufferFull += write_buffer_full.get();
+}
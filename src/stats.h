@@ -0,0 +1,81 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_STATS_H
+#define LIBBTCNET_SRC_STATS_H
+
+#include "libbtcnet/stats.h"
+
+#include <atomic>
+#include <stdint.h>
+
+// Microseconds from an arbitrary, monotonic starting point.
+uint64_t stats_now_micros();
+
+// A counter which one thread at a time updates and any thread may read.
+// Updating is a relaxed load and store rather than a locked add, so it costs
+// no more than a plain integer. Readers may see a slightly stale value.
+class CStatCounter
+{
+public:
+    CStatCounter() : m_value(0) {}
+
+    void add(uint64_t value)
+    {
+        m_value.store(m_value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    void set(uint64_t value)
+    {
+        m_value.store(value, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const
+    {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_value;
+};
+
+class CLatencyCounter
+{
+public:
+    void add(uint64_t micros);
+    void snapshot(CLatencyStats& stats) const;
+
+private:
+    CStatCounter m_count;
+    CStatCounter m_total;
+    CStatCounter m_max;
+};
+
+// Updated from the thread servicing the connection's I/O.
+struct CConnectionCounters {
+    CStatCounter bytes_read;
+    CStatCounter bytes_written;
+    CStatCounter messages_received;
+    CStatCounter malformed_messages;
+    CStatCounter bytes_skipped;
+    CStatCounter write_buffer_full;
+
+    void reset();
+    // Add the current values to stats.
+    void add_to(CConnectionStats& stats) const;
+};
+
+// Updated from the handler's event thread.
+struct CHandlerCounters {
+    CStatCounter incoming_accepted;
+    CStatCounter outgoing_connected;
+    CStatCounter connect_failures;
+    CStatCounter dns_failures;
+    CStatCounter dns_cache_hits;
+    CStatCounter reconnects;
+    CLatencyCounter connect_latency;
+    CLatencyCounter dns_latency;
+};
+
+#endif // LIBBTCNET_SRC_STATS_H
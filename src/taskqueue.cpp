@@ -0,0 +1,49 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "taskqueue.h"
+
+#include <assert.h>
+
+void CTaskQueue::reset(const event_type<event_base>& base)
+{
+    m_event.reset(base, -1, 0, std::bind(&CTaskQueue::run, this));
+}
+
+void CTaskQueue::free()
+{
+    m_event.free();
+    optional_lock(m_mutex, true);
+    m_tasks.clear();
+}
+
+void CTaskQueue::post(std::function<void()>&& func)
+{
+    assert(m_event);
+    bool wake;
+    {
+        optional_lock(m_mutex, true);
+        wake = m_tasks.empty();
+        m_tasks.push_back(std::move(func));
+    }
+    // Only the first post into an empty queue needs to wake the event loop.
+    if (wake)
+        m_event.active();
+}
+
+void CTaskQueue::run()
+{
+    std::vector<std::function<void()> > tasks;
+    {
+        optional_lock(m_mutex, true);
+        tasks.swap(m_tasks);
+    }
+    for (auto& task : tasks)
+        task();
+}
+
+CTaskQueue::operator bool() const
+{
+    return m_event.operator bool();
+}
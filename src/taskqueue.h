@@ -0,0 +1,39 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_TASKQUEUE_H
+#define LIBBTCNET_SRC_TASKQUEUE_H
+
+#include "event.h"
+#include "eventtypes.h"
+#include "threads.h"
+
+#include <functional>
+#include <vector>
+
+struct event_base;
+
+// Runs functions on an event base's thread. Functions may be posted from any
+// thread, and run in the order they were posted.
+class CTaskQueue
+{
+public:
+    void reset(const event_type<event_base>& base);
+    void free();
+    void post(std::function<void()>&& func);
+
+    // Run everything that has been posted so far on the calling thread.
+    void run();
+
+    explicit operator bool() const;
+
+private:
+    std::vector<std::function<void()> > m_tasks;
+    CEvent m_event;
+#ifndef NO_THREADS
+    std::mutex m_mutex;
+#endif
+};
+
+#endif // LIBBTCNET_SRC_TASKQUEUE_H
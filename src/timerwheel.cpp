@@ -0,0 +1,246 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "timerwheel.h"
+
+#include <event2/event.h>
+
+#include <assert.h>
+#include <chrono>
+#include <time.h>
+
+namespace
+{
+#ifndef NO_THREADS
+typedef std::unique_lock<std::mutex> wheel_lock;
+
+wheel_lock lock_if(std::mutex& mutex, bool enabled)
+{
+    return enabled ? wheel_lock(mutex) : wheel_lock(mutex, std::defer_lock);
+}
+#endif
+
+// The wheel only needs to know which tick it is, so where there is a coarse
+// clock, which is much cheaper to read, it uses that. The cost is firing up to
+// the clock's resolution early.
+uint64_t wheel_now_micros()
+{
+#if defined(CLOCK_MONOTONIC_COARSE)
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#else
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint64_t wheel_clock_resolution_micros()
+{
+#if defined(CLOCK_MONOTONIC_COARSE)
+    timespec ts;
+    if (clock_getres(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000 + (ts.tv_nsec + 999) / 1000;
+#endif
+    return 0;
+}
+
+void list_init(CTimerLink& head)
+{
+    head.prev = &head;
+    head.next = &head;
+}
+} // namespace
+
+CTimer::CTimer() : m_wheel(nullptr), m_deadline(0)
+{
+    prev = nullptr;
+    next = nullptr;
+}
+
+CTimer::~CTimer()
+{
+    del();
+}
+
+void CTimer::reset(CTimerWheel& wheel, std::function<void()>&& func)
+{
+    assert(next == nullptr);
+    m_wheel = &wheel;
+    m_func = std::move(func);
+}
+
+void CTimer::add(uint64_t millis)
+{
+    assert(m_wheel != nullptr);
+    m_wheel->add(*this, millis);
+}
+
+void CTimer::del()
+{
+    if (m_wheel != nullptr)
+        m_wheel->del(*this);
+}
+
+CTimer::operator bool() const
+{
+    return m_wheel != nullptr;
+}
+
+CTimerWheel::CTimerWheel()
+    : m_start(0), m_current(0), m_slack(0), m_pending(0), m_armed(false), m_threadsafe(false), m_running(nullptr)
+{
+    for (size_t i = 0; i < slot_count; i++)
+        list_init(m_slots[i]);
+}
+
+CTimerWheel::~CTimerWheel()
+{
+    stop();
+}
+
+void CTimerWheel::start(const event_type<event_base>& base, bool threadsafe)
+{
+    assert(m_pending == 0);
+    m_threadsafe = threadsafe;
+    m_start = wheel_now_micros();
+    m_slack = wheel_clock_resolution_micros();
+    m_current = 0;
+    m_armed = false;
+    m_tick_event.reset(base, -1, 0, std::bind(&CTimerWheel::tick, this));
+}
+
+void CTimerWheel::stop()
+{
+    m_tick_event.free();
+    m_armed = false;
+    for (size_t i = 0; i < slot_count; i++) {
+        CTimerLink& head = m_slots[i];
+        while (head.next != &head)
+            unlink(*static_cast<CTimer*>(head.next));
+    }
+}
+
+uint64_t CTimerWheel::now_ticks() const
+{
+    return (wheel_now_micros() - m_start) / (tick_millis * 1000);
+}
+
+void CTimerWheel::link(CTimer& timer)
+{
+    CTimerLink& head = m_slots[timer.m_deadline % slot_count];
+    timer.prev = head.prev;
+    timer.next = &head;
+    head.prev->next = &timer;
+    head.prev = &timer;
+    m_pending++;
+}
+
+void CTimerWheel::unlink(CTimer& timer)
+{
+    timer.prev->next = timer.next;
+    timer.next->prev = timer.prev;
+    timer.prev = nullptr;
+    timer.next = nullptr;
+    m_pending--;
+}
+
+// Keep the tick event running for as long as anything is pending, waking at
+// the start of each tick. Waking a little after allows for the clock lagging.
+void CTimerWheel::arm()
+{
+    if (m_armed || m_pending == 0 || !m_tick_event)
+        return;
+    const uint64_t tick_micros = tick_millis * 1000;
+    const uint64_t wait = tick_micros - (wheel_now_micros() - m_start) % tick_micros + m_slack;
+    timeval timeout = {static_cast<long>(wait / 1000000), static_cast<long>(wait % 1000000)};
+    m_tick_event.add(&timeout);
+    m_armed = true;
+}
+
+void CTimerWheel::add(CTimer& timer, uint64_t millis)
+{
+#ifndef NO_THREADS
+    wheel_lock lock(lock_if(m_mutex, m_threadsafe));
+#endif
+    if (timer.next != nullptr)
+        unlink(timer);
+    // Round up, so that a timer doesn't fire early. Anything due in a slot
+    // that has already been run goes in the next one.
+    const uint64_t tick_micros = tick_millis * 1000;
+    uint64_t deadline = (wheel_now_micros() - m_start + millis * 1000 + tick_micros - 1) / tick_micros;
+    timer.m_deadline = deadline > m_current ? deadline : m_current + 1;
+    link(timer);
+    arm();
+}
+
+void CTimerWheel::del(CTimer& timer)
+{
+#ifndef NO_THREADS
+    wheel_lock lock(lock_if(m_mutex, m_threadsafe));
+#endif
+    if (timer.next != nullptr)
+        unlink(timer);
+#ifndef NO_THREADS
+    if (m_threadsafe) {
+        while (m_running == &timer && m_running_thread != std::this_thread::get_id())
+            m_running_cond.wait(lock);
+    }
+#endif
+}
+
+void CTimerWheel::tick()
+{
+#ifndef NO_THREADS
+    wheel_lock lock(lock_if(m_mutex, m_threadsafe));
+#endif
+    m_armed = false;
+    const uint64_t now = now_ticks();
+    // After an idle spell, one turn of the ring visits every slot.
+    if (now - m_current > slot_count)
+        m_current = now - slot_count;
+
+    // Gather the slots that have come due. Timers may be added or deleted
+    // while the lock is dropped for a callback, which is safe because removal
+    // doesn't need to know which list a timer is on.
+    CTimerLink due;
+    list_init(due);
+    while (m_current < now) {
+        m_current++;
+        CTimerLink& head = m_slots[m_current % slot_count];
+        if (head.next == &head)
+            continue;
+        head.next->prev = due.prev;
+        due.prev->next = head.next;
+        head.prev->next = &due;
+        due.prev = head.prev;
+        list_init(head);
+    }
+
+    while (due.next != &due) {
+        CTimer* timer = static_cast<CTimer*>(due.next);
+        unlink(*timer);
+        if (timer->m_deadline > now) {
+            // Due on a later turn of the ring.
+            link(*timer);
+            continue;
+        }
+        m_running = timer;
+#ifndef NO_THREADS
+        m_running_thread = std::this_thread::get_id();
+        if (m_threadsafe)
+            lock.unlock();
+#endif
+        timer->m_func();
+#ifndef NO_THREADS
+        if (m_threadsafe)
+            lock.lock();
+#endif
+        m_running = nullptr;
+#ifndef NO_THREADS
+        if (m_threadsafe)
+            m_running_cond.notify_all();
+#endif
+    }
+    arm();
+}
@@ -0,0 +1,110 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_TIMERWHEEL_H
+#define LIBBTCNET_SRC_TIMERWHEEL_H
+
+#include "event.h"
+#include "eventtypes.h"
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef NO_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+class CTimerWheel;
+struct event_base;
+
+struct CTimerLink {
+    CTimerLink* prev;
+    CTimerLink* next;
+};
+
+// A timeout run by a CTimerWheel rather than by an event of its own. Like
+// CEvent, but adding or re-adding it is O(1) no matter how many others are
+// pending, and it fires up to one tick late.
+class CTimer : private CTimerLink
+{
+public:
+    CTimer();
+    ~CTimer();
+
+    // Must not be pending.
+    void reset(CTimerWheel& wheel, std::function<void()>&& func);
+    // (Re)schedule to fire once, millis from now.
+    void add(uint64_t millis);
+    void del();
+    operator bool() const;
+
+private:
+    friend class CTimerWheel;
+
+    std::function<void()> m_func;
+    CTimerWheel* m_wheel;
+    // The tick at which this is due.
+    uint64_t m_deadline;
+
+    CTimer(const CTimer&) = delete;
+    CTimer& operator=(const CTimer&) = delete;
+};
+
+// A hashed timing wheel serving every CTimer on one event base. Timers are
+// kept in a ring of slots by due tick, and a single libevent timer advances
+// through the ring while any are pending. Those due further out than one turn
+// of the ring wait in their slot until a later turn.
+//
+// When threadsafe, timers may be added and deleted from any thread. As with
+// event_del, deleting a timer whose callback is running on another thread
+// waits for the callback to finish.
+class CTimerWheel
+{
+public:
+    CTimerWheel();
+    ~CTimerWheel();
+
+    void start(const event_type<event_base>& base, bool threadsafe);
+    // Forget anything still pending. The wheel must outlive its timers.
+    void stop();
+
+private:
+    friend class CTimer;
+
+    static constexpr uint64_t tick_millis = 100;
+    static constexpr size_t slot_count = 1024;
+
+    void add(CTimer& timer, uint64_t millis);
+    void del(CTimer& timer);
+    void link(CTimer& timer);
+    void unlink(CTimer& timer);
+    void arm();
+    void tick();
+    uint64_t now_ticks() const;
+
+    CTimerLink m_slots[slot_count];
+    uint64_t m_start;
+    // Every slot up to and including this tick has been run.
+    uint64_t m_current;
+    // How far behind the clock may be.
+    uint64_t m_slack;
+    size_t m_pending;
+    bool m_armed;
+    bool m_threadsafe;
+    CTimer* m_running;
+    CEvent m_tick_event;
+#ifndef NO_THREADS
+    std::mutex m_mutex;
+    std::condition_variable m_running_cond;
+    std::thread::id m_running_thread;
+#endif
+
+    CTimerWheel(const CTimerWheel&) = delete;
+    CTimerWheel& operator=(const CTimerWheel&) = delete;
+};
+
+#endif // LIBBTCNET_SRC_TIMERWHEEL_H
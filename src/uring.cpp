@@ -0,0 +1,868 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "uring.h"
+#include "logger.h"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <assert.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Provided buffer rings and multishot receives arrived in Linux 5.19, along
+// with the cancel flags used below. Only the latter two are macros.
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ASYNC_CANCEL_ANY)
+#define USE_IO_URING
+#endif
+
+#ifdef USE_IO_URING
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+// Each submission's user_data is its owner's address, with the operation in the
+// low bits. A cancellation's completion has no owner.
+enum UringOp {
+    OP_CANCEL = 0,
+    OP_RECV = 1,
+    OP_SEND = 2,
+    OP_ACCEPT = 3
+};
+const uint64_t op_mask = 7;
+
+const unsigned sq_entries = 256;
+const unsigned cq_entries = 4096;
+const unsigned buf_count = 128;
+const size_t buf_size = 16384;
+const unsigned short buf_group = 0;
+
+// Received data the connection hasn't taken yet waits in the engine's end of
+// the pair. Past this, reading from the socket stops until it drains.
+const size_t recv_limit = 256 * 1024;
+// How much the engine takes from the connection's output at a time. The rest
+// stays there, where the send buffer limits can see it.
+const size_t send_limit = 256 * 1024;
+const int max_iov = 64;
+
+int uring_setup(unsigned entries, io_uring_params* params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+uint64_t make_user_data(void* owner, UringOp op)
+{
+    return reinterpret_cast<uintptr_t>(owner) | op;
+}
+} // namespace
+
+// A connected socket, and the engine's end of the bufferevent pair standing in
+// for it. Lives on until the connection has let go of its end and the last of
+// its operations has completed.
+class CUringSocket
+{
+public:
+    CUringSocket(CUringEngine& engine, evutil_socket_t fd, bufferevent* partner, int linger_seconds);
+    ~CUringSocket();
+
+    void recv();
+    void send();
+    void close();
+    void shut_down();
+    void finish_reading();
+    void fail_sending();
+    void on_recv(int res, unsigned flags, bool last);
+    void on_send(int res);
+    bool done() const;
+
+    static void read_cb(bufferevent* /*unused*/, void* ctx);
+    static void write_cb(bufferevent* /*unused*/, void* ctx);
+
+    CUringEngine& m_engine;
+    const evutil_socket_t m_fd;
+    bufferevent* const m_partner;
+    // Taken from the connection, and being sent.
+    event_type<evbuffer> m_sending;
+    CEvent m_linger_event;
+    const int m_linger;
+    int m_ops;
+    bool m_receiving;
+    // Reading stopped until the connection takes what is waiting.
+    bool m_paused;
+    bool m_sending_busy;
+    // The connection has been told that the socket is finished.
+    bool m_eof;
+    bool m_failed;
+    // The connection has let go of its end.
+    bool m_closing;
+    bool m_shut;
+    msghdr m_msg;
+    iovec m_iov[max_iov];
+};
+
+class CUringAcceptor
+{
+public:
+    CUringAcceptor(CUringEngine& engine, evutil_socket_t fd, CUringEngine::AcceptFunc&& func);
+    ~CUringAcceptor();
+
+    void accept();
+    void on_accept(int res, bool last);
+    bool done() const;
+
+    CUringEngine& m_engine;
+    const evutil_socket_t m_fd;
+    CUringEngine::AcceptFunc m_func;
+    int m_ops;
+    bool m_accepting;
+    bool m_paused;
+    bool m_closing;
+};
+
+CUringSocket::CUringSocket(CUringEngine& engine, evutil_socket_t fd, bufferevent* partner, int linger_seconds)
+    : m_engine(engine), m_fd(fd), m_partner(partner), m_sending(evbuffer_new()), m_linger(linger_seconds), m_ops(0), m_receiving(false), m_paused(false), m_sending_busy(false), m_eof(false), m_failed(false), m_closing(false), m_shut(false)
+{
+    memset(&m_msg, 0, sizeof(m_msg));
+    m_linger_event.reset(*engine.m_base, -1, 0, std::bind(&CUringSocket::shut_down, this));
+    // The read callback hears about data from the connection. The write
+    // callback is only wanted while paused, to hear about it catching up.
+    bufferevent_setcb(m_partner, read_cb, nullptr, nullptr, this);
+    bufferevent_setwatermark(m_partner, EV_READ, 0, send_limit);
+    bufferevent_setwatermark(m_partner, EV_WRITE, recv_limit / 2, 0);
+    bufferevent_enable(m_partner, EV_READ | EV_WRITE);
+}
+
+CUringSocket::~CUringSocket()
+{
+    m_linger_event.free();
+    bufferevent_free(m_partner);
+    ::close(m_fd);
+}
+
+void CUringSocket::recv()
+{
+    io_uring_sqe* sqe = m_engine.get_sqe();
+    if (sqe == nullptr) {
+        finish_reading();
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = m_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buf_group;
+    sqe->user_data = make_user_data(this, OP_RECV);
+    m_receiving = true;
+    m_ops++;
+}
+
+// Send whatever is waiting, once the last send has completed. Everything the
+// connection has handed over so far goes out in one sendmsg, as far as the
+// socket will take it.
+void CUringSocket::send()
+{
+    if (m_sending_busy || m_engine.m_stopping)
+        return;
+    if (!m_failed) {
+        if (evbuffer_get_length(m_sending) == 0) {
+            bufferevent_lock(m_partner);
+            evbuffer_add_buffer(m_sending, bufferevent_get_input(m_partner));
+            bufferevent_unlock(m_partner);
+        }
+        evbuffer_iovec vecs[max_iov];
+        int count = evbuffer_peek(m_sending, -1, nullptr, vecs, max_iov);
+        if (count > 0) {
+            if (count > max_iov)
+                count = max_iov;
+            for (int i = 0; i < count; i++) {
+                m_iov[i].iov_base = vecs[i].iov_base;
+                m_iov[i].iov_len = vecs[i].iov_len;
+            }
+            m_msg.msg_iov = m_iov;
+            m_msg.msg_iovlen = count;
+            io_uring_sqe* sqe = m_engine.get_sqe();
+            if (sqe != nullptr) {
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = m_fd;
+                sqe->addr = reinterpret_cast<uintptr_t>(&m_msg);
+                sqe->len = 1;
+                sqe->msg_flags = MSG_NOSIGNAL;
+                sqe->user_data = make_user_data(this, OP_SEND);
+                m_sending_busy = true;
+                m_ops++;
+                return;
+            }
+            fail_sending();
+        }
+    }
+    // Nothing left to send.
+    if (m_closing)
+        shut_down();
+}
+
+void CUringSocket::close()
+{
+    if (m_closing)
+        return;
+    m_closing = true;
+    if (m_receiving)
+        m_engine.cancel(make_user_data(this, OP_RECV));
+    if (m_linger > 0) {
+        timeval timeout = {m_linger, 0};
+        m_linger_event.add(&timeout);
+    }
+    send();
+}
+
+// Stop both directions, which also ends anything still in progress.
+void CUringSocket::shut_down()
+{
+    if (m_shut)
+        return;
+    m_shut = true;
+    m_linger_event.del();
+    shutdown(m_fd, SHUT_RDWR);
+}
+
+// Tell the connection that nothing more is coming, as a socket bufferevent
+// would on EOF or an error.
+void CUringSocket::finish_reading()
+{
+    if (m_eof || m_engine.m_stopping)
+        return;
+    m_eof = true;
+    bufferevent_lock(m_partner);
+    bufferevent_flush(m_partner, EV_WRITE, BEV_FINISHED);
+    bufferevent_unlock(m_partner);
+}
+
+// Give up on everything still to be sent, as on a write error.
+void CUringSocket::fail_sending()
+{
+    m_failed = true;
+    evbuffer_drain(m_sending, evbuffer_get_length(m_sending));
+    finish_reading();
+}
+
+void CUringSocket::on_recv(int res, unsigned flags, bool last)
+{
+    if (last) {
+        m_receiving = false;
+        m_ops--;
+    }
+    if (res > 0) {
+        assert((flags & IORING_CQE_F_BUFFER) != 0);
+        const unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        bool pause = false;
+        if (!m_eof && !m_closing && !m_engine.m_stopping) {
+            // Adding to the output moves what fits straight across to the
+            // connection's input.
+            bufferevent_lock(m_partner);
+            evbuffer* output = bufferevent_get_output(m_partner);
+            evbuffer_add(output, m_engine.buffer(bid), res);
+            if (!m_paused && evbuffer_get_length(output) >= recv_limit) {
+                m_paused = pause = true;
+                bufferevent_setcb(m_partner, read_cb, write_cb, nullptr, this);
+            }
+            bufferevent_unlock(m_partner);
+        }
+        m_engine.recycle(bid);
+        if (pause && m_receiving)
+            m_engine.cancel(make_user_data(this, OP_RECV));
+    } else if (res != -ENOBUFS && res != -ECANCELED && res != -EINTR) {
+        finish_reading();
+    }
+    // A multishot receive ends when it runs out of buffers, as well as when
+    // cancelled or finished.
+    if (!m_receiving && !m_paused && !m_eof && !m_closing && !m_engine.m_stopping)
+        recv();
+}
+
+void CUringSocket::on_send(int res)
+{
+    m_sending_busy = false;
+    m_ops--;
+    if (res >= 0) {
+        evbuffer_drain(m_sending, res);
+    } else if (res != -EINTR && res != -EAGAIN) {
+        fail_sending();
+    }
+    send();
+}
+
+bool CUringSocket::done() const
+{
+    return m_closing && m_shut && m_ops == 0;
+}
+
+void CUringSocket::read_cb(bufferevent* /*unused*/, void* ctx)
+{
+    static_cast<CUringSocket*>(ctx)->send();
+}
+
+void CUringSocket::write_cb(bufferevent* /*unused*/, void* ctx)
+{
+    CUringSocket* sock = static_cast<CUringSocket*>(ctx);
+    if (!sock->m_paused)
+        return;
+    bufferevent_lock(sock->m_partner);
+    const bool resume = evbuffer_get_length(bufferevent_get_output(sock->m_partner)) < recv_limit;
+    if (resume) {
+        sock->m_paused = false;
+        bufferevent_setcb(sock->m_partner, read_cb, nullptr, nullptr, sock);
+    }
+    bufferevent_unlock(sock->m_partner);
+    if (resume && !sock->m_receiving && !sock->m_eof && !sock->m_closing)
+        sock->recv();
+}
+
+CUringAcceptor::CUringAcceptor(CUringEngine& engine, evutil_socket_t fd, CUringEngine::AcceptFunc&& func)
+    : m_engine(engine), m_fd(fd), m_func(std::move(func)), m_ops(0), m_accepting(false), m_paused(false), m_closing(false)
+{
+}
+
+CUringAcceptor::~CUringAcceptor()
+{
+    ::close(m_fd);
+}
+
+void CUringAcceptor::accept()
+{
+    io_uring_sqe* sqe = m_engine.get_sqe();
+    if (sqe == nullptr) {
+        DEBUG_PRINT(LOGWARN, "couldn't queue an accept, submission queue full");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(this, OP_ACCEPT);
+    m_accepting = true;
+    m_ops++;
+}
+
+void CUringAcceptor::on_accept(int res, bool last)
+{
+    if (res >= 0) {
+        sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        sockaddr* paddr = reinterpret_cast<sockaddr*>(&addr);
+        if (m_closing || m_engine.m_stopping || getpeername(res, paddr, &addrlen) != 0)
+            ::close(res);
+        else
+            m_func(res, paddr, static_cast<int>(addrlen));
+    } else if (res != -ECANCELED) {
+        DEBUG_PRINT(LOGWARN, "accept failed, error:", -res);
+    }
+    if (last) {
+        m_accepting = false;
+        m_ops--;
+        if (!m_paused && !m_closing && !m_engine.m_stopping)
+            accept();
+    }
+}
+
+bool CUringAcceptor::done() const
+{
+    return m_closing && m_ops == 0;
+}
+
+CUringEngine::CUringEngine()
+    : m_ring_fd(-1), m_bev_opts(0), m_base(nullptr), m_sq_ptr(MAP_FAILED), m_sq_size(0), m_cq_ptr(MAP_FAILED), m_cq_size(0), m_sqes(nullptr), m_sqes_size(0), m_sq_head(nullptr), m_sq_tail(nullptr), m_sq_flags(nullptr), m_sq_array(nullptr), m_sq_mask(0), m_sq_entries(0), m_cq_head(nullptr), m_cq_tail(nullptr), m_cq_mask(0), m_cqes(nullptr), m_sq_local_tail(0), m_sq_queued(0), m_buf_ring(nullptr), m_buf_ring_size(0), m_bufs(nullptr), m_buf_tail(0), m_inflight(0), m_stopping(false)
+{
+}
+
+CUringEngine::~CUringEngine()
+{
+    stop();
+}
+
+bool CUringEngine::start(const event_type<event_base>& base, int bev_opts)
+{
+    assert(m_ring_fd < 0);
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+    m_ring_fd = uring_setup(sq_entries, &params);
+    if (m_ring_fd < 0) {
+        DEBUG_PRINT(LOGWARN, "io_uring_setup failed, error:", errno);
+        return false;
+    }
+    // Without this, completions could be dropped when the ring is full.
+    if ((params.features & IORING_FEAT_NODROP) == 0) {
+        unmap();
+        return false;
+    }
+
+    m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+        m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+    m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ptr == MAP_FAILED) {
+        unmap();
+        return false;
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+        m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+        if (m_cq_ptr == MAP_FAILED) {
+            unmap();
+            return false;
+        }
+    }
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        unmap();
+        return false;
+    }
+    m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+    unsigned char* sq = static_cast<unsigned char*>(m_sq_ptr);
+    unsigned char* cq = static_cast<unsigned char*>(m_cq_ptr != MAP_FAILED ? m_cq_ptr : m_sq_ptr);
+    m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sq_flags = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+    m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sq_entries = params.sq_entries;
+    m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    m_sq_local_tail = *m_sq_tail;
+    m_sq_queued = 0;
+
+    m_buf_ring_size = buf_count * sizeof(io_uring_buf);
+    void* buf_ring = mmap(nullptr, m_buf_ring_size + buf_count * buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        unmap();
+        return false;
+    }
+    m_buf_ring = static_cast<io_uring_buf_ring*>(buf_ring);
+    m_bufs = static_cast<unsigned char*>(buf_ring) + m_buf_ring_size;
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uintptr_t>(m_buf_ring);
+    reg.ring_entries = buf_count;
+    reg.bgid = buf_group;
+    if (uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        DEBUG_PRINT(LOGWARN, "io_uring buffer ring registration failed, error:", errno);
+        unmap();
+        return false;
+    }
+    m_buf_tail = 0;
+    for (unsigned i = 0; i < buf_count; i++)
+        recycle(static_cast<unsigned short>(i));
+    publish_buffers();
+
+    m_base = &base;
+    m_bev_opts = bev_opts;
+    m_inflight = 0;
+    m_stopping = false;
+    m_ring_event.reset(base, m_ring_fd, EV_READ | EV_PERSIST, std::bind(&CUringEngine::reap, this));
+    m_ring_event.add(nullptr);
+    m_submit_event.reset(base, -1, 0, std::bind(&CUringEngine::submit, this));
+    m_pending_event.reset(base, -1, 0, std::bind(&CUringEngine::run_pending, this));
+    return true;
+}
+
+void CUringEngine::stop()
+{
+    if (m_ring_fd < 0)
+        return;
+    m_stopping = true;
+    m_ring_event.free();
+    m_submit_event.free();
+    m_pending_event.free();
+
+    // Nothing runs on the base any more, so wait here for everything still in
+    // progress to be cancelled.
+    if (m_inflight > 0) {
+        io_uring_sqe* sqe;
+        while ((sqe = get_sqe()) == nullptr) {
+            uring_enter(m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+            reap();
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = OP_CANCEL;
+        for (CUringSocket* sock : m_sockets)
+            shutdown(sock->m_fd, SHUT_RDWR);
+        submit();
+        while (m_inflight > 0) {
+            uring_enter(m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+            reap();
+        }
+    }
+
+    for (CUringSocket* sock : m_sockets)
+        delete sock;
+    m_sockets.clear();
+    m_to_start.clear();
+    m_to_close.clear();
+    for (CUringAcceptor* acceptor : m_acceptors)
+        delete acceptor;
+    m_acceptors.clear();
+    unmap();
+    m_base = nullptr;
+    m_stopping = false;
+}
+
+bool CUringEngine::running() const
+{
+    return m_ring_fd >= 0;
+}
+
+void CUringEngine::unmap()
+{
+    if (m_buf_ring != nullptr)
+        munmap(m_buf_ring, m_buf_ring_size + buf_count * buf_size);
+    if (m_sqes != nullptr)
+        munmap(m_sqes, m_sqes_size);
+    if (m_cq_ptr != MAP_FAILED)
+        munmap(m_cq_ptr, m_cq_size);
+    if (m_sq_ptr != MAP_FAILED)
+        munmap(m_sq_ptr, m_sq_size);
+    if (m_ring_fd >= 0)
+        ::close(m_ring_fd);
+    m_buf_ring = nullptr;
+    m_bufs = nullptr;
+    m_sqes = nullptr;
+    m_cq_ptr = MAP_FAILED;
+    m_sq_ptr = MAP_FAILED;
+    m_ring_fd = -1;
+}
+
+event_type<bufferevent> CUringEngine::wrap(evutil_socket_t sock, int linger_seconds)
+{
+    assert(running());
+    bufferevent* pair[2];
+    int ret = bufferevent_pair_new(*m_base, m_bev_opts, pair);
+    assert(ret == 0);
+    (void)ret;
+    CUringSocket* state = new CUringSocket(*this, sock, pair[1], linger_seconds);
+    {
+#ifndef NO_THREADS
+        std::lock_guard<std::mutex> lock(m_sockets_mutex);
+#endif
+        m_sockets.insert(state);
+        m_to_start.push_back(state);
+    }
+    m_pending_event.active();
+    return event_type<bufferevent>(pair[0]);
+}
+
+void CUringEngine::release(event_type<bufferevent>& bev)
+{
+    if (!bev)
+        return;
+    // Anything the engine hasn't taken yet goes with the bufferevent.
+    bufferevent_lock(bev);
+    bufferevent* partner = bufferevent_pair_get_partner(bev);
+    void* ctx = nullptr;
+    if (partner != nullptr)
+        bufferevent_getcb(partner, nullptr, nullptr, nullptr, &ctx);
+    bufferevent_unlock(bev);
+    bev.free();
+    if (ctx != nullptr) {
+        CUringSocket* sock = static_cast<CUringSocket*>(ctx);
+        sock->m_engine.closing(sock);
+    }
+}
+
+void CUringEngine::closing(CUringSocket* sock)
+{
+    {
+#ifndef NO_THREADS
+        std::lock_guard<std::mutex> lock(m_sockets_mutex);
+#endif
+        m_to_close.push_back(sock);
+    }
+    m_pending_event.active();
+}
+
+// Start and close sockets from the engine's thread. Everything the engine
+// does with a socket happens there, and libevent's deferred callbacks aren't
+// used for this, so that nothing is left holding on to a bufferevent if the
+// base stops first.
+void CUringEngine::run_pending()
+{
+    std::vector<CUringSocket*> to_start;
+    std::vector<CUringSocket*> to_close;
+    {
+#ifndef NO_THREADS
+        std::lock_guard<std::mutex> lock(m_sockets_mutex);
+#endif
+        to_start.swap(m_to_start);
+        to_close.swap(m_to_close);
+    }
+    for (CUringSocket* sock : to_start) {
+        sock->recv();
+        sock->send();
+    }
+    for (CUringSocket* sock : to_close) {
+        sock->close();
+        if (sock->done())
+            forget(sock);
+    }
+}
+
+void CUringEngine::forget(CUringSocket* sock)
+{
+    {
+#ifndef NO_THREADS
+        std::lock_guard<std::mutex> lock(m_sockets_mutex);
+#endif
+        m_sockets.erase(sock);
+    }
+    delete sock;
+}
+
+CUringAcceptor* CUringEngine::listen(evutil_socket_t sock, AcceptFunc&& func)
+{
+    assert(running());
+    CUringAcceptor* acceptor = new CUringAcceptor(*this, sock, std::move(func));
+    m_acceptors.insert(acceptor);
+    acceptor->accept();
+    return acceptor;
+}
+
+void CUringEngine::pause(CUringAcceptor* acceptor, bool paused)
+{
+    acceptor->m_paused = paused;
+    if (paused && acceptor->m_accepting)
+        cancel(make_user_data(acceptor, OP_ACCEPT));
+    else if (!paused && !acceptor->m_accepting)
+        acceptor->accept();
+}
+
+void CUringEngine::unlisten(CUringAcceptor* acceptor)
+{
+    acceptor->m_closing = true;
+    // Failing that, shutting the socket down ends the accept too.
+    if (acceptor->m_accepting && !cancel(make_user_data(acceptor, OP_ACCEPT)))
+        shutdown(acceptor->m_fd, SHUT_RDWR);
+    if (acceptor->done()) {
+        m_acceptors.erase(acceptor);
+        delete acceptor;
+    }
+}
+
+// The kernel reads submissions when io_uring_enter is called, so they are
+// queued up and handed over together once the loop has run everything else
+// that was ready.
+//
+// A full queue is submitted to make room. The kernel may take fewer than were
+// queued, or none at all while its completion queue has overflowed, and a slot
+// it hasn't read yet is never reused. Returns nullptr if none could be freed,
+// and the caller fails its operation.
+io_uring_sqe* CUringEngine::get_sqe()
+{
+    while (m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+        const unsigned queued = m_sq_queued;
+        submit();
+        if (m_sq_queued == queued)
+            return nullptr;
+    }
+    const unsigned index = m_sq_local_tail & m_sq_mask;
+    io_uring_sqe* sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[index] = index;
+    m_sq_local_tail++;
+    if (m_sq_queued++ == 0 && !m_stopping)
+        m_submit_event.active();
+    m_inflight++;
+    return sqe;
+}
+
+// A cancelled operation still completes, with -ECANCELED, and its owner
+// carries on from there. Should the owner have gone and its address been
+// reused in the meantime, the same happens to the new owner. Returns false if
+// the cancellation couldn't be queued.
+bool CUringEngine::cancel(uint64_t user_data)
+{
+    io_uring_sqe* sqe = get_sqe();
+    if (sqe == nullptr)
+        return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data;
+    sqe->user_data = OP_CANCEL;
+    return true;
+}
+
+void CUringEngine::submit()
+{
+    if (m_sq_queued == 0)
+        return;
+    __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+    const int ret = uring_enter(m_ring_fd, m_sq_queued, 0, 0);
+    if (ret > 0)
+        m_sq_queued -= ret;
+    // Try the rest again on the next turn of the loop.
+    if (m_sq_queued != 0 && !m_stopping)
+        m_submit_event.active();
+}
+
+void CUringEngine::reap()
+{
+    while (true) {
+        unsigned head = *m_cq_head;
+        const unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            // Completions that didn't fit wait in the kernel until asked for.
+            if ((__atomic_load_n(m_sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) == 0)
+                break;
+            uring_enter(m_ring_fd, 0, 0, IORING_ENTER_GETEVENTS);
+            if (__atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE) == head)
+                break;
+            continue;
+        }
+        while (head != tail) {
+            const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+            const uint64_t user_data = cqe.user_data;
+            const int res = cqe.res;
+            const unsigned flags = cqe.flags;
+            __atomic_store_n(m_cq_head, ++head, __ATOMIC_RELEASE);
+            complete(user_data, res, flags);
+        }
+    }
+    // Hand back the buffers that were emptied before anything is resubmitted.
+    publish_buffers();
+    if (!m_stopping)
+        submit();
+}
+
+void CUringEngine::complete(uint64_t user_data, int res, unsigned flags)
+{
+    const bool last = (flags & IORING_CQE_F_MORE) == 0;
+    if (last) {
+        assert(m_inflight > 0);
+        m_inflight--;
+    }
+    void* owner = reinterpret_cast<void*>(static_cast<uintptr_t>(user_data & ~op_mask));
+    switch (user_data & op_mask) {
+    case OP_RECV:
+    case OP_SEND: {
+        CUringSocket* sock = static_cast<CUringSocket*>(owner);
+        if ((user_data & op_mask) == OP_RECV)
+            sock->on_recv(res, flags, last);
+        else
+            sock->on_send(res);
+        if (sock->done() && !m_stopping)
+            forget(sock);
+        break;
+    }
+    case OP_ACCEPT: {
+        CUringAcceptor* acceptor = static_cast<CUringAcceptor*>(owner);
+        acceptor->on_accept(res, last);
+        if (acceptor->done() && !m_stopping) {
+            m_acceptors.erase(acceptor);
+            delete acceptor;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+unsigned char* CUringEngine::buffer(unsigned short bid) const
+{
+    return m_bufs + static_cast<size_t>(bid) * buf_size;
+}
+
+// io_uring_buf_ring's members are only laid out as the kernel expects in C, so
+// the entries are addressed directly. The ring's tail overlays the first
+// entry's reserved field, so only the other fields are written.
+void CUringEngine::recycle(unsigned short bid)
+{
+    io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(m_buf_ring)[m_buf_tail & (buf_count - 1)];
+    buf.addr = reinterpret_cast<uintptr_t>(buffer(bid));
+    buf.len = buf_size;
+    buf.bid = bid;
+    m_buf_tail++;
+}
+
+void CUringEngine::publish_buffers()
+{
+    __atomic_store_n(&reinterpret_cast<io_uring_buf*>(m_buf_ring)->resv, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+#else // USE_IO_URING
+
+CUringEngine::CUringEngine()
+    : m_ring_fd(-1), m_bev_opts(0), m_base(nullptr), m_sq_ptr(nullptr), m_sq_size(0), m_cq_ptr(nullptr), m_cq_size(0), m_sqes(nullptr), m_sqes_size(0), m_sq_head(nullptr), m_sq_tail(nullptr), m_sq_flags(nullptr), m_sq_array(nullptr), m_sq_mask(0), m_sq_entries(0), m_cq_head(nullptr), m_cq_tail(nullptr), m_cq_mask(0), m_cqes(nullptr), m_sq_local_tail(0), m_sq_queued(0), m_buf_ring(nullptr), m_buf_ring_size(0), m_bufs(nullptr), m_buf_tail(0), m_inflight(0), m_stopping(false)
+{
+}
+
+CUringEngine::~CUringEngine() = default;
+
+bool CUringEngine::start(const event_type<event_base>& /*unused*/, int /*unused*/)
+{
+    DEBUG_PRINT(LOGWARN, "io_uring is not supported on this platform");
+    return false;
+}
+
+void CUringEngine::stop()
+{
+}
+
+bool CUringEngine::running() const
+{
+    return false;
+}
+
+event_type<bufferevent> CUringEngine::wrap(evutil_socket_t /*unused*/, int /*unused*/)
+{
+    assert(false);
+    return event_type<bufferevent>();
+}
+
+void CUringEngine::release(event_type<bufferevent>& bev)
+{
+    bev.free();
+}
+
+CUringAcceptor* CUringEngine::listen(evutil_socket_t /*unused*/, AcceptFunc&& /*unused*/)
+{
+    assert(false);
+    return nullptr;
+}
+
+void CUringEngine::pause(CUringAcceptor* /*unused*/, bool /*unused*/)
+{
+}
+
+void CUringEngine::unlisten(CUringAcceptor* /*unused*/)
+{
+}
+
+#endif // USE_IO_URING
@@ -0,0 +1,146 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef LIBBTCNET_SRC_URING_H
+#define LIBBTCNET_SRC_URING_H
+
+#include "event.h"
+#include "eventtypes.h"
+
+#include <event2/util.h>
+
+#include <functional>
+#include <set>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#ifndef NO_THREADS
+#include <mutex>
+#endif
+
+struct bufferevent;
+struct event_base;
+struct sockaddr;
+
+class CUringSocket;
+class CUringAcceptor;
+
+// Socket I/O for one event base through a Linux io_uring rather than through
+// readiness notifications. Reads are multishot receives into a ring of
+// buffers provided up front, writes are gathered into one sendmsg per
+// completion, and accepts are multishot too. Everything queued while the loop
+// runs is submitted with a single io_uring_enter.
+//
+// Connections keep using a bufferevent: the engine owns the far end of a
+// bufferevent pair and moves data between it and the socket, so that framing,
+// watermarks and timeouts work exactly as they do for a socket bufferevent.
+// Rate limits aren't applied.
+//
+// Sockets and listeners may be handed over from any thread, but all I/O
+// happens on the engine's base.
+class CUringEngine
+{
+public:
+    typedef std::function<void(evutil_socket_t sock, sockaddr* addr, int addrlen)> AcceptFunc;
+
+    CUringEngine();
+    ~CUringEngine();
+
+    // False if io_uring isn't available here, in which case the engine stays
+    // stopped and mustn't be used.
+    bool start(const event_type<event_base>& base, int bev_opts);
+    // Close everything, without waiting for unsent data.
+    void stop();
+    bool running() const;
+
+    // Take over a connected socket. Returns the bufferevent to use in its
+    // place, which must be let go of with release() rather than freed.
+    event_type<bufferevent> wrap(evutil_socket_t sock, int linger_seconds);
+    // Free a bufferevent returned by wrap. As when closing a socket, what the
+    // engine has already taken from its output is still sent, for up to the
+    // linger time given to wrap (or for as long as it takes, if 0).
+    static void release(event_type<bufferevent>& bev);
+
+    // Accept from a listening socket, which the engine then owns. Event
+    // thread only, and func is called from there too.
+    CUringAcceptor* listen(evutil_socket_t sock, AcceptFunc&& func);
+    // Stop accepting for a while, or carry on. Also event thread only.
+    void pause(CUringAcceptor* acceptor, bool paused);
+    // Stop accepting and close the socket. Also event thread only.
+    void unlisten(CUringAcceptor* acceptor);
+
+private:
+    friend class CUringSocket;
+    friend class CUringAcceptor;
+
+    struct io_uring_sqe* get_sqe();
+    bool cancel(uint64_t user_data);
+    void submit();
+    void reap();
+    void complete(uint64_t user_data, int res, unsigned flags);
+    unsigned char* buffer(unsigned short bid) const;
+    void recycle(unsigned short bid);
+    void publish_buffers();
+    void closing(CUringSocket* sock);
+    void run_pending();
+    void forget(CUringSocket* sock);
+    void unmap();
+
+    int m_ring_fd;
+    int m_bev_opts;
+    const event_type<event_base>* m_base;
+
+    // The shared rings, mapped from the kernel.
+    void* m_sq_ptr;
+    size_t m_sq_size;
+    void* m_cq_ptr;
+    size_t m_cq_size;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sqes_size;
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned* m_sq_flags;
+    unsigned* m_sq_array;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    struct io_uring_cqe* m_cqes;
+    unsigned m_sq_local_tail;
+    // Queued, but not yet submitted.
+    unsigned m_sq_queued;
+
+    // Received data lands in these, and is copied out at once so that they
+    // can be handed straight back.
+    struct io_uring_buf_ring* m_buf_ring;
+    size_t m_buf_ring_size;
+    unsigned char* m_bufs;
+    unsigned short m_buf_tail;
+
+    // Operations which have yet to produce their last completion.
+    size_t m_inflight;
+    bool m_stopping;
+
+    CEvent m_ring_event;
+    CEvent m_submit_event;
+    CEvent m_pending_event;
+
+    // Sockets are handed over and let go of from other threads, and started
+    // and closed from the engine's by m_pending_event. All guarded by
+    // m_sockets_mutex.
+    std::set<CUringSocket*> m_sockets;
+    std::vector<CUringSocket*> m_to_start;
+    std::vector<CUringSocket*> m_to_close;
+#ifndef NO_THREADS
+    std::mutex m_sockets_mutex;
+#endif
+    std::set<CUringAcceptor*> m_acceptors;
+
+    CUringEngine(const CUringEngine&) = delete;
+    CUringEngine& operator=(const CUringEngine&) = delete;
+};
+
+#endif // LIBBTCNET_SRC_URING_H
@@ -0,0 +1,168 @@
+// Copyright (c) 2016 Cory Fields
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Checks each find_bytes implementation the CPU can run against a plain
+// search, over flat buffers and over buffers split into chains.
+
+#include "src/eventtypes.h"
+#include "src/scan.h"
+
+#include <event2/buffer.h>
+
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+namespace
+{
+typedef std::vector<unsigned char> bytes;
+
+size_t find_naive(const unsigned char* data, size_t len, const unsigned char* needle, size_t needle_len)
+{
+    for (size_t i = 0; i + needle_len <= len; ++i) {
+        if (memcmp(data + i, needle, needle_len) == 0)
+            return i;
+    }
+    return len;
+}
+
+class CScanTest
+{
+public:
+    CScanTest(const char* name) : m_name(name), m_rng(1), m_checks(0), m_failures(0) {}
+
+    void Run()
+    {
+        CheckEdges();
+        CheckRandom();
+        CheckChains();
+        printf("%s: %zu checks, %zu failures\n", m_name, m_checks, m_failures);
+    }
+
+    bool Passed() const
+    {
+        return m_failures == 0;
+    }
+
+private:
+    void Check(const char* what, size_t got, size_t want, size_t len, size_t needle_len)
+    {
+        ++m_checks;
+        if (got != want && m_failures++ < 10)
+            printf("%s: %s: found %zu, expected %zu (len %zu, needle %zu)\n", m_name, what, got, want, len, needle_len);
+    }
+
+    void CheckFlat(const bytes& data, const bytes& needle)
+    {
+        const size_t want = find_naive(data.data(), data.size(), needle.data(), needle.size());
+        Check("flat", find_bytes(data.data(), data.size(), needle.data(), needle.size()), want, data.size(), needle.size());
+    }
+
+    // Only the needle's first and last bytes are compared a vector at a time,
+    // so plant it at every offset around the 16 and 32 byte steps, with
+    // decoys sharing its first and last bytes just before it.
+    void CheckEdges()
+    {
+        const size_t needle_lens[] = {2, 3, 4, 5, 8, 15, 16, 17, 31, 32, 33, 64};
+        for (size_t needle_len : needle_lens) {
+            bytes needle(needle_len);
+            for (size_t i = 0; i < needle_len; ++i)
+                needle[i] = static_cast<unsigned char>(0x80 + i);
+            for (size_t pos = 0; pos < 100; ++pos) {
+                for (size_t extra = 0; extra < 40; extra += 13) {
+                    bytes data(pos + needle_len + extra, 0);
+                    if (pos >= needle_len) {
+                        data[pos - needle_len] = needle.front();
+                        data[pos - 1] = needle.back();
+                    }
+                    memcpy(&data[pos], needle.data(), needle_len);
+                    CheckFlat(data, needle);
+                    // And the same with the needle broken, so that there is
+                    // no match at all.
+                    if (needle_len > 2) {
+                        data[pos + needle_len / 2] ^= 1;
+                        CheckFlat(data, needle);
+                    }
+                }
+            }
+        }
+    }
+
+    // A small alphabet gives plenty of near misses.
+    bytes RandomBytes(size_t len, unsigned alphabet)
+    {
+        bytes ret(len);
+        for (auto& b : ret)
+            b = static_cast<unsigned char>(m_rng() % alphabet);
+        return ret;
+    }
+
+    bytes RandomNeedle(const bytes& data, unsigned alphabet)
+    {
+        const size_t needle_len = 1 + m_rng() % 70;
+        if (data.size() >= needle_len && m_rng() % 2 == 0) {
+            const size_t at = m_rng() % (data.size() - needle_len + 1);
+            return bytes(data.begin() + at, data.begin() + at + needle_len);
+        }
+        return RandomBytes(needle_len, alphabet);
+    }
+
+    void CheckRandom()
+    {
+        for (int round = 0; round < 20000; ++round) {
+            const unsigned alphabet = 2 + m_rng() % 3;
+            const bytes data = RandomBytes(m_rng() % 300, alphabet);
+            CheckFlat(data, RandomNeedle(data, alphabet));
+        }
+    }
+
+    // Each piece added by reference gets its own chain, so matches can span
+    // any number of chain boundaries.
+    void CheckChains()
+    {
+        for (int round = 0; round < 5000; ++round) {
+            const unsigned alphabet = 2 + m_rng() % 3;
+            const bytes data = RandomBytes(m_rng() % 600, alphabet);
+            const bytes needle = RandomNeedle(data, alphabet);
+            event_type<evbuffer> input(evbuffer_new());
+            for (size_t at = 0; at < data.size();) {
+                const size_t piece = std::min<size_t>(data.size() - at, 1 + m_rng() % 80);
+                evbuffer_add_reference(input, data.data() + at, piece, nullptr, nullptr);
+                at += piece;
+            }
+            const size_t from = data.empty() ? 0 : m_rng() % data.size();
+            size_t want = find_naive(data.data() + from, data.size() - from, needle.data(), needle.size());
+            want = want == data.size() - from ? data.size() : from + want;
+            Check("chains", find_bytes(input, from, needle.data(), needle.size()), want, data.size(), needle.size());
+        }
+    }
+
+    const char* m_name;
+    std::mt19937 m_rng;
+    size_t m_checks;
+    size_t m_failures;
+};
+} // namespace
+
+int main()
+{
+    const struct {
+        find_impl impl;
+        const char* name;
+    } impls[] = {{FIND_SCALAR, "scalar"}, {FIND_SSE2, "sse2"}, {FIND_AVX2, "avx2"}};
+
+    bool passed = true;
+    for (const auto& impl : impls) {
+        if (!use_find_impl(impl.impl)) {
+            printf("%s: not supported, skipped\n", impl.name);
+            continue;
+        }
+        CScanTest test(impl.name);
+        test.Run();
+        passed = passed && test.Passed();
+    }
+    return passed ? 0 : 1;
+}